@@ -1,4 +1,4 @@
-#include "msp430fr2476.h"
+#include "hal.h"
 #include "interrupts.h"
 #include "adc.h"
 #include "acc.h"
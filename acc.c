@@ -1,10 +1,13 @@
-#include "msp430fr2476.h"
+#include "hal.h"
 #include <stdbool.h>
 #include "utypes.h"
 #include "spi0.h"
 #include "utils.h"
 #include "interrupts.h"
 #include "leds.h"
+#include "dsp.h"
+#include "handoff.h"
+#include "acc.h"
 
 #define ACC_CS BIT1
 #define ACC_SELECT() (P3OUT &= ~ACC_CS)
@@ -16,6 +19,27 @@
 #define DATA_SIZE_INT 3                 //3 байта данные акселерометра
 #define DATA_SIZE_LONG 3                 //3 байта данные акселерометра
 
+/*
+ * Акселерометр работает в FIFO (continuous mode): samples (1.1 кГц) копятся в FIFO акселерометра,
+ * а прерывание INT1 приходит только когда в FIFO набралось ACC_FIFO_THRESHOLD samples.
+ * FIFO вычитывается одним burst чтением SPI0 (при включенном FIFO адрес после 0x2D
+ * возвращается на 0x28 и следующее чтение берет следующий sample)
+ * по прерыванию и перед формированием каждого пакета.
+ */
+#define ACC_FIFO_DEPTH 32
+#define ACC_FIFO_THRESHOLD 16           //watermark: 16 samples на одно пробуждение вместо одного
+#define ACC_FIFO_SRC_COUNT 0x3F         //FSS5..FSS0 - число samples в FIFO
+#define ACC_READ 0x80                   //бит чтения в адресе регистра
+#define ACC_CTRL_REG4 0x23
+#define ACC_FIFO_EN 0x02
+#define ACC_FIFO_CTRL 0x2E
+#define ACC_FIFO_SRC 0x2F
+#define ACC_FIFO_BYPASS 0x00
+#define ACC_FIFO_CONTINUOUS 0xC0
+
+#define ACC_SAMPLE_SIZE 6               //x, y, z по 2 байта
+#define ACC_MAX_AVERAGED 64             //больше samples на пакет не усредняем (ADS >= 160 SPS дает <= 64)
+
 static uchar data_size_char = 0;        //The total size of a data batch for accelerometers (in bytes)
 static uchar data_size_int = 0;         //The total size of a data batch for accelerometers
 static uchar acc_data_address[1] = {0};
@@ -40,30 +64,48 @@ static uchar acc_startup_drdy_mask[2] = {0x13, 0x08};   //Giving ACC Gyr time to
 static uchar acc2_reset[2] = {0x20, 0x04};
 static uchar acc2_who[2] = {0x8f, 0x00};
 static uchar acc2_power[2] ={0x20 ,0xC3};               //Switch ACC on, BDU (prevent data corruption when reading just one byte
-static uchar acc2_int1[2] = {0x21, 0x80};               //Включаем прерывание на пин INT1 при готовности данных
+static uchar acc2_int1[2] = {0x21, 0x08};               //Включаем прерывание на пин INT1 при достижении watermark FIFO
 //static uchar acc2_int2[2] = {0x22, 0x80};             //Включаем прерывание на пин INT2 при готовности данных
 static uchar acc2_SPI_speed[2] = {0x24, 1};             //Оптимизируем SPI на акселерометре для скоростей > 6Mhz
 
 
-//Двойной буфер
-static int double_buffer1[DATA_SIZE_INT];
-static int double_buffer2[DATA_SIZE_INT];
-static long accumulator1[DATA_SIZE_LONG];
-static long accumulator2[DATA_SIZE_LONG];
-static long* accumulators[2] = {accumulator1, accumulator2};
-static long* current_accumulator = accumulator1;
-static uchar ticker = 0;
-static int* data_accumulator_fill = double_buffer1;
-static int* data_accumulator_ready = double_buffer2;
+/*
+ * FIFO вычитывается только из главного цикла (acc_handle_interrupt() и acc_get_data()),
+ * поэтому аккумулятор один, двойной буфер не нужен
+ */
+static long accumulator[DATA_SIZE_LONG];
 //Будем считать сколько сэмплов сконвертировано за батч, чтобы потом делить
-static unsigned long sample_counter1 = 1;
-static unsigned long sample_counter2 = 1;
-static unsigned long* sample_counters[2]= {&sample_counter1, &sample_counter2};
-static unsigned long* current_sample_counter = &sample_counter1;
-static uint data_prepared[DATA_SIZE_INT];
-static uint data_display[DATA_SIZE_INT]; // actually triple buffer
+static uchar sample_counter;
+static unsigned short data_prepared[DATA_SIZE_INT]; //short а не int, чтобы размер был 2 байта и в host сборке
+
+static short fifo_data[ACC_FIFO_DEPTH * DATA_SIZE_INT];  //samples вычитанные из FIFO за один раз
 
-static volatile bool acc_interrupt_flag;
+//Все samples пакета как есть (x, y, z по 2 байта little endian), если включен acc_set_raw_output()
+static bool raw_output;
+static uchar raw_data[ACC_RAW_MAX_SAMPLES * ACC_SAMPLE_SIZE];
+static uchar raw_count;
+
+/*
+ * 2^31 / n (Q31) для деления суммы на число samples умножением (dsp_multiply_q31, MPY32).
+ * Для n = 1 берем 0x7FFFFFFF: ошибка меньше 2^-31, после округления результат точный
+ */
+static const long reciprocals_q31[ACC_MAX_AVERAGED + 1] = {
+    0, 0x7FFFFFFF, 0x40000000, 0x2AAAAAAB, 0x20000000, 0x1999999A,
+    0x15555555, 0x12492492, 0x10000000, 0x0E38E38E, 0x0CCCCCCD, 0x0BA2E8BA,
+    0x0AAAAAAB, 0x09D89D8A, 0x09249249, 0x08888889, 0x08000000, 0x07878788,
+    0x071C71C7, 0x06BCA1AF, 0x06666666, 0x06186186, 0x05D1745D, 0x0590B216,
+    0x05555555, 0x051EB852, 0x04EC4EC5, 0x04BDA12F, 0x04924925, 0x0469EE58,
+    0x04444444, 0x04210842, 0x04000000, 0x03E0F83E, 0x03C3C3C4, 0x03A83A84,
+    0x038E38E4, 0x03759F23, 0x035E50D8, 0x03483483, 0x03333333, 0x031F3832,
+    0x030C30C3, 0x02FA0BE8, 0x02E8BA2F, 0x02D82D83, 0x02C8590B, 0x02B93105,
+    0x02AAAAAB, 0x029CBC15, 0x028F5C29, 0x02828283, 0x02762762, 0x026A439F,
+    0x025ED098, 0x0253C825, 0x02492492, 0x023EE090, 0x0234F72C, 0x022B63CC,
+    0x02222222, 0x02192E2A, 0x02108421, 0x02082082, 0x02000000
+};
+
+// PORT2_ISR публикует каждый watermark, main loop вычитывает FIFO один раз на все накопившиеся
+static handoff acc_watermarks;
+static uint acc_watermarks_taken;
 
 static void acc_write_command(uchar* data, int data_size) {
     ACC_SELECT();
@@ -84,6 +126,21 @@ static void acc_read_registers(uchar start_address, uchar* read_buffer, int data
     ACC_DESELECT();
 }
 
+static void acc_write_register(uchar address, uchar value) {
+    uchar command[2];
+    command[0] = address;
+    command[1] = value;
+    acc_write_command(command, 2);
+}
+
+/*
+ * Очищает FIFO (переходом в bypass) и снова запускает его в continuous mode
+ */
+static void acc_restart_fifo() {
+    acc_write_register(ACC_FIFO_CTRL, ACC_FIFO_BYPASS);
+    acc_write_register(ACC_FIFO_CTRL, ACC_FIFO_CONTINUOUS | ACC_FIFO_THRESHOLD);
+}
+
 void acc_init(){
     spi0_init();
     //ACC пины: 2.2 - INT1, 2.7 - INT2, CS - 3.1
@@ -104,6 +161,11 @@ void acc_init(){
     //wait(1000);
     acc_write_command(acc2_SPI_speed, 2);
     acc_write_command(acc2_int1, 2);
+    //Включаем FIFO, остальные биты CTRL_REG4 оставляем как есть
+    uchar ctrl_reg4;
+    acc_read_registers(ACC_READ | ACC_CTRL_REG4, &ctrl_reg4, 1);
+    acc_write_register(ACC_CTRL_REG4, ctrl_reg4 | ACC_FIFO_EN);
+    acc_restart_fifo();
     acc_write_command(acc2_power, 2);
     acc_write_command(acc2_who, 2);
     acc_write_command(acc2_who, 2);
@@ -122,44 +184,100 @@ void acc_stop_reading(){
     P2IE &= ~(INT1 /*+ INT2*/);         //Выключаем прерывание когда у акселерометра готовы данные
 }
 
+/*
+ * Вычитывает все samples из FIFO одним burst чтением и добавляет их в текущий аккумулятор
+ */
+static void acc_read_fifo() {
+    uchar fifo_src;
+    acc_read_registers(ACC_READ | ACC_FIFO_SRC, &fifo_src, 1);
+    int count = fifo_src & ACC_FIFO_SRC_COUNT;
+    if(count > ACC_FIFO_DEPTH) {
+        count = ACC_FIFO_DEPTH;
+    }
+    if(count == 0) {
+        return;
+    }
+    acc_read_registers(acc_data_address[0], (unsigned char *)fifo_data, count * data_size_char);
+    short* sample = fifo_data;
+    for(int n = 0; n < count; n++) {
+        if(sample_counter < ACC_MAX_AVERAGED){
+            for(int i = 0; i < DATA_SIZE_LONG; i++){
+                accumulator[i] += (long)sample[i];
+            }
+            sample_counter++;
+        }
+        if(raw_output && raw_count < ACC_RAW_MAX_SAMPLES) {
+            uchar* raw_sample = (uchar*)sample;
+            uchar* raw = raw_data + raw_count * ACC_SAMPLE_SIZE;
+            for(int i = 0; i < ACC_SAMPLE_SIZE; i++) {
+                raw[i] = raw_sample[i];
+            }
+            raw_count++;
+        }
+        sample += DATA_SIZE_INT;
+    }
+}
+
+/*
+ * true - кроме среднего собирать все samples пакета для acc_get_raw_data()
+ */
+void acc_set_raw_output(bool enabled) {
+    raw_output = enabled;
+    raw_count = 0;
+}
+
 unsigned char* acc_get_data(){
     int i;
-    //Фиксируем текущий буфер
-    long* ready_accumulator = current_accumulator;
-    unsigned long ready_sample_counter = *current_sample_counter;
-    //Обнуляем счетчик сэмплов
-    *current_sample_counter = 1;
-    //Меняем двойной буфер
-    current_accumulator = accumulators[(ticker++) & 1];
-    current_sample_counter = sample_counters[ticker & 1];
-    //Делаем данные беззнаковыми и делим на количество суммированных сэмплов
-    for(i = 0; i < data_size_int; i++){
-        //Количество сэмплов в пакете <= 23, но здесь ограничиваем 16ю
-        data_prepared[i] = (unsigned int)((ready_accumulator[i] / 16/*/ ready_sample_counter*/) + 32768);
+    //Забираем из FIFO samples пришедшие с последнего прерывания, чтобы они попали в этот пакет
+    acc_read_fifo();
+    //Делаем данные беззнаковыми и делим на количество суммированных сэмплов (умножением на 1/n).
+    //Если за пакет не пришло ни одного sample оставляем прошлое значение
+    if(sample_counter > 0) {
+        long reciprocal = reciprocals_q31[sample_counter];
+        for(i = 0; i < data_size_int; i++){
+            data_prepared[i] = (unsigned short)(dsp_multiply_q31(accumulator[i], reciprocal) + 32768);
+        }
     }
     //Обнуляем аккумулятор
-    for(int i = 0; i < DATA_SIZE_LONG; i++){
-        ready_accumulator[i] = 0;
+    for(i = 0; i < DATA_SIZE_LONG; i++){
+        accumulator[i] = 0;
     }
+    sample_counter = 0;
     return (unsigned char*) data_prepared;
 }
 
+/*
+ * Копирует в destination все samples собранные с прошлого вызова (по ACC_SAMPLE_SIZE байт,
+ * не больше ACC_RAW_MAX_SAMPLES) и возвращает их число.
+ * Вызывать после acc_get_data(), которая забирает из FIFO последние samples
+ */
+uchar acc_get_raw_data(uchar* destination) {
+    uchar count = raw_count;
+    uchar* raw = raw_data;
+    for(int i = count * ACC_SAMPLE_SIZE; i > 0; i--) {
+        *destination++ = *raw++;
+    }
+    raw_count = 0;
+    return count;
+}
+
 void acc_read(){
-    P2IE |= (INT1 /*+ INT2*/);          //Включаем прерывание когда у акселерометра готовы данные
+    //Старые samples из FIFO в запись не берем. Пустой FIFO гарантирует фронт на INT1 при достижении watermark
+    acc_restart_fifo();
+    for(int i = 0; i < DATA_SIZE_LONG; i++){
+        accumulator[i] = 0;
+    }
+    sample_counter = 0;
+    raw_count = 0;
+    handoff_consume(&acc_watermarks, &acc_watermarks_taken); //watermark прошлой записи не нужен, FIFO уже пуст
+    P2IFG &= ~(INT1);
+    P2IE |= (INT1 /*+ INT2*/);          //Включаем прерывание когда в FIFO акселерометра набрался watermark
 }
 
 
 void acc_handle_interrupt() {
-    if(acc_interrupt_flag) {
-        acc_interrupt_flag = false;
-        acc_read_registers(acc_data_address[0], (unsigned char *)double_buffer1, data_size_char);
-        for(int i = 0; i < DATA_SIZE_LONG; i++){
-            //Количество сэмплов в пакете <= 23, но здесь ограничиваем 16ю
-            if(*current_sample_counter <= 16){
-                current_accumulator[i] += (long)double_buffer1[i];
-            }
-        }
-        *current_sample_counter += 1;
+    if(handoff_consume(&acc_watermarks, &acc_watermarks_taken) > 0) {
+        acc_read_fifo();
     }
 }
 
@@ -168,7 +286,8 @@ void PORT2_ISR(void){
     switch(__even_in_range (P2IV, 0x10)){
     //INT1
     case 0x06:
-        acc_interrupt_flag = true;
+        handoff_write_begin(&acc_watermarks);
+        handoff_write_end(&acc_watermarks);
         break;
     //INT2
     case 0x10:
@@ -1,8 +1,11 @@
 #ifndef ACC_H
 #define ACC_H
 
+#include <stdbool.h>
 #include "utypes.h"
 
+#define ACC_RAW_MAX_SAMPLES 32          //samples акселерометра в одном пакете (PACKET_ACC_RAW)
+
 void acc_init();
 void acc_send(uchar* data, int data_size);
 void acc_test();
@@ -11,5 +14,7 @@ void acc_read();
 void acc_stop_reading();
 unsigned char* acc_get_data();
 void acc_handle_interrupt();
+void acc_set_raw_output(bool enabled);
+uchar acc_get_raw_data(uchar* destination);
 
 #endif //ACC_H
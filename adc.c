@@ -1,20 +1,70 @@
-#include "msp430fr2476.h"
+#include "hal.h"
+#include <stdbool.h>
 #include "interrupts.h"
+#include "utypes.h"
+#include "handoff.h"
+#include "adc.h"
 
-#define ADS_NUMBER_OF_CHANNELS 1
-#define CONVERSIONS_PER_BATCH 128
-
-static unsigned char adc_channels[2] = {6, 7}; //ADC channels for conversion
-static int adc_index = 0;
-// двойная буфферизация
-static unsigned long adc_accumulator_0[ADS_NUMBER_OF_CHANNELS];
-static unsigned long adc_accumulator_1[ADS_NUMBER_OF_CHANNELS];
-static unsigned long* adc_accumulators[2] = {adc_accumulator_0, adc_accumulator_1};
-static unsigned char i = 0;            //ADC accumulator iterator
-static unsigned char adc_accumulator_index = 0;
-static unsigned int adc_data_prepared[ADS_NUMBER_OF_CHANNELS];
-static unsigned long* adc_accumulator = adc_accumulator_0;
-static unsigned int adc_sum_cnt = 0;
+#define ADC_OUTPUT_SHIFT 3 // среднее 12 бит * 8: масштаб прежнего формата (сумма 128 измерений / 16)
+// батарейка через делитель на P1.7 (A7): вывод уже подключен к ADC, в серию Timer_B0 не входит
+#define BATTERY_ADC_CHANNEL 7
+#define ADC_DEFAULT_CHANNELS BIT6 // A6 (P1.6)
+#define ADC_CHANNEL_MASK ((1 << ADC_MAX_NUMBER_OF_CHANNELS) - 1)
+
+/*
+ * Серия - одно измерение всех каналов из adc_channel_mask по запуску от Timer_B0 (или от DRDY ADS, см. adc_sync_on()).
+ * Каналы серии ADC перебирает сам (ADCCONSEQ_1, sequence-of-channels): от ADCINCH = adc_highest_channel
+ * вниз до A0, каждое следующее преобразование начинается сразу за предыдущим (ADCMSC).
+ * Программа канал не переключает, прерывание только забирает ADCMEM0 (он у ADC один),
+ * а после adc_lowest_channel останавливает последовательность, чтобы не мерить каналы ниже.
+ * Каналы между ними которых нет в маске тоже меряются, но никуда не идут
+ */
+static uint adc_channel_mask = ADC_DEFAULT_CHANNELS;
+static uchar adc_highest_channel = 6;
+static uchar adc_lowest_channel = 6;
+static uchar adc_number_of_channels = 1;
+static volatile bool adc_scanning;    // серия идет (ADC_ISR ее заканчивает)
+static uchar adc_scan_channel;        // канал текущего преобразования серии (только ADC_ISR)
+static unsigned int adc_series_values[ADC_MAX_NUMBER_OF_CHANNELS]; // измерения текущей серии по номеру канала
+
+/*
+ * ADC_ISR публикует через adc_handoff суммы всех законченных серий (они только растут)
+ * и их число. adc_get_data() копирует их и берет разность с прошлой копией,
+ * так ни прерывание, ни main loop ничего не обнуляют и не переключают
+ */
+static unsigned long adc_sums[ADC_MAX_NUMBER_OF_CHANNELS];
+static unsigned int adc_series;
+static handoff adc_handoff;
+static unsigned long adc_sums_taken[ADC_MAX_NUMBER_OF_CHANNELS]; // что забрал прошлый adc_get_data()
+static unsigned int adc_series_taken;
+static unsigned short adc_data_prepared[ADC_MAX_NUMBER_OF_CHANNELS]; //short а не int, чтобы размер был 2 байта и в host сборке
+
+/*
+ * Синхронный режим (adc_sync_on()): серию запускает прерывание DRDY ADS (adc_convert_begin() как его callback),
+ * поэтому серия n снята в момент измерения ADS n. Запуски нумеруются (adc_triggers), и ADC_ISR кладет
+ * каждую серию в кольцо adc_sync_ring с номером ее запуска, откуда adc_get_sync_series()
+ * забирает ее для измерения ADS с тем же номером. Кольцо пишется под тем же adc_handoff что и суммы.
+ * Если запуск пропущен (ADC был занят), в кольце остается старый номер и серии для этого измерения нет
+ */
+#define ADC_SYNC_RING_SIZE 8 // main loop может отстать от DRDY на 8 измерений (16 мс при 500 SPS)
+#define ADC_SYNC_WAIT_LIMIT 0xFFFF // сколько раз проверять конец серии в adc_get_sync_series()
+
+typedef struct {
+    unsigned int trigger;                                // номер запуска серии
+    unsigned short values[ADC_MAX_NUMBER_OF_CHANNELS];   // каналы серии по возрастанию номера, 12 бит
+} adc_sync_series;
+
+static bool adc_sync;
+static unsigned int adc_triggers;              // сколько раз запускалась серия с adc_sync_on()
+static volatile unsigned int adc_scan_trigger; // номер запуска текущей серии
+static adc_sync_series adc_sync_ring[ADC_SYNC_RING_SIZE];
+
+// одиночное преобразование канала батарейки (см. adc_battery_request())
+static volatile bool battery_requested;   // ждем начала следующей серии
+static volatile bool battery_converting;  // ADC сейчас меряет батарейку
+static volatile unsigned int battery_value;
+static handoff battery_handoff;
+static unsigned int battery_taken;
 
 void adc_init(){
   //Setup TimerB as ADC trigger source
@@ -39,52 +89,237 @@ void adc_init(){
   ADCCTL0 |= ADCMSC;                             //sample and hold = 4clk, multiple conversion
   ADCCTL1 |= (ADCSHP + ADCSSEL_2 + ADCDIV_2);    //TIMER Conversion is triggered manually, ADC clock source - SMCLK/3, single channel single conversion
   ADCCTL2 |= ADCRES_2;                           //12 bit resolution
-//  ADCMCTL0 |= (ADCSREF_1 + adc_channels[adc_index]); //Employing the internal reference, start conversion from the first channel in the list
-  ADCMCTL0 |= (ADCSREF_3 + adc_channels[adc_index]);
+//  ADCMCTL0 |= (ADCSREF_1 + adc_highest_channel); //Employing the internal reference, start conversion from the first channel in the list
+  ADCMCTL0 |= (ADCSREF_3 + adc_highest_channel);
   ADCIE |= ADCIE0;                               //Activate interrupt
   ADCCTL0 |= (ADCON);
 }
 
-/* --------------------- Конвертация по 4м каналам -------------------- */
+/*
+ * Согласованная копия сумм и числа серий опубликованных ADC_ISR
+ */
+static void adc_copy_sums(unsigned long* sums, unsigned int* series){
+    unsigned int sequence;
+    do {
+        sequence = handoff_read_begin(&adc_handoff);
+        for(int i = 0; i < ADC_MAX_NUMBER_OF_CHANNELS; i++){
+            sums[i] = adc_sums[i];
+        }
+        *series = adc_series;
+    } while(!handoff_read_end(&adc_handoff, sequence));
+}
+
+/* --------------------- Конвертация серий каналов -------------------- */
 
 /*
  * This function turns on continuous timer triggered conversion.
  * Period is defined by the "period" variable.
  */
 void adc_conversion_on(unsigned int period){
+    adc_copy_sums(adc_sums_taken, &adc_series_taken); // первый пакет записи усредняет только ее серии
     TB0CCR0 = period;                            //Loading timer ticking period
     TB0CTL |= (MC_1 + TBIE);                     //Timer is in Up mode, interrupt on
 }
 
+/*
+ * Выключает запуск серий: и таймер, и синхронный режим
+ */
 void adc_conversion_off(){
     TB0CCR0 = 0x00;                              //Zeroing timer period
     TB0CTL &= ~(MC_1 + TBIE);                    //Timer is stopped, interrupt off
+    adc_sync = false;
 }
 
-void adc_convert_begin(){
+/**
+ * Синхронный режим: серии запускает не Timer_B0, а adc_convert_begin() из прерывания DRDY ADS
+ * (ads_DRDY_interrupt_callback()), по серии на каждое измерение ADS.
+ * Вызывать до ads_start_recording(): номера серий и номера измерений ADS считаются от первого DRDY
+ */
+void adc_sync_on(){
+    uchar i;
+    adc_copy_sums(adc_sums_taken, &adc_series_taken);
+    adc_triggers = 0;
+    for(i = 0; i < ADC_SYNC_RING_SIZE; i++) {
+        adc_sync_ring[i].trigger = i - ADC_SYNC_RING_SIZE; // номер который не будет запрошен
+    }
+    adc_sync = true;
+}
+
+/**
+ * Задает каналы ADC (биты маски - A0..A11) которые меряются в каждой серии и идут в пакет.
+ * Выводы каналов (P1.0..P1.7 для A0..A7, P5.0..P5.3 для A8..A11) переключаются в аналоговый режим,
+ * поэтому каналы занятых выводов (A1, A3 - SPI0 акселерометра) задавать нельзя.
+ * Вызывать когда преобразования выключены.
+ * 0 - канал по умолчанию (A6)
+ */
+void adc_set_channels(uint channel_mask){
+    uchar channel;
+    channel_mask &= ADC_CHANNEL_MASK;
+    if(channel_mask == 0) {
+        channel_mask = ADC_DEFAULT_CHANNELS;
+    }
+    adc_channel_mask = channel_mask;
+    adc_number_of_channels = 0;
+    for(channel = 0; channel < ADC_MAX_NUMBER_OF_CHANNELS; channel++) {
+        if(channel_mask & (1 << channel)) {
+            if(adc_number_of_channels == 0) {
+                adc_lowest_channel = channel;
+            }
+            adc_highest_channel = channel;
+            adc_number_of_channels++;
+        }
+    }
+    SYSCFG2 |= channel_mask;         //Activate ADC module on the pins
+}
+
+/**
+ * Сколько каналов в серии (и пар байт в adc_get_data())
+ */
+uchar adc_number_of_signals(){
+    return adc_number_of_channels;
+}
+
+static void adc_start(){
     ADCCTL0 |= ADCENC;
     ADCCTL0 |= ADCSC;           //Start conversion
 }
 
+/*
+ * Останавливает последовательность сразу (ADCCONSEQ = 0 и ADCENC = 0), а не после A0
+ */
+static void adc_scan_stop(){
+    ADCCTL0 &= ~(ADCENC);
+    ADCCTL1 &= ~(ADCCONSEQ);
+    adc_scanning = false;
+}
+
+/*
+ * Запускает преобразование канала батарейки. Вызывать из прерывания
+ * или из main loop когда серии никто не запускает и серии нет (см. adc_battery_request())
+ */
+static void battery_convert_begin(){
+    battery_requested = false;
+    battery_converting = true;
+    ADCCTL0 &= ~(ADCENC);                          //Turning the ADC off before changing the channel
+    ADCCTL1 &= ~(ADCCONSEQ);                       //Single channel single conversion
+    ADCMCTL0 = (ADCSREF_3 + BATTERY_ADC_CHANNEL);
+    adc_start();
+}
+
+/**
+ * Начинает серию (если запрошена батарейка - сначала ее, серия начнется когда она будет измерена).
+ * Если прошлое преобразование еще не закончено, запуск пропускается
+ */
+void adc_convert_begin(){
+    unsigned int trigger = adc_triggers++;
+    if(adc_scanning || battery_converting) {
+        return;
+    }
+    if(battery_requested && !adc_sync) {  // в синхронном режиме батарейка меряется после серии
+        battery_convert_begin();
+        return;
+    }
+    adc_scan_trigger = trigger;
+    adc_scanning = true;
+    adc_scan_channel = adc_highest_channel;
+    ADCCTL0 &= ~(ADCENC);                          //Channel and mode are changed only with ADCENC = 0
+    ADCMCTL0 = (ADCSREF_3 + adc_highest_channel);
+    if(adc_highest_channel != adc_lowest_channel) {
+        ADCCTL1 |= ADCCONSEQ_1;                    //Sequence of channels from ADCINCH down
+    }
+    adc_start();
+}
+
+/**
+ * Просит одно преобразование канала батарейки.
+ * Если Timer_B0 запускает серии преобразований, батарейка меряется в начале следующей серии
+ * (серия стартует сразу после нее), в синхронном режиме - сразу после следующей серии
+ * (до следующего DRDY она точно успевает), иначе ADC запускается сразу.
+ * Прерывания не запрещаются: запрос - флаг battery_requested, его забирает прерывание
+ * (начало серии от таймера или DRDY, конец серии). Сам main loop запускает батарейку только когда
+ * серии никто не запускает и серии нет: тогда прерывание ADC не трогает ADC.
+ * Если прерывание конца серии сработает между флагом и проверкой, оно запустит батарейку само,
+ * а main loop увидит battery_converting (или, если она уже кончилась, измерит еще раз - это безвредно)
+ */
+void adc_battery_request(){
+    battery_requested = true;
+    if((TB0CTL & MC_1) || adc_sync) {
+        return;
+    }
+    if(!adc_scanning && !battery_converting) {
+        battery_convert_begin();
+    }
+}
+
+/**
+ * true если преобразование батарейки закончено, результат (12 бит) кладется в value
+ */
+bool adc_battery_received(unsigned int* value){
+    unsigned int sequence;
+    unsigned int result;
+    do {
+        sequence = handoff_read_begin(&battery_handoff);
+        result = battery_value;
+    } while(!handoff_read_end(&battery_handoff, sequence));
+    if(sequence == battery_taken) {
+        return false;
+    }
+    battery_taken = sequence;
+    *value = result;
+    return true;
+}
+
 /* -------------------------------------------------------------------------- */
-// TODO убедиться что оцифрованные данные по прерыванию не прилетят во время преключения
-// двойного буффера. Если такое возможно поставить защиту
+/*
+ * Среднее каждого канала по сериям законченным с прошлого вызова:
+ * adc_number_of_signals() значений по 2 байта (little endian) по возрастанию номера канала.
+ * Прерывания не выключаются: если ADC_ISR сработал во время копирования сумм, копия повторяется.
+ * Если с прошлого вызова не было ни одной серии, остаются прошлые значения
+ */
 unsigned char* adc_get_data(){
-    //После того, как все данные оцифровались, обнуляем счетчик суммации
-    //И преобразуем longs в ints, для отсылки на PC
-    for(int i = 0; i < ADS_NUMBER_OF_CHANNELS; i++){
-//        if(adc_accumulator[i] > 65535) adc_accumulator[i] = 65535;  //Clipping the sample value
-        adc_data_prepared[i] = (unsigned int)(adc_accumulator[i] >> 4);
-    }
-    unsigned char* data = (unsigned char*) adc_data_prepared;
-    // переключаемся на второй буффер и обнуляем его значения
-    adc_accumulator = adc_accumulators[(i++ & 1)];
-    for (int i = 0; i < ADS_NUMBER_OF_CHANNELS; ++i) {
-        adc_accumulator[i] = 0;
+    unsigned long sums[ADC_MAX_NUMBER_OF_CHANNELS];
+    unsigned int series;
+    uchar channel;
+    uchar i = 0;
+    adc_copy_sums(sums, &series);
+    unsigned int count = series - adc_series_taken;
+    for(channel = 0; channel < ADC_MAX_NUMBER_OF_CHANNELS; channel++){
+        if(adc_channel_mask & (1 << channel)) {
+            if(count > 0) {
+                adc_data_prepared[i] = (unsigned short)(((sums[channel] - adc_sums_taken[channel]) << ADC_OUTPUT_SHIFT) / count);
+            }
+            i++;
+        }
+        adc_sums_taken[channel] = sums[channel];
     }
+    adc_series_taken = series;
+    return (unsigned char*) adc_data_prepared;
+}
 
-    adc_sum_cnt = 0; //Marking that the adc batch is prepared and we are ready for the next conversion
-    return data;
+/**
+ * Синхронный режим: кладет в destination серию запущенную DRDY измерения ADS номер trigger
+ * (с adc_sync_on(), см. ads_sample_number()): adc_number_of_signals() значений 12 бит
+ * по 2 байта little endian. Если серия этого измерения еще идет, ждет ее (ADC обычно успевает раньше SPI),
+ * но не больше ADC_SYNC_WAIT_LIMIT проверок.
+ * false если серии нет (запуск пропущен, серия не кончилась за ADC_SYNC_WAIT_LIMIT проверок
+ * или main loop отстал больше чем на ADC_SYNC_RING_SIZE измерений)
+ */
+bool adc_get_sync_series(unsigned int trigger, unsigned char* destination){
+    adc_sync_series* entry = &adc_sync_ring[trigger & (ADC_SYNC_RING_SIZE - 1)];
+    unsigned int sequence;
+    bool converted;
+    uchar i;
+    unsigned int wait = ADC_SYNC_WAIT_LIMIT;
+    while(adc_scanning && adc_scan_trigger == trigger && --wait > 0);
+    do {
+        sequence = handoff_read_begin(&adc_handoff);
+        converted = entry->trigger == trigger;
+        for(i = 0; i < adc_number_of_channels; i++){
+            destination[2 * i] = (unsigned char)entry->values[i];
+            destination[2 * i + 1] = (unsigned char)(entry->values[i] >> 8);
+        }
+    } while(!handoff_read_end(&adc_handoff, sequence));
+    return converted;
 }
 
 __attribute__((interrupt(ADC_VECTOR)))
@@ -95,20 +330,46 @@ void ADC_ISR(void){
             // нужно обязательно считать данные из буффера ADCMEM0 чтобы выйти из прерывания
             //Reading the current conversion
             value = ADCMEM0;
-            if(adc_sum_cnt < CONVERSIONS_PER_BATCH){
-                ADCCTL0 &= ~(ADCENC);                      //Turning the ADC off before changing the channel
-                adc_accumulator[adc_index++] += (unsigned long)value;    //Reading the current conversion
-                //Making sure we are in the range
-                if(adc_index > (ADS_NUMBER_OF_CHANNELS-1)){
-                    adc_sum_cnt++;
-                    adc_index = 0;
-                }
-                ADCMCTL0 = (ADCSREF_3 + adc_channels[adc_index]);   //Choosing the next channel
-                //If we have converted all the planned channels, stop here
-                //and wait for the next turn (timer will trigger a new conversion series)
-                if(adc_index > 0){
+            if(battery_converting) {
+                handoff_write_begin(&battery_handoff);
+                battery_value = value;
+                handoff_write_end(&battery_handoff);
+                battery_converting = false;
+                ADCCTL0 &= ~(ADCENC);
+                // если серию запускает таймер, начинаем ее (она сама вернет каналы серии)
+                if((TB0CTL & MC_1) && !adc_sync) {
                     adc_convert_begin();
                 }
+                break;
+            }
+            if(!adc_scanning) {
+                return;                     //Conversion left over from a stopped sequence
+            }
+            adc_series_values[adc_scan_channel] = value;
+            if(adc_scan_channel > adc_lowest_channel) {
+                adc_scan_channel--;         //The ADC is already converting the next channel
+                return;                     //Main loop is woken up only when the series is complete
+            }
+            adc_scan_stop();
+            // серия закончена: публикуем ее в суммах для adc_get_data()
+            handoff_write_begin(&adc_handoff);
+            for(uchar channel = adc_lowest_channel; channel <= adc_highest_channel; channel++){
+                adc_sums[channel] += adc_series_values[channel];
+            }
+            adc_series++;
+            if(adc_sync) {
+                adc_sync_series* entry = &adc_sync_ring[adc_scan_trigger & (ADC_SYNC_RING_SIZE - 1)];
+                uchar i = 0;
+                for(uchar channel = adc_lowest_channel; channel <= adc_highest_channel; channel++){
+                    if(adc_channel_mask & (1 << channel)) {
+                        entry->values[i++] = adc_series_values[channel];
+                    }
+                }
+                entry->trigger = adc_scan_trigger;
+            }
+            handoff_write_end(&adc_handoff);
+            if(battery_requested) {
+                battery_convert_begin();    //Battery requested during the series
             }
             break;
     }
@@ -120,7 +381,7 @@ __attribute__((interrupt(TIMER0_B0_VECTOR)))
 void TIMERB0_ISR(void){
     switch(__even_in_range (TB0IV, 0x0E)){
     case 0x0E:
-        adc_convert_begin();                //Initiate the first conversion
+        adc_convert_begin();                //Initiate the series (or the battery first)
         break;
     }
     interrupt_flag = true;
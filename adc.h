@@ -1,10 +1,21 @@
 #ifndef ADC_H
 #define ADC_H
 
+#include <stdbool.h>
+#include "utypes.h"
+
+#define ADC_MAX_NUMBER_OF_CHANNELS 12 // A0..A11
+
 void adc_init();
 void adc_convert_begin();
 unsigned char* adc_get_data();
 void adc_conversion_on(unsigned int period);
 void adc_conversion_off();
+void adc_sync_on();
+bool adc_get_sync_series(unsigned int trigger, unsigned char* destination);
+void adc_set_channels(uint channel_mask);
+uchar adc_number_of_signals();
+void adc_battery_request();
+bool adc_battery_received(unsigned int* value);
 
 #endif //ADC_H
@@ -1,12 +1,15 @@
 #include "spi1.h"
-#include "msp430fr2476.h"
+#include "spi.h"
+#include "hal.h"
 #include <stdbool.h>
 #include "bynary.h"
 #include "utypes.h"
 #include "uart.h"
 #include "leds.h"
-// #include "ads1292.h"  // !!!! Посмотреть на стандартный ads1292.h  от TI
+#include "ads1292.h"  // !!!! Посмотреть на стандартный ads1292.h  от TI
 #include "interrupts.h"
+#include "handoff.h"
+#include "timestamp.h"
 
 /**
  * ADS выставляет флаг(бит) DRDY (data ready) в регистре флагов процессора, когда данные готовы.
@@ -33,14 +36,54 @@
 /***************************************/
 
 #define NULL 0
-#define ADC_NUMBER_OF_CHANNELS 2
-#define ADS_SAMPLE_SIZE 9 // одно измерение: 3 байта служебные + 3 байта канал 1 + 3 байта канал 2  !!!!####!!! Выяснить про "3 байта служебные"
-static uchar data_buffer[ADS_SAMPLE_SIZE]; //buffer for ads data
+// одно измерение: 3 байта служебные (status word) + по 3 байта на каждый канал
+#define ADS_STATUS_SIZE 3
+#define ADS_MAX_SAMPLE_SIZE (ADS_STATUS_SIZE + 3 * ADS_MAX_NUMBER_OF_CHANNELS)
+static uchar data_buffer[ADS_MAX_SAMPLE_SIZE]; //buffer for ads data
 static uchar* display_buffer = data_buffer;
-
-static volatile bool data_ready; // Сработало прерывание по сигналу DRDY от ADS на P3.7
+// адреса куда SPI прерывание кладет каждый из sample_size байт измерения.
+// По умолчанию все в data_buffer (как есть, big endian),
+// ads_set_channel_destination() перенаправляет байты канала прямо в пакет.
+// Таблиц две: DRDY берет активную, main loop заполняет вторую
+// и ads_commit_channel_destinations() подменяет активную одной записью указателя,
+// так что чтение по SPI никогда не видит наполовину обновленную таблицу
+static uchar* rx_tables[2][ADS_MAX_SAMPLE_SIZE];
+static uchar** volatile rx_destinations = rx_tables[0]; // активная таблица
+static uchar** rx_pending = rx_tables[1];                 // таблица которую заполняет main loop
+
+// Число каналов (ADS1292 - 2, ADS1294/ADS1299-4 - 4, ADS1296/ADS1299-6 - 6, ADS1298/ADS1299 - 8)
+// определяется при старте по регистру ID
+static uchar number_of_channels = 2;
+static uchar sample_size = ADS_STATUS_SIZE + 3 * 2;
+
+/*
+ * Измерения ADS передаются в main loop через samples_handoff:
+ * прерывание DRDY начинает запись (handoff_write_begin()) и запускает чтение по SPI,
+ * SPI прерывание после последнего байта ее заканчивает. Пока sequence нечетный, байты измерения еще приходят.
+ * main loop берет каждое законченное измерение один раз (samples_taken), а если их набралось
+ * больше одного - прошлые уже затерты следующими и считаются пропущенными (missed_samples)
+ * Время DRDY (drdy_time) пишется под тем же handoff, поэтому main loop берет его вместе с измерением
+ */
+static handoff samples_handoff;
+static unsigned long drdy_time;    // такты XT1 (timestamp.c) в момент DRDY измерения
+static unsigned long sample_time;  // то же для взятого измерения
+static uint samples_taken;
+static uint missed_samples;
+static uint sample_number;  // номер последнего взятого измерения с начала записи (по числу DRDY)
 static bool data_received;  // Dannye byli shitany po SPI
 
+/*
+ * Копия регистров ADS в RAM: читается целиком при старте, меняется вместе с записью в ADS.
+ * Чтение регистров берет значения отсюда, поэтому не трогает SPI и не мешает RDATAC во время записи.
+ * Статусные регистры (LOFF_STAT) здесь такие как были при старте, текущий lead-off - в status word измерений
+ */
+static uchar registers[ADS_MAX_NUMBER_OF_REGISTERS];
+static uchar number_of_registers = 12;
+static bool continuous_mode;  // ADS в RDATAC (идет запись): регистры пишутся только через SDATAC
+static uchar staged_first;    // регистры [staged_first, staged_end) изменены в копии, но еще не записаны в ADS
+static uchar staged_end;      // 0 - отложенной записи нет
+#define ADS_WRITE_WAIT_LIMIT 0xFFFF // сколько раз проверять конец чтения измерения при подмене адресов
+
 // Заготовки для задержек   Проверить, что берутся из msp430fr2476.h
 #define DELAY_32()   __delay_cycles(32)
 #define DELAY_64()   __delay_cycles(64)
@@ -53,9 +96,13 @@ static bool data_received;  // Dannye byli shitany po SPI
 // указатель на функцию без параметров например "void func()" определяется следующим образом: void (*func)(void)
 // и дальше этому указателю можно присваивать адрес любой  соответсвующей функции и вызывать ее просто как func();
 /** указатель на внешнюю функцию которая будет вызываться из прерывания DRDY (ads данные готовы) */
-static void (*DRDY_interrupt_callback)(void); // сейчас не используется
+static void (*DRDY_interrupt_callback)(void); // запуск серии ADC в синхронном режиме (adc_convert_begin)
 
 
+#define ADS1292_LOFF_STAT_REGISTER 0x08
+#define ADS129X_LOFF_STATP_REGISTER 0x12 // ADS1294/6/8 и ADS1299, LOFF_STATN следующий
+#define ADS129X_LOFF_STATN_REGISTER 0x13
+
 /******** ADS ONE BYTE COMMANDS ( Набор команд opcode commands from data sheet: Table 15. Command Definitions Page 47) *********/
 typedef enum {
     ADS_WAKEUP = B00000010, //Any following command must be sent after 4 tCLK cycles.
@@ -89,12 +136,12 @@ static void ads_write_command(ADS_COMMAND command) {
 }
 
 /**
- * Запись подряд нескольких регистров
+ * Запись подряд нескольких регистров по SPI (ADS не в RDATAC)
  * @param addres - starting register address
  * @param data указатель на массив данных
  * @param data_size размер данных
  */
-void ads_write_regs(uchar address, uchar* data, uchar data_size) {
+static void ads_spi_write_regs(uchar address, uchar* data, uchar data_size) {
     DELAY_32();
     //The Register Write command is a two-byte opcode followed by the input of the register data.
     //First opcode byte: 010r rrrr, where r rrrr is the starting register address.
@@ -110,6 +157,89 @@ void ads_write_regs(uchar address, uchar* data, uchar data_size) {
     DELAY_32();
 }
 
+/*
+ * Чтение подряд count регистров начиная с address одной командой RREG (ADS не в RDATAC)
+ */
+static void ads_spi_read_regs(uchar address, uchar* destination, uchar count) {
+    DELAY_32();
+    //The Register Read command is a two-byte opcode followed by the output of the register data.
+    //First opcode byte: 001r rrrr, where r rrrr is the starting register address.
+    //Second opcode byte: 000n nnnn, where n nnnn is the number of registers to read � 1.
+    uchar opcode_first_byte = address | B00100000;
+    uchar opcode_second_byte = count - 1; // (number of registers to read � 1)
+    // отправляем команду чтения из регистров
+    spi1_transfer(opcode_first_byte);
+    spi1_transfer(opcode_second_byte);
+    // отправляем 0 чтобы прочитать данные
+    spi1_read(destination, count);
+}
+
+/*
+ * Пишет в ADS отложенные регистры [staged_first, staged_end) из копии в RAM одной командой WREG
+ * (ADS не в RDATAC). Попавшие в диапазон регистры только для чтения ADS не пишет
+ */
+static void ads_spi_write_staged() {
+    if (staged_end != 0) {
+        ads_spi_write_regs(staged_first, &registers[staged_first], staged_end - staged_first);
+        staged_end = 0;
+    }
+}
+
+/**
+ * Запись подряд нескольких регистров (и их копии в RAM).
+ * Во время записи ADS в RDATAC и команды регистров не принимает, поэтому новые значения
+ * пока только в копии, а в ADS их пишет ads_data_received() когда все законченные измерения
+ * уже взяты и очередное не читается: DRDY выключается, SDATAC, WREG, RDATAC, DRDY включается.
+ * Так ни одно измерение не затирается, а DRDY пришедший во время записи оставит флаг
+ * и его измерение прочитается сразу после нее. Остановка записи пишет отложенное сразу.
+ * Вызывать только из main loop
+ */
+void ads_write_regs(uchar address, uchar* data, uchar data_size) {
+    uchar end = address + data_size;
+    for (uchar i = 0; i < data_size; i++) {
+        uchar reg = address + i;
+        if (reg < number_of_registers && !ads_register_read_only(reg)) {
+            registers[reg] = data[i];
+        }
+    }
+    if (!continuous_mode) {
+        ads_spi_write_regs(address, data, data_size);
+        return;
+    }
+    if (end > number_of_registers) {
+        end = number_of_registers;
+    }
+    if (address >= end) {
+        return;
+    }
+    if (staged_end == 0 || address < staged_first) {
+        staged_first = address;
+    }
+    if (end > staged_end) {
+        staged_end = end;
+    }
+}
+
+/*
+ * Пишет отложенные ads_write_regs() регистры во время записи, если сейчас можно:
+ * законченных невзятых измерений нет (взятое уже обработано, адреса следующего заданы)
+ * и очередное не читается по SPI. Иначе пробует при следующем вызове ads_data_received()
+ */
+static void ads_write_staged_live() {
+    uint sequence = handoff_read_begin(&samples_handoff);
+    if (sequence != samples_taken) {
+        return;
+    }
+    ADS_DRDY_INTERRUPT_DISABLE();
+    // DRDY успел между проверкой и выключением: запишем в следующий раз
+    if (handoff_read_begin(&samples_handoff) == sequence) {
+        ads_write_command(ADS_DISABLE_CONTINUOUS_MODE);
+        ads_spi_write_staged();
+        ads_write_command(ADS_ENABLE_CONTINUOUS_MODE);
+    }
+    ADS_DRDY_INTERRUPT_ENABLE();
+}
+
 //initial ADS startup for testing purposes
 static void ads_test_config() {
     ads_write_command(ADS_DISABLE_CONTINUOUS_MODE);   //Disable Read Data Continuous mode
@@ -118,6 +248,23 @@ static void ads_test_config() {
     ads_write_regs(0x01, test_reg_values, sizeof(test_reg_values));
 }
 
+/*
+ * Число каналов по значению регистра ID:
+ *  ADS1291/ADS1292/ADS1292R:   ID[7] = 0, ID[4:2] = 100 - 2 канала (у ADS1291 данные второго канала нулевые)
+ *  ADS1294/ADS1296/ADS1298(R): ID[7] = 1, ID[2:0] = 000/001/010 - 4/6/8 каналов
+ *  ADS1299-4/-6/ADS1299:       ID[7] = 0, ID[4:2] = 111, ID[1:0] = 00/01/10 - 4/6/8 каналов
+ * Неизвестный ID считаем двухканалкой (как было до определения)
+ */
+static uchar ads_channels_by_id(uchar id) {
+    if ((id & 0x80) && (id & 0x07) <= 0x02) { // ADS1294/6/8
+        return 4 + 2 * (id & 0x07);
+    }
+    if ((id & 0x1C) == 0x1C && (id & 0x03) <= 0x02) {  // ADS1299
+        return 4 + 2 * (id & 0x03);
+    }
+    return 2;
+}
+
 void ads_init() {  // !!!! Надо все перепроверить
     spi1_init();
     //Configuring ports
@@ -143,32 +290,52 @@ void ads_init() {  // !!!! Надо все перепроверить
     DELAY_64();
     P4OUT |= RESET_BIT; // ads releasing
     DELAY_320();
+    // после reset ADS в режиме RDATAC и регистры не читаются
+    ads_write_command(ADS_DISABLE_CONTINUOUS_MODE);
+    ads_spi_read_regs(ADS_ID_REGISTER, registers, 1);
+    number_of_channels = ads_channels_by_id(registers[ADS_ID_REGISTER]);
+    // ADS1292: 12 регистров, ADS1299(-4/-6): 24 (нет WCT1, WCT2), ADS1294/6/8: 26
+    if (number_of_channels == 2) {
+        number_of_registers = 12;
+    } else if (!(registers[ADS_ID_REGISTER] & 0x80)) {
+        number_of_registers = 24;
+    } else {
+        number_of_registers = ADS_MAX_NUMBER_OF_REGISTERS;
+    }
+    ads_spi_read_regs(ADS_ID_REGISTER, registers, number_of_registers);
+    sample_size = ADS_STATUS_SIZE + 3 * number_of_channels;
+    for (uchar i = 0; i < ADS_MAX_SAMPLE_SIZE; i++) {
+        rx_tables[0][i] = data_buffer + i;
+        rx_tables[1][i] = data_buffer + i;
+    }
   //  ads_test_config();
 }
 
 /**
- * Чтение одного регистра. Возращает прочитанное значение
- * (Не используем, но есть в файле commands.c  Резерв для отладки)
+ * Чтение одного регистра (из копии в RAM). Возращает прочитанное значение
  */
 uchar ads_read_reg(uchar address) {
-    DELAY_32();
-    //The Register Read command is a two-byte opcode followed by the output of the register data.
-    //First opcode byte: 001r rrrr, where r rrrr is the starting register address.
-    //Second opcode byte: 000n nnnn, where n nnnn is the number of registers to read � 1.
-    uchar opcode_first_byte = address | B00100000;
-    uchar opcode_second_byte = 0x00; // (number of registers to read � 1) = 0
-    // отправляем команду чтения из регистра
-    spi1_transfer(opcode_first_byte);
-    spi1_transfer(opcode_second_byte);
-    // отправляем 0 чтобы прочитать данные
     uchar reg_value;
-    spi1_read(&reg_value, 1); //Reading one byte
+    ads_read_regs(address, &reg_value, 1);
     return reg_value;
 }
 
+/*
+ * Копирует count регистров подряд начиная с address из копии в RAM, SPI не трогает.
+ * Регистров которых у этой ADS нет - 0
+ */
+void ads_read_regs(uchar address, uchar* destination, uchar count) {
+    for (uchar i = 0; i < count; i++) {
+        uchar reg = address + i;
+        destination[i] = reg < number_of_registers ? registers[reg] : 0;
+    }
+}
+
 void ads_stop_recording() { // Разобраться, что происходит. Почему дергается сигнал DRDY
     LED1_OFF();
+    continuous_mode = false;
     ads_write_command(ADS_DISABLE_CONTINUOUS_MODE); // stop continuous recording
+    ads_spi_write_staged();
     ads_write_command(ADS_STOP); //ads stop
 }
 
@@ -177,32 +344,98 @@ void ads_start_recording() {
     ADS_DRDY_INTERRUPT_DISABLE(); //disable interrupt on DRDY чтобы прерывания не нарушали процесс старта
     // очищаем флаги
     ADS_DRDY_FLAG_CLEAR(); //Clearing interrput flag DRDY
-    data_ready = false;
+    handoff_consume(&samples_handoff, &samples_taken); // измерения прошлой записи не нужны
+    data_received = false;
+    missed_samples = 0;
+    sample_number = (uint)-1; // первое измерение получит номер 0
     ads_write_command(ADS_ENABLE_CONTINUOUS_MODE); // enable continuous recording
+    continuous_mode = true;
     ads_write_command(ADS_START); //start recording
     ADS_DRDY_INTERRUPT_ENABLE(); //Enabling the interrupt on DRDY
 }
 
+/**
+ * Задает куда SPI прерывание положит 3 байта следующего измерения канала channel.
+ * ADS отдает данные в big endian, а по адресу destination они лягут сразу в little endian:
+ * destination[0] - младший байт, destination[2] - старший (знаковый).
+ * Адреса пишутся в неактивную таблицу и действуют после ads_commit_channel_destinations().
+ * Задавать нужно все каналы: таблицы чередуются
+ */
+void ads_set_channel_destination(uchar channel, uchar* destination) {
+    uchar** channel_destinations = rx_pending + ADS_STATUS_SIZE + channel * 3; // первые 3 байта служебные
+    channel_destinations[0] = destination + 2;
+    channel_destinations[1] = destination + 1;
+    channel_destinations[2] = destination;
+}
+
+/**
+ * Делает заданные ads_set_channel_destination() адреса активными со следующего DRDY.
+ * Вызывать из main loop после того как ads_data_received() вернул true.
+ * После возврата по старым адресам SPI уже не пишет: если DRDY пришел до подмены,
+ * ждем конца его чтения (не дольше ADS_WRITE_WAIT_LIMIT проверок)
+ */
+void ads_commit_channel_destinations() {
+    uchar** table = rx_pending;
+    uint wait = ADS_WRITE_WAIT_LIMIT;
+    rx_pending = rx_destinations;
+    rx_destinations = table;
+    while ((handoff_read_begin(&samples_handoff) & 1) && --wait);
+}
+
+/**
+ * Данные читаются по SPI в прерываниях, чтение запускает само прерывание DRDY (PORT3_ISR).
+ * Возвращает true когда все байты очередного измерения приняты
+ */
 bool ads_data_received() {
-    if (data_ready) {
-        /****** Обработчик прерывания *****/
-        //чтение данных из ADS по SPI
-        spi1_read(data_buffer, ADS_SAMPLE_SIZE);
-        // вызвываем callback функцию если ее адрес не нулевой
-        if (*DRDY_interrupt_callback != NULL) {
-            DRDY_interrupt_callback();
+    if (!data_received) {
+        uint sequence;
+        uint new_samples;
+        if (staged_end != 0) {
+            ads_write_staged_live();
         }
-        data_ready = false;
+        // время копируем вместе с номером: если пока копируем придет DRDY, копируем заново
+        do {
+            sequence = handoff_read_begin(&samples_handoff);
+            if ((sequence & ~1u) == samples_taken) {
+                return false; // законченных измерений нет (следующее может как раз читаться по SPI)
+            }
+            sample_time = drdy_time;
+        } while (!handoff_read_end(&samples_handoff, sequence));
+        new_samples = (uint)(sequence - samples_taken) >> 1;
+        samples_taken = sequence;
+        missed_samples += new_samples - 1;
+        sample_number += new_samples;
         data_received = true;
-        /*************************************/
     }
     return data_received;
 }
 
+/**
+ * Номер измерения которое сейчас взято (ads_data_received()) с начала записи, считается по DRDY,
+ * поэтому пропущенные измерения номер тоже сдвигают. Совпадает с номером серии ADC в синхронном режиме
+ */
+uint ads_sample_number() {
+    return sample_number;
+}
+
+/**
+ * Время DRDY взятого измерения в тактах XT1 (timestamp.c)
+ */
+unsigned long ads_sample_time() {
+    return sample_time;
+}
+
+/**
+ * Сколько измерений с начала записи затерто следующими до того как main loop их взял
+ */
+uint ads_missed_samples() {
+    return missed_samples;
+}
+
 /**
  * Перед тем как получить данные убедиться что они готовы. Метод ads_data_received()!
  *
- * Возвращает ссылку на массив из 3 * ADS_NUMBER_OF_CHANNELS  байт:
+ * Возвращает ссылку на массив из 3 * ads_number_of_signals()  байт:
  * 3 байта от первого канала
  * 3 байта от второго канала
  * ...
@@ -211,7 +444,46 @@ bool ads_data_received() {
 uchar* ads_get_data() {
     data_received = false;
     //Dropping the first 3 bytes from ADS (там служебная информация)
-    return data_buffer + 3;
+    return data_buffer + ADS_STATUS_SIZE;
+}
+
+/**
+ * Число каналов ADS (2, 4, 6 или 8), определяется в ads_init()
+ */
+uchar ads_number_of_signals() {
+    return number_of_channels;
+}
+
+/**
+ * Число регистров ADS (с ID), определяется в ads_init()
+ */
+uchar ads_number_of_registers() {
+    return number_of_registers;
+}
+
+/**
+ * true для регистров которые ADS только читает: ID и статус lead-off
+ * (LOFF_STAT у ADS1292, LOFF_STATP и LOFF_STATN у остальных)
+ */
+bool ads_register_read_only(uchar address) {
+    if (address == ADS_ID_REGISTER) {
+        return true;
+    }
+    if (number_of_channels == 2) {
+        return address == ADS1292_LOFF_STAT_REGISTER;
+    }
+    return address == ADS129X_LOFF_STATP_REGISTER || address == ADS129X_LOFF_STATN_REGISTER;
+}
+
+/**
+ * Перед тем как получить данные убедиться что они готовы. Метод ads_data_received()!
+ *
+ * Для случая когда данные каналов прерывание уже разложило по адресам
+ * заданным ads_set_channel_destination(). Возвращает ссылку на 3 служебных байта (status word).
+ */
+uchar* ads_get_status() {
+    data_received = false;
+    return data_buffer;
 }
 
 // отправляет тестовые данные
@@ -224,30 +496,45 @@ uchar* ads_get_data_t() {
 /**
  * Перед тем как получить значение лофф статуса
  * убедиться что данные от ADS считаны. Метод ads_data_received()
+ *
+ * Lead-off биты из status word (3 служебных байта) последнего измерения, 1 - электрод отвалился:
+ *  ADS1292: 1100 | LOFF_STAT[4:0] | GPIO[1:0] | 0...  ->  LOFF_STAT[4:0] (RLD, IN2N, IN2P, IN1N, IN1P)
+ *  ADS1294/6/8, ADS1299: 1100 | LOFF_STATP[7:0] | LOFF_STATN[7:0] | GPIO[7:4]  ->  LOFF_STATP | LOFF_STATN << 8
+ *  (у 4 и 6 каналов биты несуществующих каналов нулевые)
  */
-// скопировано у Саши. Разобраться что за 3 служебных байта выдает ADS
-/*uchar ads_get_loff_status() {
-    uchar result = ((data_buffer[0] << 1) & 0x0E) | ((data_buffer[1] >> 7) & 0x01);
-    return result;
-}*/
+uint ads_get_loff_status() {
+    if (number_of_channels == 2) {
+        return ((data_buffer[0] << 1) & 0x1E) | ((data_buffer[1] >> 7) & 0x01);
+    }
+    uchar loff_statp = (uchar)((data_buffer[0] << 4) | (data_buffer[1] >> 4));
+    uchar loff_statn = (uchar)((data_buffer[1] << 4) | (data_buffer[2] >> 4));
+    return loff_statp | ((uint)loff_statn << 8);
+}
 
 // метод передает указатель на конкретную функцию которая будет вызываться в DRDY прерывании (данные готовы)
-/*void ads_DRDY_interrupt_callback(void (*func)(void)) {
+// NULL - не вызывать ничего. Задавать когда прерывание DRDY выключено (до ads_start_recording())
+void ads_DRDY_interrupt_callback(void (*func)(void)) {
     DRDY_interrupt_callback = func;
-}*/
+}
 
 
 __attribute__((interrupt(PORT3_VECTOR)))
 void PORT3_ISR(void){
     if (ADS_DRDY_FLAG_SET) { //if interrupt from DRDY
-        data_ready = true; // выставляем флаг
+        // вызвываем callback функцию если ее адрес не нулевой: первым делом, чтобы задержка от DRDY была наименьшей
+        if (DRDY_interrupt_callback != NULL) {
+            DRDY_interrupt_callback();
+        }
+        //запускаем чтение данных из ADS по SPI в прерываниях
+        handoff_write_begin(&samples_handoff);
+        drdy_time = timestamp_now();
+        spi_read_scatter(rx_destinations, sample_size, &samples_handoff);
         ADS_DRDY_FLAG_CLEAR();
 //        LED1_ON(); // дергаем пин P1.0 для запуска лог.анализатора
 //        __delay_cycles(32);
 //        LED1_OFF();
     }
-    interrupt_flag = true;
-    __low_power_mode_off_on_exit(); // Выходим из спячки в main loop
+    // main loop не будим: измерение еще не принято, разбудит конец чтения по SPI (spi.c)
 }
 
 
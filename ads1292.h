@@ -5,15 +5,28 @@
 #include "bynary.h"
 #include "utypes.h"
 
+#define ADS_MAX_NUMBER_OF_CHANNELS 8
+#define ADS_MAX_NUMBER_OF_REGISTERS 0x1A // ADS1298: 0x00 - 0x19 (у ADS1292 12 регистров)
+#define ADS_ID_REGISTER 0x00
 
 void ads_init();
 uchar ads_read_reg(uchar address);
+void ads_read_regs(uchar address, uchar* destination, uchar count);
 void ads_write_regs(uchar address, uchar* data, uchar data_size);
 void ads_start_recording();
 uchar ads_number_of_signals();
+uchar ads_number_of_registers();
+bool ads_register_read_only(uchar address);
 void ads_stop_recording();
 bool ads_data_received();
+uint ads_missed_samples();
+uint ads_sample_number();
+unsigned long ads_sample_time();
 uchar* ads_get_data();
+uchar* ads_get_status();
+uint ads_get_loff_status();
+void ads_set_channel_destination(uchar channel, uchar* destination);
+void ads_commit_channel_destinations();
 void ads_DRDY_interrupt_callback(void (*func)(void));
 
 
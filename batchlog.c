@@ -0,0 +1,151 @@
+#include "hal.h"
+#include <stdbool.h>
+#include "utypes.h"
+#include "fram.h"
+#include "batchlog.h"
+
+/**
+ * Кольцевые логи пакетов в HIFRAM (msp430fr2476.ld: 0x10000 - 0x17FFE, кроме логов там ничего нет).
+ * databatch.c держит в HIFRAM два лога: пакеты отложенные пока uart не успевает (store-and-forward)
+ * и историю последних отправленных пакетов для повторной отправки по запросу хоста (BATCH_RESEND).
+ * Каждая запись: size(2 bytes)|пакет как есть (size bytes), записи идут друг за другом и
+ * переходят через конец лога в начало. Если место кончилось, затираются самые старые записи (batchlog_lost()).
+ * HIFRAM выше 64K, поэтому доступ через __data20_... (MOVX), в структуре лога - смещения от его начала.
+ * Работает только из main loop
+ */
+
+#define RECORD_HEADER_SIZE 2
+#define BATCH_NUMBER_OFFSET 2 // номер пакета после двух START_MARKER (little endian)
+
+static uint log_next(batchlog* log, uint offset, uint count) {
+    offset += count;
+    if(offset >= log->size) {
+        offset -= log->size;
+    }
+    return offset;
+}
+
+static uchar log_read(batchlog* log, uint offset) {
+    return __data20_read_char(log->start + offset);
+}
+
+static uint log_read_uint(batchlog* log, uint offset) {
+    return log_read(log, offset) | ((uint)log_read(log, log_next(log, offset, 1)) << 8);
+}
+
+/* копирует size байт с offset в destination, через конец лога - в два куска */
+static void log_copy(batchlog* log, uint offset, uchar* destination, uint size) {
+    unsigned long address = log->start + offset;
+    uint i;
+    for(i = 0; i < size; i++) {
+        if(offset + i == log->size) {
+            address = log->start;
+        }
+        destination[i] = __data20_read_char(address++);
+    }
+}
+
+void batchlog_init(batchlog* log, unsigned long start, uint size) {
+    log->start = start;
+    log->size = size;
+    batchlog_clear(log);
+}
+
+void batchlog_clear(batchlog* log) {
+    log->head = 0;
+    log->tail = 0;
+    log->used = 0;
+    log->records = 0;
+    log->lost = 0;
+}
+
+/**
+ * Добавляет пакет в конец лога, затирая самые старые если не хватает места.
+ * false - пакет больше всего лога
+ */
+bool batchlog_append(batchlog* log, const uchar* batch, uint size) {
+    unsigned long address;
+    uint i;
+    if(size + RECORD_HEADER_SIZE > log->size) {
+        return false;
+    }
+    while(log->size - log->used < size + RECORD_HEADER_SIZE) {
+        batchlog_drop(log);
+        log->lost++;
+    }
+    FRAM_WRITE_ENABLE();
+    __data20_write_char(log->start + log->head, (uchar)size);
+    __data20_write_char(log->start + log_next(log, log->head, 1), (uchar)(size >> 8));
+    log->head = log_next(log, log->head, RECORD_HEADER_SIZE);
+    address = log->start + log->head;
+    for(i = 0; i < size; i++) {
+        if(log->head + i == log->size) {
+            address = log->start;
+        }
+        __data20_write_char(address++, batch[i]);
+    }
+    FRAM_WRITE_DISABLE();
+    log->head = log_next(log, log->head, size);
+    log->used += size + RECORD_HEADER_SIZE;
+    log->records++;
+    return true;
+}
+
+bool batchlog_empty(batchlog* log) {
+    return log->used == 0;
+}
+
+/**
+ * Копирует самую старую запись в destination (не удаляя ее) и возвращает ее размер, 0 - лог пуст
+ */
+uint batchlog_peek(batchlog* log, uchar* destination) {
+    uint size;
+    if(log->used == 0) {
+        return 0;
+    }
+    size = log_read_uint(log, log->tail);
+    log_copy(log, log_next(log, log->tail, RECORD_HEADER_SIZE), destination, size);
+    return size;
+}
+
+/**
+ * Ищет пакет с номером batch_number (от старых к новым), копирует его в destination и возвращает размер.
+ * 0 - такого пакета в логе нет (уже затерт или не было)
+ */
+uint batchlog_find(batchlog* log, uint batch_number, uchar* destination) {
+    uint offset = log->tail;
+    uint records = log->records;
+    uint size;
+    uint packet;
+    while(records-- > 0) {
+        size = log_read_uint(log, offset);
+        packet = log_next(log, offset, RECORD_HEADER_SIZE);
+        if(log_read_uint(log, log_next(log, packet, BATCH_NUMBER_OFFSET)) == batch_number) {
+            log_copy(log, packet, destination, size);
+            return size;
+        }
+        offset = log_next(log, packet, size);
+    }
+    return 0;
+}
+
+/**
+ * Удаляет самую старую запись
+ */
+void batchlog_drop(batchlog* log) {
+    uint size;
+    if(log->used == 0) {
+        return;
+    }
+    size = log_read_uint(log, log->tail) + RECORD_HEADER_SIZE;
+    log->tail = log_next(log, log->tail, size);
+    log->used -= size;
+    log->records--;
+}
+
+/**
+ * Сколько записей затерто новыми с последнего batchlog_clear()
+ */
+uint batchlog_lost(batchlog* log) {
+    return log->lost;
+}
@@ -0,0 +1,26 @@
+#ifndef BATCHLOG_H
+#define BATCHLOG_H
+
+#include <stdbool.h>
+#include "utypes.h"
+
+typedef struct {
+    unsigned long start; // адрес в HIFRAM
+    uint size;           // байт
+    uint head;           // смещение куда писать следующую запись
+    uint tail;           // смещение самой старой записи
+    uint used;           // занято байт
+    uint records;
+    uint lost;           // затерто записей
+} batchlog;
+
+void batchlog_init(batchlog* log, unsigned long start, uint size);
+void batchlog_clear(batchlog* log);
+bool batchlog_append(batchlog* log, const uchar* batch, uint size);
+bool batchlog_empty(batchlog* log);
+uint batchlog_peek(batchlog* log, uchar* destination);
+uint batchlog_find(batchlog* log, uint batch_number, uchar* destination);
+void batchlog_drop(batchlog* log);
+uint batchlog_lost(batchlog* log);
+
+#endif //BATCHLOG_H
@@ -0,0 +1,99 @@
+#include "hal.h"
+#include <stdbool.h>
+#include "utypes.h"
+#include "adc.h"
+#include "fram.h"
+#include "battery.h"
+
+/**
+ * Напряжение батарейки для пакетов (2 байта после ACC/ADC, милливольты little endian).
+ * Батарейка меняется медленно, поэтому одно преобразование ADC делается раз в BATTERY_PERIOD пакетов
+ * (ADC запускается между сериями Timer_B0, см. adc_battery_request()),
+ * в пакет идет среднее последних BATTERY_AVERAGING измерений, а до первого среднего - первое измерение.
+ * В остальное время на батарейку не тратится ничего кроме счетчика пакетов.
+ *
+ * Калибровка хранится в FRAM и задается командой BATTERY_CALIBRATION:
+ *  millivolts = adc * full_scale_mv / 4096 + offset_mv
+ * full_scale_mv - напряжение батарейки при котором ADC (12 бит) дает 4096: опорное VEREF+ умноженное на делитель
+ */
+
+#define BATTERY_PERIOD 50           // измеряем раз в 50 пакетов (1 с при 500 SPS)
+#define BATTERY_AVERAGING_SHIFT 3
+#define BATTERY_AVERAGING (1 << BATTERY_AVERAGING_SHIFT) // 8 измерений
+#define BATTERY_DEFAULT_FULL_SCALE_MV 6600 // VEREF+ 3.3 В и делитель 1:2, уточняется калибровкой
+#define ADC_FULL_SCALE_SHIFT 12
+
+typedef struct {
+    uint full_scale_mv;
+    int offset_mv;
+} battery_calibration;
+
+__attribute__((persistent))
+static battery_calibration calibration = {BATTERY_DEFAULT_FULL_SCALE_MV, 0};
+
+static uchar batch_count;
+static uint sum;      // 8 * 4095 помещается в 16 бит
+static uchar count;
+static uint average;
+static bool measured; // есть хотя бы одно измерение
+
+static uint battery_millivolts(uint adc_value) {
+    long millivolts = (long)(((unsigned long)adc_value * calibration.full_scale_mv) >> ADC_FULL_SCALE_SHIFT);
+    millivolts += calibration.offset_mv;
+    if(millivolts < 0) {
+        return 0;
+    }
+    if(millivolts > 0xFFFF) {
+        return 0xFFFF;
+    }
+    return (uint)millivolts;
+}
+
+/**
+ * Вызывается при старте записи: первое измерение запрашивается сразу
+ */
+void battery_start() {
+    batch_count = 0;
+    sum = 0;
+    count = 0;
+    measured = false;
+    adc_battery_request();
+}
+
+/**
+ * Вызывается на каждый пакет. Забирает готовое измерение, раз в BATTERY_PERIOD пакетов запрашивает новое
+ * и возвращает напряжение в милливольтах (0 пока нет ни одного измерения)
+ */
+uint battery_batch() {
+    uint value;
+    if(adc_battery_received(&value)) {
+        if(!measured) {
+            average = value;
+            measured = true;
+        }
+        sum += value;
+        if(++count >= BATTERY_AVERAGING) {
+            average = sum >> BATTERY_AVERAGING_SHIFT;
+            sum = 0;
+            count = 0;
+        }
+    }
+    if(++batch_count >= BATTERY_PERIOD) {
+        batch_count = 0;
+        adc_battery_request();
+    }
+    if(!measured) {
+        return 0;
+    }
+    return battery_millivolts(average);
+}
+
+/**
+ * Сохраняет калибровку в FRAM
+ */
+void battery_set_calibration(uint full_scale_mv, int offset_mv) {
+    FRAM_WRITE_ENABLE();
+    calibration.full_scale_mv = full_scale_mv;
+    calibration.offset_mv = offset_mv;
+    FRAM_WRITE_DISABLE();
+}
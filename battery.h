@@ -0,0 +1,10 @@
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include "utypes.h"
+
+void battery_start();
+uint battery_batch();
+void battery_set_calibration(uint full_scale_mv, int offset_mv);
+
+#endif //BATTERY_H
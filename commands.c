@@ -5,6 +5,12 @@
 #include "ads1292.h"
 #include "databatch.h"
 #include "leds.h"
+#include "rice.h"
+#include "dsp.h"
+#include "battery.h"
+#include "profiles.h"
+
+#define NULL 0
 
 #define FRAME_START  0xAA
 #define FRAME_STOP 0x55
@@ -15,6 +21,13 @@ FRAME_START|COMMAND_START|frame size(bytes)|COMMAND_MARKER|...|COMMAND_NEED_CONF
 Комманды высокой надежности, которые требуют подтверждения, сначала посылаются
 назад и выполняются только после того как придет подтверждение что команда принята правильно
 
+command that need confirm, with sequence number:
+FRAME_START|COMMAND_START|frame size(bytes)|COMMAND_MARKER|...|sequence|COMMAND_NEEDS_SEQUENCE_CONFIRM|FRAME_STOP
+Тоже посылаются назад, но ждут подтверждения в таблице (до PENDING_COMMANDS команд), поэтому хост может слать их
+подряд не дожидаясь эхо и подтвердить сразу несколько командой SEQUENCE_CONFIRMED. Команда выполняется так же
+как без номера (sequence убирается). Команда с номером который уже ждет подтверждения заменяет ждущую
+(так хост исправляет команду вернувшуюся с неправильным эхо). Если таблица полна, команда отбрасывается без эхо
+
 command that do not need confirm:
 FRAME_START|COMMAND_START|frame size(bytes)|COMMAND_MARKER|...|FRAME_STOP|FRAME_STOP
 Обычные команды, не требующие подтверждения, выполняются сразу
@@ -22,6 +35,7 @@ FRAME_START|COMMAND_START|frame size(bytes)|COMMAND_MARKER|...|FRAME_STOP|FRAME_
 
 #define COMMAND_START 0x5A
 #define COMMAND_NEEDS_CONFIRM 0xCC
+#define COMMAND_NEEDS_SEQUENCE_CONFIRM 0xCD
 
 /****** COMMANDS MARKERS *************/
 // Processor registers addresses are 16bit (2 bytes) LITTLE ENDIAN
@@ -38,6 +52,7 @@ FRAME_START|COMMAND_START|frame size(bytes)|COMMAND_MARKER|...|FRAME_STOP|FRAME_
 // FRAME_START|COMMAND_START|0X08|PROCESSOR_REGISTER_READ|reg_address_bottom|reg_address_top|FRAME_STOP|FRAME_STOP
 
 // ADS registers addresses are 8bit (1 byte)
+// читаются из копии регистров в RAM, а пишутся и во время записи (между DRDY, см. ads_write_regs())
 #define ADS_REGISTER_WRITE             0xA6
 // FRAME_START|COMMAND_START|0X08|ADS_REGISTER_WRITE|reg_address|reg_value|COMMAND_NEED_CONFIRM|FRAME_STOP
 
@@ -47,6 +62,70 @@ FRAME_START|COMMAND_START|frame size(bytes)|COMMAND_MARKER|...|FRAME_STOP|FRAME_
 #define ADS_START_RECORDING            0xA8
 // FRAME_START|COMMAND_START|0X08|ADS_START_RECORDING|divider_1|divider_2|COMMAND_NEED_CONFIRM|FRAME_STOP (двухканалка)
 // FRAME_START|COMMAND_START|0X0E|ADS_START_RECORDING|divider_1|...|divider_8|COMMAND_NEED_CONFIRM|FRAME_STOP (восьмиканалка)
+// у 4 и 6 каналов делителей 4 и 6 (размер кадра 0X0A и 0X0C)
+// после делителей могут идти формат пакета и параметр сжатия (см. databatch.h), по умолчанию PACKET_FORMAT_RAW:
+// FRAME_START|COMMAND_START|0X0A|ADS_START_RECORDING|divider_1|divider_2|packet_format|rice_k|COMMAND_NEED_CONFIRM|FRAME_STOP
+
+#define ADS_FILTER_SET                 0xB0
+// IIR фильтр канала (до децимации, см. dsp.c): звено section, коэффициенты b0, b1, b2, a1, a2 в Q30 по 4 байта LITTLE ENDIAN
+// FRAME_START|COMMAND_START|0X1C|ADS_FILTER_SET|channel|section|b0|b1|b2|a1|a2|COMMAND_NEED_CONFIRM|FRAME_STOP
+// выключить фильтр канала:
+// FRAME_START|COMMAND_START|0X08|ADS_FILTER_SET|channel|0xFF|COMMAND_NEED_CONFIRM|FRAME_STOP
+// channel = 0xFF - все каналы
+
+#define BATTERY_CALIBRATION            0xB1
+// калибровка батарейки, сохраняется в FRAM (см. battery.c): millivolts = adc * full_scale_mv / 4096 + offset_mv
+// FRAME_START|COMMAND_START|0X0A|BATTERY_CALIBRATION|full_scale_mv(2 bytes)|offset_mv(2 bytes, signed)|COMMAND_NEED_CONFIRM|FRAME_STOP
+
+#define ADC_CHANNELS_SET               0xB2
+// каналы ADC которые меряются в каждой серии (биты маски - A0..A11, little endian), применяются когда запись остановлена.
+// В пакет все каналы идут с форматом PACKET_ADC_SCAN (средние) или PACKET_ADC_SYNC (каждое измерение ADS, см. databatch.h)
+// FRAME_START|COMMAND_START|0X08|ADC_CHANNELS_SET|channel_mask_bottom|channel_mask_top|COMMAND_NEED_CONFIRM|FRAME_STOP
+
+#define STORE_AND_FORWARD_SET          0xB3
+// когда в очереди uart threshold пакетов и больше, пакеты откладываются в FRAM и отправляются позже
+// с флагом PACKET_REPLAYED (см. databatch.c). threshold = 0 - выключить. Только для packet_format != PACKET_FORMAT_RAW
+// FRAME_START|COMMAND_START|0X07|STORE_AND_FORWARD_SET|threshold|COMMAND_NEED_CONFIRM|FRAME_STOP
+
+#define BATCH_RESEND                   0xB4
+// повторно отправить count пакетов начиная с номера first_number (little endian) из истории последних пакетов
+// в FRAM, с флагом PACKET_REPLAYED и низким приоритетом (см. databatch.c). Хост шлет ее на пропуски номеров,
+// подтверждение не нужно: если команда потерялась, хост увидит что пропуск не заполнился и запросит снова
+// FRAME_START|COMMAND_START|0X09|BATCH_RESEND|first_number_bottom|first_number_top|count|FRAME_STOP|FRAME_STOP
+
+#define SEQUENCE_CONFIRMED             0xB5
+// выполнить в порядке прихода все команды ждущие подтверждения до команды с номером last_sequence включительно.
+// Если такой команды нет (уже выполнена), ничего не делает, поэтому повторять подтверждение безопасно
+// FRAME_START|COMMAND_START|0X07|SEQUENCE_CONFIRMED|last_sequence|FRAME_STOP|FRAME_STOP
+
+#define ADS_REGISTERS_WRITE            0xB6
+// записать n регистров ADS подряд начиная с start_address одной командой WREG (n = frame size - 7)
+// FRAME_START|COMMAND_START|0X07+n|ADS_REGISTERS_WRITE|start_address|value_1|...|value_n|COMMAND_NEED_CONFIRM|FRAME_STOP
+
+#define ADS_REGISTERS_READ             0xB7
+// прочитать count регистров ADS подряд начиная с start_address (не больше ADS_MAX_NUMBER_OF_REGISTERS),
+// ответ - MESSAGE_ADS_REGISTERS_MARKER
+// FRAME_START|COMMAND_START|0X08|ADS_REGISTERS_READ|start_address|count|FRAME_STOP|FRAME_STOP
+
+#define PROCESSOR_MEMORY_READ          0xB8
+// прочитать count байт памяти процессора начиная с address (не больше PROCESSOR_MEMORY_READ_MAX),
+// ответ - MESSAGE_PROCESSOR_MEMORY_MARKER
+// FRAME_START|COMMAND_START|0X09|PROCESSOR_MEMORY_READ|address_bottom|address_top|count|FRAME_STOP|FRAME_STOP
+
+#define PROFILE_SAVE                   0xB9
+// сохранить текущие настройки в профиль slot (0..PROFILES_NUMBER-1) в FRAM под именем name (8 байт, см. profiles.c):
+// регистры ADS, делители, формат пакета и rice_k последнего ADS_START_RECORDING, IIR фильтры каналов (ADS_FILTER_SET),
+// каналы ADC, порог store-and-forward
+// FRAME_START|COMMAND_START|0X0F|PROFILE_SAVE|slot|name_1|...|name_8|COMMAND_NEED_CONFIRM|FRAME_STOP
+
+#define PROFILE_START                  0xBA
+// записать в ADS и databatch все настройки профиля slot и начать запись (идущая запись сначала останавливается).
+// Профиль сохраненный на ADS с другим ID (модель, число каналов) не применяется
+// FRAME_START|COMMAND_START|0X07|PROFILE_START|slot|COMMAND_NEED_CONFIRM|FRAME_STOP
+
+#define PROFILE_LIST                   0xBB
+// имена сохраненных профилей, ответ - MESSAGE_PROFILES_MARKER
+// FRAME_START|COMMAND_START|0X06|PROFILE_LIST|FRAME_STOP|FRAME_STOP
 
 // one byte commands
 #define ADS_STOP_RECORDING             0xA9
@@ -54,6 +133,7 @@ FRAME_START|COMMAND_START|frame size(bytes)|COMMAND_MARKER|...|FRAME_STOP|FRAME_
 #define HARDWARE_REQUEST               0xAC
 #define PING                           0xAD
 #define COMMAND_CONFIRMED              0xAE
+#define STATUS_REQUEST                 0xAF
 // FRAME_START|COMMAND_START|0X06|COMMAND_MARKER|COMMAND_NEED_CONFIRM|FRAME_STOP
 // FRAME_START|COMMAND_START|0X06|COMMAND_MARKER|FRAME_STOP|FRAME_STOP
 
@@ -69,14 +149,41 @@ FRAME_START|MESSAGE_START|frame size(bytes)|MESSAGE_MARKER|...|FRAME_STOP
 #define MESSAGE_HARDWARE_MARKER 0xA4
 // FRAME_START|MESSAGE_START|0X06|MESSAGE_HARDWARE_MARKER|0x02|FRAME_STOP  (двухканалка)
 // FRAME_START|MESSAGE_START|0X06|MESSAGE_HARDWARE_MARKER|0x08|FRAME_STOP (восьмиканалка)
+// 0x04 и 0x06 - ADS на 4 и 6 каналов
+
+#define MESSAGE_STATUS_MARKER 0xA1
+// FRAME_START|MESSAGE_START|0X09|MESSAGE_STATUS_MARKER|batch_overruns(2 bytes)|rx_overruns(2 bytes)|FRAME_STOP
+// batch_overruns - сколько пакетов потеряно с начала записи из-за того что uart не успевал (little endian)
+// rx_overruns - сколько байт команд пропало с включения из-за переполнения входящего fifo uart (little endian)
+
+#define MESSAGE_ADS_REGISTERS_MARKER 0xA6
+// FRAME_START|MESSAGE_START|0X07+count|MESSAGE_ADS_REGISTERS_MARKER|start_address|count|value_1|...|value_count|FRAME_STOP
+
+#define MESSAGE_PROCESSOR_MEMORY_MARKER 0xA7
+// FRAME_START|MESSAGE_START|0X08+count|MESSAGE_PROCESSOR_MEMORY_MARKER|address_bottom|address_top|count|byte_1|...|byte_count|FRAME_STOP
+
+#define MESSAGE_PROFILES_MARKER 0xA8
+// для каждого из PROFILES_NUMBER профилей: saved (1 - сохранен, 0 - пустой) и имя (8 байт)
+// FRAME_START|MESSAGE_START|0X29|MESSAGE_PROFILES_MARKER|saved_0|name_0(8 bytes)|...|saved_3|name_3(8 bytes)|FRAME_STOP
 /**===========================================================================*/
 #define MSG_HELLO_SIZE 0X05
 static uchar message_hello[] = {FRAME_START, MESSAGE_START, MSG_HELLO_SIZE, MESSAGE_HELLO_MARKER, FRAME_STOP};
 #define MSG_HARDWARE_SIZE 0X06
 static uchar message_hardware[] = {FRAME_START, MESSAGE_START, MSG_HARDWARE_SIZE, MESSAGE_HARDWARE_MARKER, 0x02, FRAME_STOP};
+#define MSG_STATUS_SIZE 0X09
+static uchar message_status[] = {FRAME_START, MESSAGE_START, MSG_STATUS_SIZE, MESSAGE_STATUS_MARKER, 0x00, 0x00, 0x00, 0x00, FRAME_STOP};
+#define MSG_ADS_REGISTERS_HEADER_SIZE 6
+static uchar message_ads_registers[MSG_ADS_REGISTERS_HEADER_SIZE + ADS_MAX_NUMBER_OF_REGISTERS + 1];
+#define MSG_PROCESSOR_MEMORY_HEADER_SIZE 7
+#define PROCESSOR_MEMORY_READ_MAX 128
+static uchar message_processor_memory[MSG_PROCESSOR_MEMORY_HEADER_SIZE + PROCESSOR_MEMORY_READ_MAX + 1];
+#define MSG_PROFILES_SIZE (4 + PROFILES_NUMBER * (1 + PROFILE_NAME_SIZE) + 1)
+static uchar message_profiles[MSG_PROFILES_SIZE];
 
-#define ADS_MAX_NUMBER_OF_SIGNALS 8
-#define MAX_COMMAND_LENGTH 16
+#define MAX_COMMAND_LENGTH 32
+#define MIN_COMMAND_LENGTH 6 // FRAME_START|COMMAND_START|size|COMMAND_MARKER|FRAME_STOP/COMMAND_NEED_CONFIRM|FRAME_STOP
+#define ADS_FILTER_SET_SIZE (6 + 4 * DSP_BIQUAD_COEFFICIENTS + 2)
+#define ADS_FILTER_OFF 0xFF
 static uchar buffer0[MAX_COMMAND_LENGTH];
 static uchar buffer1[MAX_COMMAND_LENGTH];
 static uchar* fill_buffer = buffer0; // ссылка на буфер для заполнения
@@ -85,13 +192,288 @@ static uchar* command_buffer = buffer1;
 static uchar fill_buffer_index;
 static uchar command_length;
 static bool command_buffered;
-static uchar ads_dividers[ADS_MAX_NUMBER_OF_SIGNALS];
+static uchar ads_dividers[ADS_MAX_NUMBER_OF_CHANNELS];
+// настройки присланные командами, из них PROFILE_SAVE собирает профиль
+static profile settings = {0, {0}, 0, {0}, {1, 1, 1, 1, 1, 1, 1, 1}, PACKET_FORMAT_RAW, RICE_DEFAULT_K, 0, 0, {0}, {{{0}}}};
+// ответы уходят из очереди uart позже, поэтому хранятся не на стеке и отправляются прямо из своих буферов.
+// Буфер нельзя менять пока его ответ в очереди: у каждого изменяемого буфера свой счетчик ответов,
+// и только команда которой нужен занятый буфер ждет его отправки (frame_waiting), вместе с командами после нее.
+// Команды с другими буферами разбираются и отвечают сразу, так что пачка команд не переполняет входящий fifo
+typedef struct {
+    uchar queued;
+    volatile uchar sent; // увеличивает прерывание uart когда ответ отправлен
+} reply_buffer;
+static uchar ads_register_value;
+static uchar processor_register_value; // копия: регистр может измениться пока байт ждет в очереди
+static reply_buffer ads_register_reply;
+static reply_buffer processor_register_reply;
+static reply_buffer ads_registers_reply;
+static reply_buffer processor_memory_reply;
+static reply_buffer profiles_reply;
+static reply_buffer status_reply;
+static reply_buffer command_buffer_reply; // эхо команды с подтверждением (из command_buffer)
+static bool frame_waiting; // разобранный кадр в fill_buffer ждет освобождения буфера ответа
+
+// команды с номером ждущие подтверждения, кольцо в порядке прихода (эхо отправляется прямо из него)
+#define PENDING_COMMANDS 8
+static uchar pending_commands[PENDING_COMMANDS][MAX_COMMAND_LENGTH];
+static uchar pending_first;  // самая старая ждущая команда
+static uchar pending_count;
+static reply_buffer pending_replies[PENDING_COMMANDS]; // эхо из pending_commands
+static uchar sequenced_command[MAX_COMMAND_LENGTH]; // выполняемая команда без номера
+static uchar confirmed_left; // сколько подтвержденных команд еще ждут выполнения (освобождения буфера ответа)
 
 #define REGISTER_ADDRESS(byte_bottom, byte_top) ((unsigned char*)byte_bottom + (byte_top << 8))
 
+/*
+ * Начало ответа: FRAME_START|MESSAGE_START|size|marker, FRAME_STOP в конце. Возвращает размер
+ */
+static uchar message_frame(uchar* message, uchar marker, uchar size) {
+    message[0] = FRAME_START;
+    message[1] = MESSAGE_START;
+    message[2] = size;
+    message[3] = marker;
+    message[size - 1] = FRAME_STOP;
+    return size;
+}
+
+/*
+ * Ставит ответ из message в очередь uart, buffer (если не NULL) считает ответы из этого буфера.
+ * Если очередь полна, ответ теряется (хост повторит команду)
+ */
+static void reply(uchar* message, uchar size, reply_buffer* buffer) {
+    if (uart_transmit_queued(message, size, UART_PRIORITY_HIGH, buffer != NULL ? &buffer->sent : NULL) &&
+        buffer != NULL) {
+        buffer->queued++;
+    }
+}
+
+static bool reply_free(reply_buffer* buffer) {
+    return buffer->queued == buffer->sent;
+}
+
+/*
+ * Буфер в который команда с маркером marker пишет ответ (NULL если ответа нет или буфер не меняется)
+ */
+static reply_buffer* command_reply(uchar marker) {
+    if (marker == PROCESSOR_REGISTER_READ) {
+        return &processor_register_reply;
+    } else if (marker == ADS_REGISTER_READ) {
+        return &ads_register_reply;
+    } else if (marker == ADS_REGISTERS_READ) {
+        return &ads_registers_reply;
+    } else if (marker == PROCESSOR_MEMORY_READ) {
+        return &processor_memory_reply;
+    } else if (marker == PROFILE_LIST) {
+        return &profiles_reply;
+    } else if (marker == STATUS_REQUEST) {
+        return &status_reply;
+    }
+    return NULL;
+}
+
+/*
+ * true если буфер ответа команды свободен и ее можно выполнять
+ * (для COMMAND_CONFIRMED - буфер ответа подтверждаемой команды)
+ */
+static bool command_ready(uchar* command) {
+    reply_buffer* buffer;
+    if (command[3] == COMMAND_CONFIRMED && command_buffered) {
+        command = command_buffer;
+    }
+    buffer = command_reply(command[3]);
+    return buffer == NULL || reply_free(buffer);
+}
+
+static void do_command(uchar *command);
+
+static uchar pending_index(uchar i) {
+    i += pending_first;
+    if (i >= PENDING_COMMANDS) {
+        i -= PENDING_COMMANDS;
+    }
+    return i;
+}
+
+static uchar* pending_command(uchar i) {
+    return pending_commands[pending_index(i)];
+}
+
+static uchar command_sequence(uchar* command) {
+    return command[command[2] - 3];
+}
+
+/*
+ * Команда с номером пришла: кладем в таблицу (или заменяем ждущую с тем же номером) и отправляем назад.
+ * false если эхо прошлой команды из этого места таблицы еще в очереди uart (команда подождет)
+ */
+static bool buffer_sequenced_command(uchar* command) {
+    uchar slot;
+    uchar i;
+    // подтверждения не ждут подтверждения, иначе выполнение таблицы вызывало бы само себя
+    if (command[2] <= MIN_COMMAND_LENGTH || command[3] == COMMAND_CONFIRMED || command[3] == SEQUENCE_CONFIRMED) {
+        return true;
+    }
+    for (i = 0; i < pending_count; i++) {
+        if (command_sequence(pending_command(i)) == command_sequence(command)) {
+            break;
+        }
+    }
+    if (i == PENDING_COMMANDS) {
+        return true; // таблица полна: хост не получит эхо и пошлет команду снова
+    }
+    slot = pending_index(i);
+    if (!reply_free(&pending_replies[slot])) {
+        return false;
+    }
+    if (i == pending_count) {
+        pending_count++;
+    }
+    for (i = 0; i < command[2]; i++) {
+        pending_commands[slot][i] = command[i];
+    }
+    reply(pending_commands[slot], command[2], &pending_replies[slot]);
+    return true;
+}
+
+/*
+ * Выполняет подтвержденные команды от самой старой. Команда которой нужен буфер ответа
+ * еще стоящий в очереди uart останавливает выполнение, ее и остальные выполнит следующий вызов
+ */
+static void run_confirmed() {
+    uchar i;
+    for (; confirmed_left > 0 && command_ready(pending_command(0)); confirmed_left--) {
+        uchar* command = pending_command(0);
+        uchar size = command[2];
+        // убираем sequence: дальше это обычная команда с подтверждением
+        for (i = 0; i < size - 3; i++) {
+            sequenced_command[i] = command[i];
+        }
+        sequenced_command[2] = size - 1;
+        sequenced_command[size - 3] = COMMAND_NEEDS_CONFIRM;
+        sequenced_command[size - 2] = FRAME_STOP;
+        if (++pending_first == PENDING_COMMANDS) {
+            pending_first = 0;
+        }
+        pending_count--;
+        do_command(sequenced_command);
+    }
+}
+
+/*
+ * Выполняет ждущие команды от самой старой до команды с номером last_sequence включительно
+ */
+static void confirm_sequence(uchar last_sequence) {
+    uchar confirmed;
+    for (confirmed = 0; confirmed < pending_count; confirmed++) {
+        if (command_sequence(pending_command(confirmed)) == last_sequence) {
+            confirmed_left = confirmed + 1;
+            run_confirmed();
+            return;
+        }
+    }
+}
+
+/*
+ * Запоминает в settings фильтр заданный ADS_FILTER_SET, так же как databatch_set_filter()
+ * и databatch_clear_filter() (coefficients == NULL - выключить фильтр канала)
+ */
+static void remember_filter(uchar channel, uchar section, long* coefficients) {
+    uchar i;
+    uchar j;
+    if (coefficients != NULL && section >= DSP_MAX_BIQUADS) {
+        return;
+    }
+    for (i = 0; i < ADS_MAX_NUMBER_OF_CHANNELS; i++) {
+        if (channel == i || channel == DATABATCH_ALL_CHANNELS) {
+            if (coefficients == NULL) {
+                settings.filter_sections[i] = 0;
+            } else {
+                for (j = 0; j < DSP_BIQUAD_COEFFICIENTS; j++) {
+                    settings.filter_coefficients[i][section][j] = coefficients[j];
+                }
+                settings.filter_sections[i] |= (uchar)(1 << section);
+            }
+        }
+    }
+}
+
+/*
+ * Текущие настройки (регистры ADS - из их копии в RAM) сохраняются в профиль slot
+ */
+static void save_profile(uchar slot, uchar* name) {
+    uchar i;
+    for (i = 0; i < PROFILE_NAME_SIZE; i++) {
+        settings.name[i] = name[i];
+    }
+    settings.number_of_registers = ads_number_of_registers();
+    ads_read_regs(0, settings.ads_registers, settings.number_of_registers);
+    profiles_save(slot, &settings);
+}
+
+/*
+ * Пишет в ADS регистры профиля кроме тех что ADS только читает (ID, LOFF_STAT):
+ * каждый непрерывный участок остальных регистров - одной командой WREG
+ */
+static void restore_ads_registers() {
+    uchar first = 1; // ID только читается
+    uchar address;
+    for (address = first; address <= settings.number_of_registers; address++) {
+        if (address == settings.number_of_registers || ads_register_read_only(address)) {
+            if (address > first) {
+                ads_write_regs(first, &settings.ads_registers[first], address - first);
+            }
+            first = address + 1;
+        }
+    }
+}
+
+/*
+ * Применяет профиль slot и начинает запись
+ */
+static void start_profile(uchar slot) {
+    const profile* stored = profiles_get(slot);
+    uchar i;
+    uchar section;
+    // у ADS1294/6/8 одинаковое число регистров, поэтому сравниваем ID
+    if (stored == NULL || stored->number_of_registers != ads_number_of_registers() ||
+        stored->ads_registers[ADS_ID_REGISTER] != ads_read_reg(ADS_ID_REGISTER)) {
+        return;
+    }
+    settings = *stored;
+    databatch_stop_recording(); // каналы ADC меняются только между записями, регистры ADS - без RDATAC
+    restore_ads_registers();
+    databatch_set_adc_channels(settings.adc_channels);
+    databatch_set_store_and_forward(settings.store_threshold);
+    databatch_clear_filter(DATABATCH_ALL_CHANNELS);
+    for (i = 0; i < ADS_MAX_NUMBER_OF_CHANNELS; i++) {
+        ads_dividers[i] = settings.dividers[i];
+        for (section = 0; section < DSP_MAX_BIQUADS; section++) {
+            if (settings.filter_sections[i] & (1 << section)) {
+                databatch_set_filter(i, section, settings.filter_coefficients[i][section]);
+            }
+        }
+    }
+    databatch_start_recording(ads_dividers, settings.packet_format, settings.rice_k);
+}
+
+static void list_profiles() {
+    uchar* entry = message_profiles + 4;
+    uchar slot;
+    uchar i;
+    for (slot = 0; slot < PROFILES_NUMBER; slot++) {
+        const profile* stored = profiles_get(slot);
+        *entry++ = stored != NULL;
+        for (i = 0; i < PROFILE_NAME_SIZE; i++) {
+            *entry++ = stored != NULL ? stored->name[i] : 0;
+        }
+    }
+    reply(message_profiles, message_frame(message_profiles, MESSAGE_PROFILES_MARKER, MSG_PROFILES_SIZE), &profiles_reply);
+}
+
 // TODO PING
 static void do_command(uchar *command) {
-    uchar number_of_signals = 2;
+    uchar number_of_signals = ads_number_of_signals(); // 2, 4, 6 или 8, определяется при старте ADS
     uchar command_marker = command[3];
     /************** PROCESSOR REGISTERS *******************/
     // Processor register address is 2 bytes. Must be send in little endian order
@@ -105,35 +487,112 @@ static void do_command(uchar *command) {
         uchar *address = REGISTER_ADDRESS(command[4], command[5]);
         *address &= ~command[6];
     } else if (command_marker == PROCESSOR_REGISTER_READ) {
-        uchar *address = REGISTER_ADDRESS(command[4], command[5]);
-        uart_flush(); // ждем завершения отправки по uart
-        uart_transmit(address, 1);
+        processor_register_value = *REGISTER_ADDRESS(command[4], command[5]);
+        reply(&processor_register_value, 1, &processor_register_reply);
     }
         /************** ADS REGISTERS *******************/
         // Ads register address is 1 byte.
     else if (command_marker == ADS_REGISTER_WRITE) {
         ads_write_regs(command[4], &command[5], 1);
     } else if (command_marker == ADS_REGISTER_READ) {
-        uchar ch = ads_read_reg(command[4]);
-        uart_flush(); // ждем завершения отправки по uart
-        uart_transmit(&ch, 1);
+        ads_register_value = ads_read_reg(command[4]);
+        reply(&ads_register_value, 1, &ads_register_reply);
+    } else if (command_marker == ADS_REGISTERS_WRITE) {
+        if (command[2] > 7) {
+            ads_write_regs(command[4], &command[5], command[2] - 7);
+        }
+    } else if (command_marker == ADS_REGISTERS_READ) {
+        uchar count = command[5];
+        if (count > 0 && count <= ADS_MAX_NUMBER_OF_REGISTERS) {
+            message_ads_registers[4] = command[4];
+            message_ads_registers[5] = count;
+            ads_read_regs(command[4], &message_ads_registers[MSG_ADS_REGISTERS_HEADER_SIZE], count);
+            reply(message_ads_registers, message_frame(message_ads_registers, MESSAGE_ADS_REGISTERS_MARKER,
+                                                       MSG_ADS_REGISTERS_HEADER_SIZE + count + 1),
+                  &ads_registers_reply);
+        }
+    } else if (command_marker == PROCESSOR_MEMORY_READ) {
+        uchar *address = REGISTER_ADDRESS(command[4], command[5]);
+        uchar count = command[6];
+        if (count > 0 && count <= PROCESSOR_MEMORY_READ_MAX) {
+            message_processor_memory[4] = command[4];
+            message_processor_memory[5] = command[5];
+            message_processor_memory[6] = count;
+            for (uchar i = 0; i < count; i++) {
+                message_processor_memory[MSG_PROCESSOR_MEMORY_HEADER_SIZE + i] = address[i];
+            }
+            reply(message_processor_memory, message_frame(message_processor_memory, MESSAGE_PROCESSOR_MEMORY_MARKER,
+                                                          MSG_PROCESSOR_MEMORY_HEADER_SIZE + count + 1),
+                  &processor_memory_reply);
+        }
     }
         /************** MACRO COMMANDS *******************/
     else if (command_marker == ADS_START_RECORDING) {
         for (int i = 0; i < number_of_signals; ++i) {
             ads_dividers[i] = command[4 + i];
         }
-        databatch_start_recording(ads_dividers);
+        uchar packet_format = PACKET_FORMAT_RAW;
+        uchar rice_k = RICE_DEFAULT_K;
+        // command[2] - размер кадра, последние 2 байта служебные
+        if (command[2] > 4 + number_of_signals + 2) {
+            packet_format = command[4 + number_of_signals];
+        }
+        if (command[2] > 5 + number_of_signals + 2) {
+            rice_k = command[5 + number_of_signals];
+        }
+        databatch_start_recording(ads_dividers, packet_format, rice_k);
+        for (int i = 0; i < number_of_signals; ++i) {
+            settings.dividers[i] = ads_dividers[i]; // уже проверенные databatch
+        }
+        settings.packet_format = packet_format;
+        settings.rice_k = rice_k;
+    } else if (command_marker == ADS_FILTER_SET) {
+        if (command[5] == ADS_FILTER_OFF || command[2] < ADS_FILTER_SET_SIZE) {
+            databatch_clear_filter(command[4]);
+            remember_filter(command[4], 0, NULL);
+        } else {
+            long coefficients[DSP_BIQUAD_COEFFICIENTS];
+            for (int i = 0; i < DSP_BIQUAD_COEFFICIENTS; ++i) {
+                uchar* value = &command[6 + 4 * i];
+                coefficients[i] = (long)value[0] | ((long)value[1] << 8) | ((long)value[2] << 16) | ((long)(signed char)value[3] << 24);
+            }
+            databatch_set_filter(command[4], command[5], coefficients);
+            remember_filter(command[4], command[5], coefficients);
+        }
+    } else if (command_marker == BATTERY_CALIBRATION) {
+        battery_set_calibration(command[4] | ((uint)command[5] << 8), (int)(((signed char)command[7] << 8) | command[6]));
+    } else if (command_marker == ADC_CHANNELS_SET) {
+        settings.adc_channels = command[4] | ((uint)command[5] << 8);
+        databatch_set_adc_channels(settings.adc_channels);
+    } else if (command_marker == STORE_AND_FORWARD_SET) {
+        settings.store_threshold = command[4];
+        databatch_set_store_and_forward(command[4]);
+    } else if (command_marker == PROFILE_SAVE) {
+        save_profile(command[4], &command[5]);
+    } else if (command_marker == PROFILE_START) {
+        start_profile(command[4]);
+    } else if (command_marker == PROFILE_LIST) {
+        list_profiles();
+    } else if (command_marker == SEQUENCE_CONFIRMED) {
+        confirm_sequence(command[4]);
+    } else if (command_marker == BATCH_RESEND) {
+        databatch_resend(command[4] | ((uint)command[5] << 8), command[6]);
     } else if (command_marker == ADS_STOP_RECORDING) {
         databatch_stop_recording();
     } else if (command_marker == HELLO_REQUEST) {
-        uart_flush(); // ждем завершения отправки по uart
-        uart_transmit(message_hello, MSG_HELLO_SIZE);
+        reply(message_hello, MSG_HELLO_SIZE, NULL); // не меняется
     } else if (command_marker == HARDWARE_REQUEST) {
-        // предпоследний байт содержит информацию о числе каналов ADS (2 или 8)
+        // предпоследний байт содержит информацию о числе каналов ADS (2, 4, 6 или 8)
         message_hardware[MSG_HARDWARE_SIZE - 2] = number_of_signals;
-        uart_flush(); // ждем завершения отправки по uart
-        uart_transmit(message_hardware, MSG_HARDWARE_SIZE);
+        reply(message_hardware, MSG_HARDWARE_SIZE, NULL); // число каналов не меняется
+    } else if (command_marker == STATUS_REQUEST) {
+        uint overruns = databatch_overruns();
+        message_status[4] = (uchar)overruns;
+        message_status[5] = (uchar)(overruns >> 8);
+        overruns = uart_rx_overruns();
+        message_status[6] = (uchar)overruns;
+        message_status[7] = (uchar)(overruns >> 8);
+        reply(message_status, MSG_STATUS_SIZE, &status_reply);
     } else if (command_marker == COMMAND_CONFIRMED) {
         if (command_buffered) {
             command_buffered = false;
@@ -142,43 +601,113 @@ static void do_command(uchar *command) {
     }
 }
 
-void commands_process() {
-    uchar ch;
-    if(uart_read(&ch)) { // если в uart прилетел символ
-        if (fill_buffer_index == 0 && ch == FRAME_START) {
-            fill_buffer[fill_buffer_index++] = ch;
-        } else if (fill_buffer_index == 1 && ch == COMMAND_START) {
-            fill_buffer[fill_buffer_index++] = ch;
-        } else if (fill_buffer_index == 2 && ch < MAX_COMMAND_LENGTH) {
-            fill_buffer[fill_buffer_index++] = ch;
-            command_length = ch;
-        } else if (fill_buffer_index > 2 && fill_buffer_index < (command_length - 1)) {
-            fill_buffer[fill_buffer_index++] = ch;
-        } else if ((fill_buffer_index == (command_length - 1)) && (ch == FRAME_STOP)) {
-            fill_buffer[fill_buffer_index] = ch;
-            // проверяем предпоследний байт
-            if (fill_buffer[fill_buffer_index - 1] == FRAME_STOP) { // команда не требует подтверждения
-                do_command(fill_buffer);
-                fill_buffer_index = 0;
-            } else if (fill_buffer[fill_buffer_index - 1] == COMMAND_NEEDS_CONFIRM) { // комманда требует подтверждения
-                //swap double buffers
-                uchar *tmp = command_buffer;
-                command_buffer = fill_buffer;
-                fill_buffer = tmp;
-                uart_flush(); // ждем завершения отправки по uart
-                // отправляем команду назад на проверку
-                uart_transmit(command_buffer, command_length);
-                //выставляем флаг
-                command_buffered = true;
-                fill_buffer_index = 0;
-            } else {
-                fill_buffer_index = 0; //invalid command
-            }
-        } else {
-            fill_buffer_index = 0; //invalid command
+/*
+ * Последний байт команды пришел: выполняем ее сразу или отправляем назад на подтверждение.
+ * false если команде нужен буфер ответа который еще в очереди uart, или еще выполняются
+ * подтвержденные команды (порядок сохраняется): кадр остается в fill_buffer до следующего вызова
+ */
+static bool dispatch_command() {
+    uchar last = fill_buffer_index - 1;
+    if (fill_buffer[last] != FRAME_STOP) {
+        return true; //invalid command
+    }
+    if (confirmed_left > 0) {
+        return false;
+    }
+    // проверяем предпоследний байт
+    if (fill_buffer[last - 1] == FRAME_STOP) { // команда не требует подтверждения
+        if (!command_ready(fill_buffer)) {
+            return false;
         }
+        do_command(fill_buffer);
+    } else if (fill_buffer[last - 1] == COMMAND_NEEDS_CONFIRM) { // комманда требует подтверждения
+        // command_buffer станет буфером для заполнения: его прошлое эхо должно уйти
+        if (!reply_free(&command_buffer_reply)) {
+            return false;
+        }
+        //swap double buffers
+        uchar *tmp = command_buffer;
+        command_buffer = fill_buffer;
+        fill_buffer = tmp;
+        // отправляем команду назад на проверку
+        reply(command_buffer, command_length, &command_buffer_reply);
+        //выставляем флаг
+        command_buffered = true;
+    } else if (fill_buffer[last - 1] == COMMAND_NEEDS_SEQUENCE_CONFIRM) {
+        return buffer_sequenced_command(fill_buffer);
+    }
+    return true;
+}
+
+/******* разбор кадров команд: конечный автомат ******
+ * Для каждого состояния в таблице parser_steps функция, которая принимает байт
+ * и возвращает следующее состояние. Байт который не подходит к кадру начинает поиск
+ * нового кадра (и сам может оказаться его FRAME_START)
+ */
+typedef enum {
+    WAIT_FRAME_START,
+    WAIT_COMMAND_START,
+    WAIT_SIZE,
+    WAIT_BODY,
+    NUMBER_OF_PARSER_STATES
+} PARSER_STATE;
+
+static PARSER_STATE wait_frame_start(uchar ch) {
+    if (ch != FRAME_START) {
+        return WAIT_FRAME_START;
     }
+    fill_buffer[0] = ch;
+    fill_buffer_index = 1;
+    return WAIT_COMMAND_START;
 }
 
+static PARSER_STATE wait_command_start(uchar ch) {
+    if (ch != COMMAND_START) {
+        return wait_frame_start(ch);
+    }
+    fill_buffer[fill_buffer_index++] = ch;
+    return WAIT_SIZE;
+}
 
+static PARSER_STATE wait_size(uchar ch) {
+    if (ch < MIN_COMMAND_LENGTH || ch > MAX_COMMAND_LENGTH) {
+        return wait_frame_start(ch);
+    }
+    fill_buffer[fill_buffer_index++] = ch;
+    command_length = ch;
+    return WAIT_BODY;
+}
 
+static PARSER_STATE wait_body(uchar ch) {
+    fill_buffer[fill_buffer_index++] = ch;
+    if (fill_buffer_index < command_length) {
+        return WAIT_BODY;
+    }
+    frame_waiting = !dispatch_command();
+    return WAIT_FRAME_START;
+}
+
+static PARSER_STATE (*const parser_steps[NUMBER_OF_PARSER_STATES])(uchar ch) = {
+    wait_frame_start,
+    wait_command_start,
+    wait_size,
+    wait_body
+};
+static PARSER_STATE parser_state = WAIT_FRAME_START;
+
+/*
+ * Разбирает все байты накопившиеся во входящем fifo uart за один вызов:
+ * пачка команд от хоста выполняется за одно пробуждение main loop.
+ * Разбор останавливается только на кадре которому нужен буфер ответа еще стоящий в очереди uart:
+ * main loop разбудит конец отправки буфера, и кадр выполнится следующим вызовом
+ */
+void commands_process() {
+    uchar ch;
+    run_confirmed();
+    if (frame_waiting) {
+        frame_waiting = !dispatch_command();
+    }
+    while (!frame_waiting && uart_read(&ch)) {
+        parser_state = parser_steps[parser_state](ch);
+    }
+}
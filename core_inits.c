@@ -1,4 +1,4 @@
-#include <msp430fr2476.h>
+#include "hal.h"
 #include "utils.h"
 
 //This function stops the watchdog timer
@@ -0,0 +1,47 @@
+#include "hal.h"
+#include "utypes.h"
+#include "crc16.h"
+
+/**
+ * CRC-16/CCITT-FALSE (полином 0x1021, начальное значение 0xFFFF, без отражения и финального XOR),
+ * на "123456789" дает 0x29B1. На MSP430 считает модуль CRC16: байт записанный в CRCDIRB_L
+ * обрабатывается со старшего бита, как в стандарте CCITT, за один такт.
+ * Модуль CRC используется только из main loop.
+ */
+
+#ifndef __MSP430__
+static uint crc16_value;
+#endif
+
+void crc16_begin() {
+#ifdef __MSP430__
+    CRCINIRES = 0xFFFF;
+#else
+    crc16_value = 0xFFFF;
+#endif
+}
+
+void crc16_add(const uchar* data, uint size) {
+#ifdef __MSP430__
+    while(size-- > 0) {
+        CRCDIRB_L = *data++;
+    }
+#else
+    uchar bit;
+    while(size-- > 0) {
+        crc16_value ^= (uint)*data++ << 8;
+        for(bit = 0; bit < 8; bit++) {
+            crc16_value = (crc16_value & 0x8000) ? (crc16_value << 1) ^ 0x1021 : crc16_value << 1;
+        }
+        crc16_value &= 0xFFFF;
+    }
+#endif
+}
+
+uint crc16_result() {
+#ifdef __MSP430__
+    return CRCINIRES;
+#else
+    return crc16_value;
+#endif
+}
@@ -0,0 +1,10 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include "utypes.h"
+
+void crc16_begin();
+void crc16_add(const uchar* data, uint size);
+uint crc16_result();
+
+#endif //CRC16_H
@@ -1,4 +1,4 @@
-#include "msp430fr2476.h"
+#include "hal.h"
 #include <stdbool.h>
 #include "ads1292.h"
 #include "adc.h"
@@ -6,12 +6,20 @@
 #include "utypes.h"
 #include "uart.h"
 #include "leds.h"
+#include "rice.h"
+#include "dsp.h"
+#include "battery.h"
+#include "timestamp.h"
+#include "crc16.h"
+#include "batchlog.h"
+#include "databatch.h"
 
 #define START_MARKER 0xAA
 #define STOP_MARKER 0x55
 
 /**======================== Формат данных ======================
-Универсальный упаковщик и для 2х канальной адс и для 8 канальной
+Универсальный упаковщик и для 2х канальной адс и для 8 канальной.
+Число каналов определяется при старте по регистру ID ADS (ads_number_of_signals())
 
 Каждый пакет содержит 10 измерений от ADS + 1 измерение акселерометра по трем осям - X, Y, Z  + 1 измерение батарейки
 Каждый sample данных ADS занимает 3 байта.
@@ -24,8 +32,13 @@
  1 sample from accelerometer_x channel (2 bytes) //if accelerometer enabled
  1 sample from accelerometer_y channel (2 bytes) //if accelerometer enabled
  1 sample from accelerometer_Z channel (2 bytes) //if accelerometer enabled
- 1 sample with BatteryVoltage info (2 bytes) //if BatteryVoltageMeasure  enabled
- 1 byte(for 2 channels) or 2 bytes(for 8 channels) with lead-off detection info (if lead-off detection enabled) //сейчас пока этого нет
+ 1 sample with BatteryVoltage info (2 bytes) // милливольты, среднее измерений раз в секунду (battery.c)
+ 1 byte(for 2 channels) or 2 bytes(for 8 channels) with lead-off detection info (if PACKET_LOFF)
+ raw accelerometer samples: count (1 byte) + count * 6 bytes (if PACKET_ACC_RAW)
+ all ADC channels: count (1 byte) + count * 2 bytes (if PACKET_ADC_SCAN)
+ ADC channels of every ADS sample: count (1 byte) + 10 * count * 2 bytes (if PACKET_ADC_SYNC)
+ timestamp of the first ADS sample (4 bytes) (if PACKET_TIMESTAMP)
+ CRC16 of the batch (2 bytes) (if PACKET_CRC)
 
 Количество самплов от ADS по каналу i:  n_i = 10/ divider_i
 Последовательность байт в пакете Little Endian
@@ -34,28 +47,171 @@
 и имеет следующий вид:
 START_MARKER|START_MARKER|номер пакета(2bytes)|данные . . .|STOP_MARKER
 
+Если при старте записи задан packet_format отличный от PACKET_FORMAT_RAW, то после номера пакета
+идет байт с packet_format (флаги формата, см. databatch.h):
+START_MARKER|START_MARKER|номер пакета(2bytes)|packet_format|данные . . .|STOP_MARKER
+
+PACKET_RICE: данные ADS сжаты (дельта + Райс с параметром k из ADS_START_RECORDING, см. rice.c)
+и перед ними стоит байт с длиной сжатых данных:
+ ads_data_length(1 byte)|сжатые данные всех каналов ADS (ads_data_length bytes)|остальные данные как обычно
+Если сжатие не дает выигрыша ads_data_length = 0 и данные ADS идут несжатыми (n_i * 3 bytes на канал)
+
+PACKET_LOFF: после батарейки идет lead-off статус ADS: биты LOFF из status word всех 10 измерений пакета
+объединенные по ИЛИ (1 - электрод отвалился хотя бы в одном измерении):
+ двухканалка:   1 byte  - LOFF_STAT[4:0] (RLD, IN2N, IN2P, IN1N, IN1P)
+ 4, 6 и 8 каналов: 2 bytes - LOFF_STATP[7:0] (входы IN1P..IN8P), LOFF_STATN[7:0] (IN1N..IN8N)
+Сами компараторы lead-off включаются записью регистров ADS (ADS_REGISTER_WRITE)
+
+PACKET_ACC_RAW: после lead-off статуса (если он есть) идут все samples акселерометра пришедшие за пакет,
+а не только среднее (среднее по-прежнему стоит на своем месте):
+ count(1 byte)|x_0 y_0 z_0 (6 bytes)| ... |x_count-1 y_count-1 z_count-1
+Длина переменная: акселерометр меряет с частотой 1.1 кГц независимо от ADS (больше ACC_RAW_MAX_SAMPLES не пишем).
+Если акселерометр выключен count = 0
+
+PACKET_ADC_SCAN: в самом конце пакета средние всех каналов ADC заданных командой ADC_CHANNELS_SET
+(на обычном месте ADC по-прежнему только первый из них):
+ count(1 byte)|adc_0 (2 bytes)| ... |adc_count-1 (2 bytes)
+каналы по возрастанию номера (A0..A11). Если ADC выключен count = 0
+
+PACKET_ADC_SYNC: серии ADC запускает не Timer_B0, а прерывание DRDY ADS, то есть каждый канал ADC меряется
+в момент каждого измерения ADS (задержка от DRDY - несколько мкс, одна и та же). В конце пакета (после PACKET_ADC_SCAN)
+идут каналы ADC всех 10 измерений пакета, 12 бит как есть:
+ count(1 byte)|measuring_0: adc_0 ... adc_count-1 (count * 2 bytes)| ... |measuring_9: adc_0 ... adc_count-1
+measuring_i снят в тот же момент что и i-е измерение ADS пакета (до децимации). 0xFFFF - серии для этого измерения нет
+(ADC был занят). Если ADC выключен count = 0
+
+PACKET_TIMESTAMP: в конце пакета (после PACKET_ADC_SYNC) время DRDY первого из 10 измерений ADS пакета (до децимации),
+32 бита в тактах кварца XT1 (32768 Гц) с включения прибора (timestamp.c), переполняется через 36 часов:
+ timestamp(4 bytes)
+Номер пакета 16-битный и при 500 SPS переполняется за 22 минуты, а по меткам времени хост
+находит уход кварца относительно своих часов (host/clock_drift.c)
+
+PACKET_CRC: перед STOP_MARKER идет CRC-16/CCITT-FALSE (crc16.c) всех байт пакета от номера пакета
+до последнего байта данных включительно (без START_MARKER, STOP_MARKER и самой CRC):
+START_MARKER|START_MARKER|номер пакета(2bytes)|packet_format|данные . . .|crc(2 bytes)|STOP_MARKER
+Хост отбрасывает пакет если CRC не совпала (испорченный по Bluetooth пакет иначе проходит проверку маркеров)
+
+PACKET_REPLAYED: этот бит выставлен в packet_format пакетов которые были отложены в FRAM (store-and-forward,
+команда STORE_AND_FORWARD_SET, batchlog.c) и отправлены позже, между живыми пакетами. Номер пакета и данные
+те же что были бы у живого пакета, CRC (если есть) пересчитана с выставленным битом. Хост вставляет такие
+пакеты в пропуски номеров. При PACKET_FORMAT_RAW байта packet_format нет и пакеты в FRAM не откладываются.
+Тем же битом помечены пакеты повторно отправленные из истории по команде BATCH_RESEND: последние готовые пакеты
+(и потерянные из-за переполнения кольца тоже) записываются в FRAM, хост запрашивает пропущенные номера
+
  =========================================================**/
 
-#define ADS_NUMBER_OF_CHANNELS 2
 #define ADS_NUMBER_OF_MESURING 10 // 10 измерений на пакет
 #define ADS_BYTES_PER_CHANNEL  (ADS_NUMBER_OF_MESURING * 3)
-#define ADS_BATCH_SIZE (ADS_BYTES_PER_CHANNEL * ADS_NUMBER_OF_CHANNELS)  // 10 измерений, по 3 байта на каждый канал
+#define ADS_MAX_BATCH_SIZE (ADS_BYTES_PER_CHANNEL * ADS_MAX_NUMBER_OF_CHANNELS)  // 10 измерений, по 3 байта на каждый канал
 #define ACC_ADC_DATA_SIZE 8 //4 канала по 2 байта каждый (3 канала акселерометра + батарейка)
 #define BATCH_HEADER_SIZE 4 // start byte/start_byte/ batch_number (2 bytes)
+#define BATCH_FORMAT_SIZE 2 // packet_format + ads_data_length (если заданы)
+#define BATCH_LOFF_MAX_SIZE 2 // lead-off статус (если задан PACKET_LOFF)
+#define BATCH_ACC_RAW_MAX_SIZE (1 + ACC_RAW_MAX_SAMPLES * 6) // samples акселерометра (если задан PACKET_ACC_RAW)
+#define BATCH_ADC_SCAN_MAX_SIZE (1 + ADC_MAX_NUMBER_OF_CHANNELS * 2) // каналы ADC (если задан PACKET_ADC_SCAN)
+#define ADC_SYNC_DATA_SIZE (ADS_NUMBER_OF_MESURING * ADC_MAX_NUMBER_OF_CHANNELS * 2)
+#define BATCH_ADC_SYNC_MAX_SIZE (1 + ADC_SYNC_DATA_SIZE) // каналы ADC каждого измерения (если задан PACKET_ADC_SYNC)
+#define BATCH_TIMESTAMP_SIZE 4 // время первого измерения (если задан PACKET_TIMESTAMP)
+#define BATCH_CRC_SIZE 2 // CRC16 пакета (если задан PACKET_CRC)
 #define BATCH_TAIL_SIZE 1 //stop byte
 
-//Total size of the whole batch (10 samples for two channels+accelerometer,
+//Total size of the whole batch (10 samples for n channels+accelerometer,
 // battery and a stop byte)
-#define MAX_BATCH_SIZE (BATCH_HEADER_SIZE + ADS_BATCH_SIZE + ACC_ADC_DATA_SIZE + BATCH_TAIL_SIZE)
+#define BATCH_SIZE(ads_batch_size) (BATCH_HEADER_SIZE + BATCH_FORMAT_SIZE + (ads_batch_size) + ACC_ADC_DATA_SIZE \
+                                    + BATCH_LOFF_MAX_SIZE + BATCH_ACC_RAW_MAX_SIZE + BATCH_ADC_SCAN_MAX_SIZE \
+                                    + BATCH_ADC_SYNC_MAX_SIZE + BATCH_TIMESTAMP_SIZE + BATCH_CRC_SIZE \
+                                    + BATCH_TAIL_SIZE)
+#define MAX_BATCH_SIZE BATCH_SIZE(ADS_MAX_BATCH_SIZE)
 
 static int batch_size;
 static uchar* ads_channel_dividers;
+static uchar packet_format = PACKET_FORMAT_RAW;
+static uchar rice_k = RICE_DEFAULT_K;
+static uchar ads_data_offset = BATCH_HEADER_SIZE; // где в пакете начинаются данные ADS
+static uchar ads_data_size;                       // сколько байт данные ADS занимают без сжатия
+static uchar ads_number_of_channels;              // 2, 4, 6 или 8, сколько каналов у ADS (ads_number_of_signals())
+static uchar channel_samples[ADS_MAX_NUMBER_OF_CHANNELS]; // сколько samples каждого канала в пакете
+static uchar rice_buffer[ADS_MAX_BATCH_SIZE];     // сюда сжимаются данные ADS
+static uint loff_status;                          // lead-off биты измерений пакета по ИЛИ
+static uchar adc_sync_data[ADC_SYNC_DATA_SIZE];   // каналы ADC каждого измерения пакета (PACKET_ADC_SYNC)
+static unsigned long batch_time;                  // время DRDY первого измерения пакета (PACKET_TIMESTAMP)
 
-/*******  double buffer for all signals: ADS, ADC and helper info ******/
-static uchar data_buffer_0[MAX_BATCH_SIZE];
-static uchar data_buffer_1[MAX_BATCH_SIZE];
-static uchar* fill_buffer = data_buffer_0; // ссылка на буфер для заполнения
-static uchar* display_buffer = data_buffer_1;  //ссылка на заполненный буфер готовый для обработки
+/*******  кольцо пакетов для всех сигналов: ADS, ADC and helper info ******
+ * Один пакет заполняется, остальные ждут отправки по uart.
+ * Если uart не успевает (например подвисает блютус) готовые пакеты копятся в кольце,
+ * а когда свободных мест нет - заполняемый пакет теряется (считаем overruns),
+ * но прием данных от ADS никогда не останавливается.
+ *
+ * Под кольцо отдаем всю RAM которая остается от переменных всех модулей и стека: msp430fr2476.ld
+ * кладет ее между последней секцией RAM (.heap) и __stack - __stack_reserve
+ * (__batch_ring_start - __batch_ring_end), так что новые переменные в других модулях уменьшают кольцо,
+ * а не залезают в стек. Если места меньше чем BATCH_RING_MIN_MEMORY_SIZE (4 пакета восьмиканалки),
+ * сборка останавливается на ASSERT в msp430fr2476.ld.
+ * __stack_reserve (0x200) - оценка: самая глубокая цепочка main loop (databatch_process -> make_batch ->
+ * rice_encode / adc_get_data) по -fstack-usage хостовой сборки занимает около 350 байт при 8-байтовых
+ * указателях и регистрах, у MSP430 они 2-4 байта, плюс один обработчик прерывания (вложенных нет).
+ * Место одного пакета зависит от числа каналов ADS, поэтому память делится на пакеты
+ * в databatch_init(): у двухканалки их в кольце больше чем у восьмиканалки.
+ * Последнее место - replay_buffer: из него отправляются пакеты отложенные в FRAM
+ */
+#define BATCH_RING_MIN_MEMORY_SIZE 0xB48 // __batch_ring_min_size в msp430fr2476.ld
+#if BATCH_RING_MIN_MEMORY_SIZE < 4 * MAX_BATCH_SIZE
+#error "__batch_ring_min_size in msp430fr2476.ld must hold 4 batches of MAX_BATCH_SIZE"
+#endif
+
+#ifdef __MSP430__
+extern uchar __batch_ring_start[];
+extern uchar __batch_ring_end[];
+#define batch_ring __batch_ring_start
+#define BATCH_RING_MEMORY_SIZE ((uint)(__batch_ring_end - __batch_ring_start))
+#else
+#define BATCH_RING_MEMORY_SIZE 0x1000 // на компьютере как у прибора с ~4 КБ свободной RAM
+static uchar batch_ring[BATCH_RING_MEMORY_SIZE];
+#endif
+
+static int batch_slot_size = MAX_BATCH_SIZE; // место под один пакет
+static uchar batch_ring_size = 2;            // сколько пакетов в кольце
+static uchar ring_fill;   // индекс пакета который сейчас заполняется
+static uchar batches_queued;         // сколько пакетов поставлено в очередь uart
+static volatile uchar batches_sent;  // сколько из них уже отправлено (увеличивает прерывание uart)
+static uchar* fill_buffer = batch_ring; // ссылка на буфер для заполнения
+// место в кольце каждого пакета в очереди uart: индекс - номер пакета batches_queued по модулю размера очереди.
+// Пакеты уходят по порядку, значит в очереди лежат последние batches_queued - batches_sent из них
+static uchar queued_slots[UART_TX_QUEUE_SIZE];
+#if 256 % UART_TX_QUEUE_SIZE != 0
+#error "UART_TX_QUEUE_SIZE must divide 256: queued_slots is indexed by the uchar batches_queued"
+#endif
+static uint overrun_counter; // сколько пакетов потеряно из-за того что uart не успевал
+
+/******* store-and-forward: пакеты которые uart не успевает отправить откладываются в FRAM (batchlog.c) ******
+ * Когда в очереди uart store_threshold пакетов и больше, готовые пакеты пишутся в лог вместо очереди,
+ * пока очередь не уменьшится до store_threshold / 2. Когда очередь не больше store_threshold / 2,
+ * databatch_process() отправляет по одному пакету из лога (с PACKET_REPLAYED) между живыми
+ */
+static uchar store_threshold;          // 0 - store-and-forward выключен
+static bool storing;                   // пакеты сейчас идут в лог
+static uchar* replay_buffer;           // сюда копируется пакет из лога на время отправки
+static uchar replays_queued;
+static volatile uchar replays_sent;
+/******* история: последние готовые пакеты для повторной отправки по команде BATCH_RESEND ******
+ * HIFRAM (msp430fr2476.ld: 0x10000 - 0x17FFE) делится между двумя логами batchlog.c, других свободных
+ * 32 КБ FRAM нет (в нижней FRAM программа). Лог store-and-forward (DATABATCH_STORE_LOG_SIZE, 18 КБ) покрывает
+ * пропадание связи, история (13.75 КБ) - время от пропуска в номерах до запроса хоста.
+ * При 2 каналах и 500 SPS (50 пакетов в секунду), запись - размер (2 байта) + пакет:
+ *   0x8D (83 байта): лог ~220 пакетов (4.4 с), история ~170 пакетов (3.4 с);
+ *   0xC0 (139 байт): лог ~130 пакетов (2.6 с), история ~100 пакетов (2 с).
+ * Запрос BATCH_RESEND приходит через round trip связи (десятки - сотни мс), истории хватает с запасом,
+ * а пропадание связи дольше лога все равно теряет пакеты: переносить место из истории в лог почти ничего не дает.
+ * Сколько пакетов формата вмещает лог, учитывает host/pipeline_bench (outage_batches())
+ */
+#define STORE_LOG_START 0x10000UL
+#define STORE_LOG_SIZE DATABATCH_STORE_LOG_SIZE
+#define HISTORY_START (STORE_LOG_START + STORE_LOG_SIZE)
+#define HISTORY_SIZE 0x3700U
+static batchlog store_log;
+static batchlog history;
+static uint resend_next;  // номер следующего запрошенного пакета
+static uint resend_left;  // сколько пакетов запрошено еще
 /***********************************************************************/
 static bool acc_available = false;
 static bool adc_available = false;
@@ -65,47 +221,186 @@ static bool is_recording = false;
 static unsigned int batch_counter = 0;
 
 //Pointers at ADS batch segments with offset for different channels
-static unsigned char channel_pointers[ADS_NUMBER_OF_CHANNELS] = {0};
-static unsigned char channel_starts[ADS_NUMBER_OF_CHANNELS];
+static unsigned char channel_pointers[ADS_MAX_NUMBER_OF_CHANNELS] = {0};
+static unsigned char channel_starts[ADS_MAX_NUMBER_OF_CHANNELS];
 static unsigned char ads_mesuring_count;
 
+//Decimation filters for ADS channels with dividers (dsp.c)
+static dsp_decimator decimators[ADS_MAX_NUMBER_OF_CHANNELS];
+//IIR filters (DC removal, notch) applied to ADS channels before decimation, set by host (dsp.c)
+static dsp_filter filters[ADS_MAX_NUMBER_OF_CHANNELS];
+
+static void reset_decimators() {
+    uchar channel;
+    for(channel = 0; channel < ads_number_of_channels; channel++) {
+        dsp_decimator_init(&decimators[channel], ads_channel_dividers[channel]);
+        dsp_filter_reset(&filters[channel]);
+    }
+}
+
+/*
+ * Сообщает ADS куда положить следующее измерение каждого канала.
+ * SPI прерывание пишет байты прямо в пакет на место channel_pointers[channel]
+ */
+static void set_ads_destinations() {
+    uchar* ads_buffer = fill_buffer + ads_data_offset;
+    uchar channel;
+    for(channel = 0; channel < ads_number_of_channels; channel++) {
+        ads_set_channel_destination(channel, ads_buffer + channel_pointers[channel]);
+    }
+    ads_commit_channel_destinations();
+}
+
+/*
+ * Готовимся к заполнению следующего пакета
+ */
+static void reset_channel_pointers() {
+    uchar channel;
+    for(channel = 0; channel < ads_number_of_channels; channel++) {
+        channel_pointers[channel] = channel_starts[channel];
+    }
+    set_ads_destinations();
+}
+
+static uchar ring_next(uchar index) {
+    if(++index >= batch_ring_size) {
+        index = 0;
+    }
+    return index;
+}
+
+static bool slot_in_flight(uchar slot) {
+    uchar in_flight = (uchar)(batches_queued - batches_sent);
+    uchar i;
+    for(i = 1; i <= in_flight; i++) {
+        if(queued_slots[(uchar)(batches_queued - i) % UART_TX_QUEUE_SIZE] == slot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Следующий свободный (не стоящий в очереди uart) пакет после заполненного.
+ * В очереди не больше batch_ring_size - 2 пакетов, так что кроме заполненного свободен еще хотя бы один
+ */
+static void next_fill_buffer() {
+    uchar slot = ring_next(ring_fill);
+    while(slot != ring_fill && slot_in_flight(slot)) {
+        slot = ring_next(slot);
+    }
+    ring_fill = slot;
+    fill_buffer = batch_ring + ring_fill * batch_slot_size;
+}
+
 static void set_batch_size(){
-    batch_size = BATCH_HEADER_SIZE + BATCH_TAIL_SIZE + ACC_ADC_DATA_SIZE;
+    ads_data_offset = BATCH_HEADER_SIZE;
+    if(packet_format != PACKET_FORMAT_RAW) {
+        ads_data_offset++; // packet_format
+    }
+    if(packet_format & PACKET_RICE) {
+        ads_data_offset++; // ads_data_length
+    }
     unsigned char channel;
     unsigned char channel_start = 0;
     unsigned char bytes_per_channel = 0;
-    for(channel = 0; channel < ADS_NUMBER_OF_CHANNELS; channel++) {
+    for(channel = 0; channel < ads_number_of_channels; channel++) {
         bytes_per_channel = ADS_BYTES_PER_CHANNEL / ads_channel_dividers[channel];
-        batch_size += bytes_per_channel;
+        channel_samples[channel] = ADS_NUMBER_OF_MESURING / ads_channel_dividers[channel];
         channel_starts[channel] = channel_start;
         channel_pointers[channel] = channel_start;
         channel_start += bytes_per_channel;
     }
+    ads_data_size = channel_start;
+    batch_size = ads_data_offset + ads_data_size + ACC_ADC_DATA_SIZE + BATCH_TAIL_SIZE;
+}
+
+/*
+ * Сжимает данные ADS в пакете (см. rice.c) и возвращает сколько байт они теперь занимают.
+ * Длина сжатых данных пишется в байт перед ними, 0 - сжатие не дало выигрыша и данные оставлены как есть
+ */
+static uchar compress_ads_data(uchar* ads_data) {
+    uchar i;
+    // сжатые данные должны быть хоть на байт меньше исходных, иначе оставляем как есть
+    int size = rice_encode(ads_data, channel_samples, ads_number_of_channels, rice_k, rice_buffer, ads_data_size - 1);
+    if(size <= 0) {
+        ads_data[-1] = 0;
+        return ads_data_size;
+    }
+    for(i = 0; i < size; i++) {
+        ads_data[i] = rice_buffer[i];
+    }
+    ads_data[-1] = (uchar)size;
+    return (uchar)size;
 }
 
 void databatch_init(bool adc_available1, bool acc_available1) {
+    uint slots;
     adc_available = adc_available1; //
     acc_available = acc_available1; // ### Зачем эти промежуточные переменные?
     ads_init();
-    if(adc_available) {
-        adc_init();
-        // передаем в ADS ссылку на функцию из ADC10 которую ads будет вызывать в прерывании DRDY при поступлении данных
-        //ads_DRDY_interrupt_callback(adc_convert_begin);
+    // делим память кольца на пакеты под найденное число каналов ADS
+    ads_number_of_channels = ads_number_of_signals();
+    batch_slot_size = BATCH_SIZE(ADS_BYTES_PER_CHANNEL * ads_number_of_channels);
+    slots = BATCH_RING_MEMORY_SIZE / batch_slot_size - 1; // одно место под replay_buffer
+    // больше пакетов чем вмещает очередь uart (вместе с отложенным) в кольце держать незачем
+    if(slots > UART_TX_QUEUE_SIZE - 1) {
+        slots = UART_TX_QUEUE_SIZE - 1;
     }
+    batch_ring_size = (uchar)slots;
+    replay_buffer = batch_ring + batch_ring_size * batch_slot_size;
+    batchlog_init(&store_log, STORE_LOG_START, STORE_LOG_SIZE);
+    batchlog_init(&history, HISTORY_START, HISTORY_SIZE);
+    ring_fill = 0;
+    fill_buffer = batch_ring;
+    adc_init(); // ADC нужен и для батарейки, даже если канал ADC в пакет не идет
+    timestamp_init();
+    // ссылку на adc_convert_begin() которую ads будет вызывать в прерывании DRDY
+    // передаем при старте записи с PACKET_ADC_SYNC (databatch_start_recording())
     if(acc_available) {
         acc_init();
     }
 }
 
-void databatch_start_recording(uchar* ads_dividers) {
+/*
+ * format - флаги формата пакета (PACKET_...), rice_parameter - k для PACKET_RICE
+ */
+void databatch_start_recording(uchar* ads_dividers, uchar format, uchar rice_parameter) {
     batch_counter = 0; //Setting the next batch number to zero
     ads_channel_dividers = ads_dividers;
+    packet_format = format;
+    rice_k = rice_parameter;
+    if(rice_k > RICE_MAX_K) {
+        rice_k = RICE_MAX_K;
+    }
+    overrun_counter = 0;
+    // в пакете n_i = 10 / divider_i samples, поэтому делитель должен делить 10 нацело
+    for(uchar channel = 0; channel < ads_number_of_channels; channel++) {
+        if(ads_channel_dividers[channel] == 0 || ADS_NUMBER_OF_MESURING % ads_channel_dividers[channel] != 0) {
+            ads_channel_dividers[channel] = 1;
+        }
+    }
     set_batch_size();
+    reset_decimators();
+    loff_status = 0;
+    storing = false;
+    // отложенные пакеты и история прошлой записи уже не нужны (номера пакетов начинаются заново)
+    batchlog_clear(&store_log);
+    batchlog_clear(&history);
+    resend_left = 0;
+    set_ads_destinations();
+    if(adc_available && (packet_format & PACKET_ADC_SYNC)) {
+        // серии ADC запускает прерывание DRDY: ADC и ADS меряют в одни и те же моменты
+        adc_sync_on();
+        ads_DRDY_interrupt_callback(adc_convert_begin);
+    }
+    battery_start(); // в синхронном режиме батарейка меряется после первой серии
     ads_start_recording();
-    if(adc_available) {
+    if(adc_available && !(packet_format & PACKET_ADC_SYNC)) {
         adc_conversion_on(255);
     }
     if(acc_available) {
+        acc_set_raw_output(packet_format & PACKET_ACC_RAW);
         acc_read();
     }
     batch_counter = 0;
@@ -119,6 +414,7 @@ void databatch_stop_recording() {
     if(adc_available) {
         adc_conversion_off();
     }
+    ads_DRDY_interrupt_callback(0);
     if(acc_available) {
         acc_stop_reading();
     }
@@ -126,151 +422,374 @@ void databatch_stop_recording() {
 }
 
 /*
- * В пакет уже заполненный данными от 10 измерений ADS
- * добавляет данные от ACC и ADC (1 измерение), данные от батарейки (сейчас нули)
- * стартовые и стоповые байты и отправляет по UART
+ * true если готовый пакет надо отложить в FRAM: очередь uart дошла до store_threshold
+ * и еще не уменьшилась до store_threshold / 2
+ */
+static bool store_batch(uchar batches_in_flight) {
+    if(store_threshold == 0 || packet_format == PACKET_FORMAT_RAW) {
+        return false;
+    }
+    if(batches_in_flight >= store_threshold) {
+        storing = true;
+    } else if(batches_in_flight <= store_threshold / 2) {
+        storing = false;
+    }
+    return storing;
+}
+
+/*
+ * Когда очередь uart разгрузилась, отправляет по одному пакету за раз: сначала запрошенные
+ * командой BATCH_RESEND из истории, потом самый старый отложенный (store-and-forward)
+ */
+static void replay_batch() {
+    uint size;
+    bool resend = resend_left > 0;
+    // без store-and-forward ждем пока кольцо освободится наполовину
+    uchar in_flight_limit = store_threshold != 0 ? store_threshold / 2 : batch_ring_size / 2;
+    if(replays_queued != replays_sent || (uchar)(batches_queued - batches_sent) > in_flight_limit) {
+        return;
+    }
+    if(resend) {
+        // один номер за вызов: номера которых уже нет в истории не задерживают main loop.
+        // Отложенный store-and-forward пакет и так придет, второй раз его не шлем
+        size = 0;
+        if(batchlog_empty(&store_log) || batchlog_find(&store_log, resend_next, replay_buffer) == 0) {
+            size = batchlog_find(&history, resend_next, replay_buffer);
+        }
+        resend_next++;
+        resend_left--;
+        if(size == 0) {
+            return;
+        }
+    } else if(!storing && !batchlog_empty(&store_log)) {
+        size = batchlog_peek(&store_log, replay_buffer);
+    } else {
+        return;
+    }
+    replay_buffer[BATCH_HEADER_SIZE] |= PACKET_REPLAYED;
+    if(replay_buffer[BATCH_HEADER_SIZE] & PACKET_CRC) {
+        uchar* crc = replay_buffer + size - BATCH_CRC_SIZE - BATCH_TAIL_SIZE;
+        crc16_begin();
+        crc16_add(replay_buffer + 2, crc - (replay_buffer + 2));
+        uint value = crc16_result();
+        crc[0] = (uchar)value;
+        crc[1] = (uchar)(value >> 8);
+    }
+    if(uart_transmit_queued(replay_buffer, size, UART_PRIORITY_LOW, &replays_sent)) {
+        replays_queued++;
+        if(!resend) {
+            batchlog_drop(&store_log);
+        }
+    } else if(resend) {
+        // очередь uart полна, этот пакет пробуем снова в следующий раз
+        resend_next--;
+        resend_left++;
+    }
+}
+
+/*
+ * В пакет slot кольца, уже заполненный данными от 10 измерений ADS,
+ * добавляет данные от ACC и ADC (1 измерение), напряжение батарейки в милливольтах от battery_batch()
+ * (0 пока нет ни одного измерения),
+ * стартовые и стоповые байты и отправляет по UART.
+ * Следующие измерения ADS к этому моменту уже идут в другой пакет
  */
-static void make_batch(){
+static void make_batch(uchar slot){
+    uchar* batch = batch_ring + slot * batch_slot_size;
+    // место в пакете сразу за данными ADS
+    uchar* batch_tail = batch + ads_data_offset + ads_data_size;
+    if(packet_format & PACKET_RICE) {
+        batch_tail = batch + ads_data_offset + compress_ads_data(batch + ads_data_offset);
+    }
     //Adding data from accelerometer and adc
      //По 2 байта на каждую из осей x, y ,z в случае Accelerometer
-     //По 2 байта на каждое измерение в случае ADC
+     //По 2 байта на каждое измерение в случае ADC (на этом месте только первый канал серии ADC)
+    uchar* adc_data = 0;
+    if(adc_available) {
+        adc_data = adc_get_data(); // adc data, все каналы серии
+    }
     if(adc_available && acc_available) {
-        uchar* adc_data = adc_get_data(); // adc data
         uchar* acc_data = acc_get_data(); // accelerometer data
-        fill_buffer[batch_size - 9] = adc_data[0];
-        fill_buffer[batch_size - 8] = adc_data[1];
-        fill_buffer[batch_size - 7] = acc_data[0];
-        fill_buffer[batch_size - 6] = acc_data[1];
-        fill_buffer[batch_size - 5] = acc_data[2];
-        fill_buffer[batch_size - 4] = acc_data[3];
+        batch_tail[0] = adc_data[0];
+        batch_tail[1] = adc_data[1];
+        batch_tail[2] = acc_data[0];
+        batch_tail[3] = acc_data[1];
+        batch_tail[4] = acc_data[2];
+        batch_tail[5] = acc_data[3];
     } else if(acc_available) {
         uchar* acc_data = acc_get_data();
-        fill_buffer[batch_size - 9] = acc_data[0];
-        fill_buffer[batch_size - 8] = acc_data[1];
-        fill_buffer[batch_size - 7] = acc_data[2];
-        fill_buffer[batch_size - 6] = acc_data[3];
-        fill_buffer[batch_size - 5] = acc_data[4];
-        fill_buffer[batch_size - 4] = acc_data[5];
+        batch_tail[0] = acc_data[0];
+        batch_tail[1] = acc_data[1];
+        batch_tail[2] = acc_data[2];
+        batch_tail[3] = acc_data[3];
+        batch_tail[4] = acc_data[4];
+        batch_tail[5] = acc_data[5];
     } else if (adc_available) {
-        uchar* adc_data = adc_get_data();
-        fill_buffer[batch_size - 9] = adc_data[0];
-        fill_buffer[batch_size - 8] = adc_data[1];
-        fill_buffer[batch_size - 7] = 0;
-        fill_buffer[batch_size - 6] = 0;
-        fill_buffer[batch_size - 5] = 0;
-        fill_buffer[batch_size - 4] = 0;
+        batch_tail[0] = adc_data[0];
+        batch_tail[1] = adc_data[1];
+        batch_tail[2] = 0;
+        batch_tail[3] = 0;
+        batch_tail[4] = 0;
+        batch_tail[5] = 0;
     } else {
-        fill_buffer[batch_size - 9] = 0;
-        fill_buffer[batch_size - 8] = 0;
-        fill_buffer[batch_size - 7] = 0;
-        fill_buffer[batch_size - 6] = 0;
-        fill_buffer[batch_size - 5] = 0;
-        fill_buffer[batch_size - 4] = 0;
-    }
-    //Adding battery info
-    //TODO think how to do it!!!
-    fill_buffer[batch_size - 3] = 0;
-    fill_buffer[batch_size - 2] = 0;
-    //Stop marker
-    fill_buffer[batch_size - 1] = STOP_MARKER;
+        batch_tail[0] = 0;
+        batch_tail[1] = 0;
+        batch_tail[2] = 0;
+        batch_tail[3] = 0;
+        batch_tail[4] = 0;
+        batch_tail[5] = 0;
+    }
+    //Adding battery info: millivolts (battery.c)
+    uint battery = battery_batch();
+    batch_tail[6] = (uchar)battery;
+    batch_tail[7] = (uchar)(battery >> 8);
+    batch_tail += ACC_ADC_DATA_SIZE;
+    if(packet_format & PACKET_LOFF) {
+        *batch_tail++ = (uchar)loff_status;
+        if(ads_number_of_channels > 2) {
+            *batch_tail++ = (uchar)(loff_status >> 8);
+        }
+    }
+    loff_status = 0;
+    if(packet_format & PACKET_ACC_RAW) {
+        uchar count = 0;
+        if(acc_available) {
+            count = acc_get_raw_data(batch_tail + 1);
+        }
+        *batch_tail = count;
+        batch_tail += 1 + count * 6;
+    }
+    if(packet_format & PACKET_ADC_SCAN) {
+        uchar count = 0;
+        if(adc_available) {
+            count = adc_number_of_signals();
+            for(uchar i = 0; i < count * 2; i++) {
+                batch_tail[1 + i] = adc_data[i];
+            }
+        }
+        *batch_tail = count;
+        batch_tail += 1 + count * 2;
+    }
+    if(packet_format & PACKET_ADC_SYNC) {
+        uchar count = 0;
+        uint size = 0;
+        if(adc_available) {
+            count = adc_number_of_signals();
+            size = ADS_NUMBER_OF_MESURING * count * 2;
+            for(uint i = 0; i < size; i++) {
+                batch_tail[1 + i] = adc_sync_data[i];
+            }
+        }
+        *batch_tail = count;
+        batch_tail += 1 + size;
+    }
+    if(packet_format & PACKET_TIMESTAMP) {
+        batch_tail[0] = (uchar)batch_time;
+        batch_tail[1] = (uchar)(batch_time >> 8);
+        batch_tail[2] = (uchar)(batch_time >> 16);
+        batch_tail[3] = (uchar)(batch_time >> 24);
+        batch_tail += BATCH_TIMESTAMP_SIZE;
+    }
     //Writing header info
-    fill_buffer[0] = START_MARKER;
-    fill_buffer[1] = START_MARKER;
+    batch[0] = START_MARKER;
+    batch[1] = START_MARKER;
     //Assigning  batch a number
-    fill_buffer[2] = (uchar)batch_counter;
-    fill_buffer[3] = (uchar)(batch_counter >> 8);
+    batch[2] = (uchar)batch_counter;
+    batch[3] = (uchar)(batch_counter >> 8);
+    if(packet_format != PACKET_FORMAT_RAW) {
+        batch[BATCH_HEADER_SIZE] = packet_format;
+    }
+    if(packet_format & PACKET_CRC) {
+        // от номера пакета до конца данных, модулем CRC16 (байт за такт)
+        crc16_begin();
+        crc16_add(batch + 2, batch_tail - (batch + 2));
+        uint crc = crc16_result();
+        batch_tail[0] = (uchar)crc;
+        batch_tail[1] = (uchar)(crc >> 8);
+        batch_tail += BATCH_CRC_SIZE;
+    }
+    //Stop marker
+    *batch_tail++ = STOP_MARKER;
     //Increasing the batch no int (two bytes)
     batch_counter++;
-    // swap double buffers
-    uchar *tmp = display_buffer;
-    display_buffer = fill_buffer;
-    fill_buffer = tmp;
-    uart_flush(); // ждем завершения отправки по uart
+    batch_size = batch_tail - batch;
     if(is_recording) {
-        //send data to uart
-//        LED1_ON(); // дергаем пин P1.0 для запуска лог.анализатора
-//        __delay_cycles(32);
-//        LED1_OFF();
-        uart_transmit(display_buffer, batch_size);
+        // (uchar) - счетчики переполняются одинаково, разность остается верной
+        uchar batches_in_flight = (uchar)(batches_queued - batches_sent);
+        if(packet_format != PACKET_FORMAT_RAW) {
+            // в историю идут все пакеты, в том числе те что ниже потеряются: хост может их запросить
+            batchlog_append(&history, batch, batch_size);
+        }
+        if(store_batch(batches_in_flight)) {
+            // uart не успевает: пакет откладывается в FRAM, его место в кольце свободно
+            if(!batchlog_append(&store_log, batch, batch_size)) {
+                overrun_counter++;
+            }
+        } else if(batches_in_flight < batch_ring_size - 2 &&
+           uart_transmit_queued(batch, batch_size, UART_PRIORITY_LOW, &batches_sent)) {
+            // пакет поставлен в очередь uart, его место занято до отправки
+            queued_slots[batches_queued % UART_TX_QUEUE_SIZE] = slot;
+            batches_queued++;
+        } else {
+            // все места в кольце заняты: не ждем uart,
+            // а отбрасываем пакет (хост увидит пропуск в номерах пакетов)
+            overrun_counter++;
+        }
     }
 }
 
-#define ADS_HALF_BATCH_SIZE ADS_BATCH_SIZE/2
-static int sample_pointer = 0;
+/*
+ * Каналы ADC снятые по DRDY этого измерения ADS (PACKET_ADC_SYNC) откладываются до make_batch()
+ */
+static void take_adc_sync_series() {
+    uchar channels = adc_number_of_signals();
+    uchar* destination = adc_sync_data + ads_mesuring_count * channels * 2;
+    uchar i;
+    if(!adc_get_sync_series(ads_sample_number(), destination)) {
+        for(i = 0; i < channels * 2; i++) {
+            destination[i] = 0xFF;
+        }
+    }
+}
 
 /*
- * Метод помещает в пакет данные от 10 измерений ADS (ADS_NUMBER_OF_MESURING)
- * в случае когда каналы имеют делители отличные от 1
+ * К моменту вызова SPI прерывание уже положило очередное измерение ADS
+ * прямо в пакет (little endian) на место channel_pointers[channel].
+ * Для каналов с делителем 1 и без IIR фильтра остается только сдвинуть указатель.
+ * Иначе это место служит буфером: значение проходит IIR фильтр (если задан)
+ * и фильтр децимации (dsp.c), а когда фильтр выдает
+ * очередное значение оно записывается туда же и указатель сдвигается
  */
-#define LONG_MAX 2147483647
-#define LONG_MIN 2147483648
-static long accumulator[ADS_NUMBER_OF_CHANNELS] = {0};
-static unsigned char accum_counter[ADS_NUMBER_OF_CHANNELS] = {0}; // все элементы массива будут инициализированы 0;
-long avg_value;
-long ads_value;
-char* ptr_ads_value = (char*)&ads_value;
-char* ptr_avg_value = (char*)&avg_value;
-static void process_ads_samples(uchar* ads_samples){
-    uchar* ads_buffer = fill_buffer + BATCH_HEADER_SIZE;
-    signed char signed_byte;
+static void process_ads_samples(){
+    uchar* ads_buffer = fill_buffer + ads_data_offset;
+    uchar* sample;
     uchar channel;
     uchar chn_pointer;
+    long ads_value;
+    long filtered_value;
+
+    if(ads_mesuring_count == 0) {
+        batch_time = ads_sample_time();
+    }
+    for(channel = 0; channel < ads_number_of_channels; channel++) {
+        chn_pointer = channel_pointers[channel];
+        if(ads_channel_dividers[channel] > 1 || filters[channel].enabled) {
+            sample = ads_buffer + chn_pointer;
+            // старший байт определяет знак числа
+            ads_value = (signed char)sample[2];
+            ads_value = (ads_value << 16) | ((uint)sample[1] << 8) | sample[0];
+            if(filters[channel].enabled) {
+                ads_value = dsp_filter_process(&filters[channel], ads_value);
+            }
 
-    for(channel = 0; channel < ADS_NUMBER_OF_CHANNELS; channel++) {
-
-        // MSP is little endian !!! MSP is little endian
-        signed_byte = (signed char)*ads_samples; // старший байт определяет знак числа
-        ptr_ads_value[3] = 0;
-        if(signed_byte&BIT7) { ptr_ads_value[3] = 0xFF; }
-
-        ptr_ads_value[2] = *ads_samples++;
-        ptr_ads_value[1] = *ads_samples++;
-        ptr_ads_value[0] = *ads_samples++;
-
-        //Accumulating for averaging.
-        accumulator[channel] += ads_value;
-        accum_counter[channel]++; //Keeping the count of accumulations
-        //Stop accumulating when we have enough samples
-        if(accum_counter[channel] >= ads_channel_dividers[channel]){
-          //Averaging accumulated samples
-            avg_value = accumulator[channel];
-          if(ads_channel_dividers[channel] == 2) {
-              avg_value = avg_value >> 1;     // делим на 2
-          }else if(ads_channel_dividers[channel] ==  5) {
-              avg_value = avg_value >> 3;     // делим на 8
-          }else if(ads_channel_dividers[channel] == 10) {
-              avg_value = avg_value >> 4; // делим на 16
-          }
-
-          accumulator[channel] = 0;
-          accum_counter[channel] = 0;
-
-          //Adding the result to the batch Порядок байт little_endian
-          chn_pointer = channel_pointers[channel];
-
-          ads_buffer[chn_pointer]     = ptr_avg_value[0];
-          ads_buffer[chn_pointer + 1] = ptr_avg_value[1];
-          ads_buffer[chn_pointer + 2] = ptr_avg_value[2];
-
-          channel_pointers[channel] = chn_pointer + 3; //Pointing at the place to write the next sample
+            if(dsp_decimate(&decimators[channel], ads_value, &filtered_value)) {
+                //Adding the result to the batch Порядок байт little_endian
+                sample[0] = (uchar)filtered_value;
+                sample[1] = (uchar)(filtered_value >> 8);
+                sample[2] = (uchar)(filtered_value >> 16);
+                chn_pointer += 3; //Pointing at the place to write the next sample
+            }
+        } else {
+            chn_pointer += 3;
         }
+        channel_pointers[channel] = chn_pointer;
+    }
+
+    if(adc_available && (packet_format & PACKET_ADC_SYNC)) {
+        take_adc_sync_series();
     }
 
     // если ADS сделала все ADS_NUMBER_OF_MESURING (10) измерений то
     // завершаем формирование пакета и готовимся к формированию следующего
     if(++ads_mesuring_count >= ADS_NUMBER_OF_MESURING) {
-        make_batch();
+        uchar slot = ring_fill;
         ads_mesuring_count = 0;
-        int channel;
-         for(channel = 0; channel < ADS_NUMBER_OF_CHANNELS; channel++) {
-             channel_pointers[channel] = channel_starts[channel];
-         }
+        // следующее измерение ADS должно лечь уже в новый буфер:
+        // переключаемся до make_batch(), чтобы DRDY не переписал пакет пока он собирается и ждет uart
+        next_fill_buffer();
+        reset_channel_pointers();
+        make_batch(slot);
+    } else {
+        set_ads_destinations();
     }
 }
 
 void databatch_process() {
     if(ads_data_received()) {
-        process_ads_samples(ads_get_data());
+        ads_get_status(); // данные каналов уже лежат в пакете, из служебных байт берем только lead-off
+        loff_status |= ads_get_loff_status();
+        process_ads_samples();
+    }
+    replay_batch();
+}
+
+/*
+ * Задает звено section IIR фильтра канала channel (коэффициенты b0, b1, b2, a1, a2 в Q30, см. dsp.c).
+ * channel = DATABATCH_ALL_CHANNELS - для всех каналов
+ */
+void databatch_set_filter(uchar channel, uchar section, long* coefficients) {
+    uchar i;
+    for(i = 0; i < ADS_MAX_NUMBER_OF_CHANNELS; i++) {
+        if(channel == i || channel == DATABATCH_ALL_CHANNELS) {
+            dsp_filter_set_section(&filters[i], section, coefficients);
+        }
+    }
+}
+
+/*
+ * Выключает IIR фильтр канала channel (DATABATCH_ALL_CHANNELS - всех каналов)
+ */
+void databatch_clear_filter(uchar channel) {
+    uchar i;
+    for(i = 0; i < ADS_MAX_NUMBER_OF_CHANNELS; i++) {
+        if(channel == i || channel == DATABATCH_ALL_CHANNELS) {
+            dsp_filter_clear(&filters[i]);
+        }
+    }
+}
+
+/*
+ * Задает каналы ADC (биты маски - A0..A11, см. adc_set_channels()) для следующих записей.
+ * Во время записи каналы не меняются
+ */
+void databatch_set_adc_channels(uint channel_mask) {
+    if(!is_recording) {
+        adc_set_channels(channel_mask);
     }
 }
 
+/*
+ * Сколько пакетов потеряно с начала записи из-за того что uart не успевал их отправлять
+ * (в том числе затертых в FRAM логе store-and-forward)
+ */
+uint databatch_overruns() {
+    return overrun_counter + batchlog_lost(&store_log);
+}
+
+/*
+ * Store-and-forward: с threshold пакетов в очереди uart и больше пакеты откладываются в FRAM
+ * и отправляются когда связь восстановится. 0 - выключить (пакеты сверх кольца теряются).
+ * Порог не больше чем пакетов может стоять в очереди (batch_ring_size - 2, см. make_batch())
+ */
+void databatch_set_store_and_forward(uchar threshold) {
+    if(threshold > batch_ring_size - 2) {
+        threshold = batch_ring_size - 2;
+    }
+    if(threshold == 1) {
+        threshold = 2; // иначе store_threshold / 2 = 0 и отложенные пакеты ждут совсем пустой очереди
+    }
+    store_threshold = threshold;
+}
+
+/*
+ * Повторно отправить пакеты с номерами first_number .. first_number + count - 1 из истории (с PACKET_REPLAYED).
+ * Пакеты которых в истории уже нет и пакеты которые еще лежат в логе store-and-forward пропускаются.
+ * Новый запрос заменяет еще не выполненный
+ */
+void databatch_resend(uint first_number, uchar count) {
+    if(packet_format == PACKET_FORMAT_RAW) {
+        return;
+    }
+    resend_next = first_number;
+    resend_left = count;
+}
@@ -1,9 +1,29 @@
 #ifndef DATABATCH_H
 #define DATABATCH_H
 
+/****** packet_format: флаги формата пакета (задаются в ADS_START_RECORDING) ******/
+#define PACKET_FORMAT_RAW 0x00 // исходный формат, байта packet_format в пакете нет
+#define PACKET_RICE       0x01 // данные ADS сжаты: дельта + код Райса (rice.c)
+#define PACKET_LOFF       0x02 // в конце пакета lead-off статус ADS (1 байт у двухканалки, 2 у 4, 6 и 8 каналов)
+#define PACKET_TIMESTAMP  0x04 // в конце пакета время первого измерения (4 байта, такты XT1, см. timestamp.c)
+#define PACKET_CRC        0x08 // перед STOP_MARKER CRC16 пакета (2 байта, см. crc16.c)
+#define PACKET_ACC_RAW    0x10 // в конце пакета все samples акселерометра за пакет (число + x, y, z каждого)
+#define PACKET_ADC_SCAN   0x20 // в конце пакета все каналы ADC (число + по 2 байта на канал, см. adc_set_channels())
+#define PACKET_ADC_SYNC   0x40 // ADC запускается по DRDY ADS, в конце пакета каналы ADC каждого из 10 измерений
+#define PACKET_REPLAYED   0x80 // выставляет прошивка: пакет был отложен в FRAM и отправлен позже (store-and-forward)
+
+#define DATABATCH_ALL_CHANNELS 0xFF
+#define DATABATCH_STORE_LOG_SIZE 0x4800U // байт HIFRAM под лог store-and-forward (запись - размер 2 байта + пакет)
+
 void databatch_init(bool adc_available1, bool acc_available1);
-void databatch_start_recording(uchar* ads_dividers);
+void databatch_start_recording(uchar* ads_dividers, uchar format, uchar rice_parameter);
 void databatch_stop_recording();
 void databatch_process();
+uint databatch_overruns();
+void databatch_set_filter(uchar channel, uchar section, long* coefficients);
+void databatch_clear_filter(uchar channel);
+void databatch_set_adc_channels(uint channel_mask);
+void databatch_set_store_and_forward(uchar threshold);
+void databatch_resend(uint first_number, uchar count);
 
 #endif //DATABATCH_H
@@ -0,0 +1,217 @@
+#include <stdbool.h>
+#include "hal.h"
+#include "utypes.h"
+#include "dsp.h"
+
+/**======================== Децимация данных ADS ======================
+Каналы ADS с делителем > 1 проходят CIC фильтр порядка DSP_CIC_ORDER (2) с децимацией в divider раз:
+ на каждый входной sample - DSP_CIC_ORDER интеграторов (сложения),
+ на каждый выходной - DSP_CIC_ORDER гребенок (вычитания) и умножение на 1/divider^2.
+Это FIR с треугольной импульсной характеристикой длиной 2*divider - 1: АЧХ (sin(pi*f*R/fs)/(R*sin(pi*f/fs)))^2,
+нули на всех частотах кратных новой частоте дискретизации, поэтому полосы которые при децимации
+заворачиваются на постоянную составляющую и низкие частоты подавлены вдвое сильнее (в дБ) чем у простого усреднения.
+Задержка divider - 1 входных samples.
+
+Интеграторы считаются по модулю 2^32: переполнения при вычитании в гребенках сокращаются,
+а результат (до 24 + 2*log2(divider) бит) в 32 бита помещается пока divider <= DSP_MAX_DIVIDER.
+
+Коэффициент усиления CIC divider^2 снимается умножением на 1/divider^2 (Q31, с округлением)
+на аппаратном умножителе MPY32. Относительная ошибка коэффициента меньше 2^-24,
+ошибка результата вместе с округлением - не больше младшего бита ADS. Делитель может быть любым от 1 до DSP_MAX_DIVIDER.
+
+Цена - оценка вручную по числу инструкций MSP430X и их тактам из user's guide (SLAU445),
+без листинга компилятора и без замера на плате (MCLK 16 МГц):
+ входной sample без выхода      ~45 тактов (вызов, 2 интегратора по ~13 тактов: сложение 32 бит и запись, счетчик)
+ входной sample с выходом       ~150 тактов (+ 2 гребенки по ~18 тактов и dsp_multiply_q31 ~70 тактов:
+                                8 записей в регистры MPY32, умножение 32x32, чтение RES1..RES3 со сдвигами)
+ для 8 каналов с делителем 10 при 500 SPS это около 220 тысяч тактов в секунду (~1.5% процессора).
+ Замер на плате - по TA1R (timestamp_now()) до и после dsp_decimate() на пачке samples
+ =========================================================**/
+
+/**======================== IIR фильтры (до децимации) ======================
+На каждый канал до DSP_MAX_BIQUADS биквадов (direct form I), коэффициенты задает хост командой ADS_FILTER_SET.
+Типично: ФВЧ 0.5 Гц для удаления постоянной составляющей и режекторный фильтр 50 или 60 Гц.
+Коэффициенты в Q30 (32 бита, диапазон [-2, 2)): у звеньев с полюсами рядом с единичной окружностью a1 близко к -2,
+в Q15 (и в Q31) его не записать, а 16 бит не хватает для точности полюсов на низких частотах.
+Состояние (x1, x2, y1, y2) - samples в исходном 24-битном масштабе.
+Пять произведений 32x32 накапливаются в 64-битном RES умножителя MPY32 (MACS32) без промежуточных округлений,
+выход звена = сумма / 2^30 с округлением, на выходе фильтра значение ограничивается 24 битами.
+Цена - оценка вручную по тактам инструкций MSP430X, как и у CIC (на плате не мерялось): ~230 тактов на звено на sample:
+ 5 MACS32 по ~28 тактов (4 записи операндов из памяти, умножение 32x32, у a1 и a2 еще смена знака),
+ обнуление RES ~16, сборка результата из RES1..RES3 со сдвигами ~30, сдвиг состояния (4 значения 32 бит) ~45.
+2 звена на 8 каналах при 500 SPS - около 1.8 млн тактов в секунду (~12% процессора при 16 МГц)
+ =========================================================**/
+
+#define SAMPLE_MAX 0x7FFFFFL
+#define SAMPLE_MIN (-0x800000L)
+
+/*
+ * (value * factor_q31) / 2^31 с округлением.
+ * На MSP430 через MPY32: в RES заранее кладем 2^30 (округление) и делаем знаковое умножение с накоплением MACS32.
+ * MPY32 используется только из main loop, в прерываниях умножений нет (см. interrupts.h)
+ */
+long dsp_multiply_q31(long value, long factor_q31) {
+#ifdef __MSP430__
+    RES3 = 0;
+    RES2 = 0;
+    RES1 = 0x4000;  // 2^30
+    RES0 = 0;
+    MACS32L = (uint)value;
+    MACS32H = (uint)(value >> 16);
+    OP2L = (uint)factor_q31;
+    OP2H = (uint)(factor_q31 >> 16); // запись OP2H запускает умножение
+    // биты 31..62 результата
+    return (long)((RES1 >> 15) | ((unsigned long)RES2 << 1) | ((unsigned long)RES3 << 17));
+#else
+    return (long)(((long long)value * factor_q31 + (1LL << 30)) >> 31);
+#endif
+}
+
+void dsp_decimator_init(dsp_decimator* decimator, uchar divider) {
+    uchar stage;
+    unsigned long gain = 1;
+    if(divider < 1) {
+        divider = 1;
+    }
+    if(divider > DSP_MAX_DIVIDER) {
+        divider = DSP_MAX_DIVIDER;
+    }
+    for(stage = 0; stage < DSP_CIC_ORDER; stage++) {
+        decimator->integrators[stage] = 0;
+        decimator->combs[stage] = 0;
+        gain *= divider;
+    }
+    // 2^31 / gain с округлением; для divider 1 фильтр не нужен и коэффициент не используется
+    decimator->gain_q31 = (long)((0x80000000UL + gain / 2) / gain);
+    decimator->divider = divider;
+    decimator->count = 0;
+}
+
+/**
+ * Подает на вход фильтра очередной sample.
+ * Каждый divider-й вызов возвращает true и кладет в output отфильтрованное значение
+ * (того же масштаба что и вход)
+ */
+bool dsp_decimate(dsp_decimator* decimator, long sample, long* output) {
+    unsigned long value;
+    unsigned long previous;
+    uchar stage;
+    if(decimator->divider == 1) {
+        *output = sample;
+        return true;
+    }
+    value = (unsigned long)sample;
+    for(stage = 0; stage < DSP_CIC_ORDER; stage++) {
+        decimator->integrators[stage] += value;
+        value = decimator->integrators[stage];
+    }
+    if(++decimator->count < decimator->divider) {
+        return false;
+    }
+    decimator->count = 0;
+    for(stage = 0; stage < DSP_CIC_ORDER; stage++) {
+        previous = decimator->combs[stage];
+        decimator->combs[stage] = value;
+        value -= previous;
+    }
+    *output = dsp_multiply_q31((long)value, decimator->gain_q31);
+    return true;
+}
+
+#ifdef __MSP430__
+#define MACS32(value, factor) \
+    MACS32L = (uint)(value); \
+    MACS32H = (uint)((value) >> 16); \
+    OP2L = (uint)(factor); \
+    OP2H = (uint)((factor) >> 16)
+#endif
+
+/*
+ * Одно звено: (b0*x + b1*x1 + b2*x2 - a1*y1 - a2*y2) / 2^30 с округлением
+ */
+static long biquad_process(dsp_biquad* biquad, long x) {
+    long* c = biquad->coefficients;
+    long y;
+#ifdef __MSP430__
+    RES3 = 0;
+    RES2 = 0;
+    RES1 = 0x2000;  // 2^29 (округление)
+    RES0 = 0;
+    MACS32(x, c[0]);
+    MACS32(biquad->x1, c[1]);
+    MACS32(biquad->x2, c[2]);
+    MACS32(biquad->y1, -c[3]);
+    MACS32(biquad->y2, -c[4]);
+    // биты 30..61 результата
+    y = (long)((RES1 >> 14) | ((unsigned long)RES2 << 2) | ((unsigned long)RES3 << 18));
+#else
+    long long sum = 1LL << 29;
+    sum += (long long)x * c[0];
+    sum += (long long)biquad->x1 * c[1];
+    sum += (long long)biquad->x2 * c[2];
+    sum -= (long long)biquad->y1 * c[3];
+    sum -= (long long)biquad->y2 * c[4];
+    y = (long)(sum >> 30);
+#endif
+    biquad->x2 = biquad->x1;
+    biquad->x1 = x;
+    biquad->y2 = biquad->y1;
+    biquad->y1 = y;
+    return y;
+}
+
+/**
+ * Задает коэффициенты (b0, b1, b2, a1, a2 в Q30) звена section и включает его.
+ * Состояние звена обнуляется
+ */
+void dsp_filter_set_section(dsp_filter* filter, uchar section, long* coefficients) {
+    uchar i;
+    dsp_biquad* biquad;
+    if(section >= DSP_MAX_BIQUADS) {
+        return;
+    }
+    biquad = &filter->sections[section];
+    for(i = 0; i < DSP_BIQUAD_COEFFICIENTS; i++) {
+        biquad->coefficients[i] = coefficients[i];
+    }
+    biquad->x1 = biquad->x2 = biquad->y1 = biquad->y2 = 0;
+    filter->enabled |= (uchar)(1 << section);
+}
+
+/**
+ * Выключает все звенья фильтра
+ */
+void dsp_filter_clear(dsp_filter* filter) {
+    filter->enabled = 0;
+}
+
+/**
+ * Обнуляет состояние звеньев (перед началом записи), коэффициенты остаются
+ */
+void dsp_filter_reset(dsp_filter* filter) {
+    uchar section;
+    for(section = 0; section < DSP_MAX_BIQUADS; section++) {
+        dsp_biquad* biquad = &filter->sections[section];
+        biquad->x1 = biquad->x2 = biquad->y1 = biquad->y2 = 0;
+    }
+}
+
+/**
+ * Пропускает sample через включенные звенья по порядку.
+ * Результат ограничен диапазоном 24-битного sample
+ */
+long dsp_filter_process(dsp_filter* filter, long sample) {
+    uchar section;
+    for(section = 0; section < DSP_MAX_BIQUADS; section++) {
+        if(filter->enabled & (1 << section)) {
+            sample = biquad_process(&filter->sections[section], sample);
+        }
+    }
+    if(sample > SAMPLE_MAX) {
+        return SAMPLE_MAX;
+    }
+    if(sample < SAMPLE_MIN) {
+        return SAMPLE_MIN;
+    }
+    return sample;
+}
@@ -0,0 +1,40 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdbool.h>
+#include "utypes.h"
+
+#define DSP_CIC_ORDER 2     // порядок CIC фильтра децимации
+#define DSP_MAX_DIVIDER 16  // 24 бита sample + 2 * log2(16) бит роста = 32 бита регистров CIC
+#define DSP_MAX_BIQUADS 2   // звеньев IIR на канал (например ФВЧ + режекторный 50/60 Гц)
+#define DSP_BIQUAD_COEFFICIENTS 5
+#define DSP_Q30_ONE 0x40000000L // 1.0 в Q30 (формат коэффициентов биквадов)
+
+/* b0, b1, b2, a1, a2 в Q30: y = b0*x + b1*x1 + b2*x2 - a1*y1 - a2*y2 */
+typedef struct {
+    long coefficients[DSP_BIQUAD_COEFFICIENTS];
+    long x1, x2, y1, y2;
+} dsp_biquad;
+
+typedef struct {
+    dsp_biquad sections[DSP_MAX_BIQUADS];
+    uchar enabled; // биты включенных звеньев
+} dsp_filter;
+
+typedef struct {
+    unsigned long integrators[DSP_CIC_ORDER];
+    unsigned long combs[DSP_CIC_ORDER];   // значения на входе гребенок в прошлый отсчет выхода
+    long gain_q31;                        // 1 / divider^DSP_CIC_ORDER в Q31
+    uchar divider;
+    uchar count;
+} dsp_decimator;
+
+void dsp_decimator_init(dsp_decimator* decimator, uchar divider);
+bool dsp_decimate(dsp_decimator* decimator, long sample, long* output);
+long dsp_multiply_q31(long value, long factor_q31);
+void dsp_filter_set_section(dsp_filter* filter, uchar section, long* coefficients);
+void dsp_filter_clear(dsp_filter* filter);
+void dsp_filter_reset(dsp_filter* filter);
+long dsp_filter_process(dsp_filter* filter, long sample);
+
+#endif //DSP_H
@@ -0,0 +1,15 @@
+#ifndef FRAM_H
+#define FRAM_H
+
+#include "hal.h"
+
+/**
+ * Переменные с __attribute__((persistent)) лежат в секции .persistent в FRAM программ (msp430fr2476.ld)
+ * и сохраняются при выключении питания. После reset эта память защищена от записи битом PFWP (SYSCFG0),
+ * поэтому запись в них нужно обрамлять FRAM_WRITE_ENABLE() / FRAM_WRITE_DISABLE().
+ * Старший байт SYSCFG0 - пароль FRWPPW, бит DFWP (защита INFOMEM) не трогаем
+ */
+#define FRAM_WRITE_ENABLE()  (SYSCFG0 = FRWPPW | (SYSCFG0 & DFWP))
+#define FRAM_WRITE_DISABLE() (SYSCFG0 = FRWPPW | (SYSCFG0 & DFWP) | PFWP)
+
+#endif //FRAM_H
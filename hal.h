@@ -0,0 +1,16 @@
+#ifndef HAL_H
+#define HAL_H
+
+/**
+ * Доступ к железу (регистры, векторы прерываний, intrinsics) для всех модулей.
+ * На MSP430 это заголовок TI msp430fr2476.h.
+ * На компьютере - host/hal_host.h: регистры там обычные переменные,
+ * а прерывания вызывает host/hal_host.c по сценарию теста или бенчмарка.
+ */
+#ifdef __MSP430__
+#include <msp430fr2476.h>
+#else
+#include "host/hal_host.h"
+#endif
+
+#endif //HAL_H
@@ -0,0 +1,68 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include "utypes.h"
+
+/**
+ * Передача данных из прерывания (писатель) в main loop (читатель) без выключения прерываний.
+ * У каждого handoff один писатель и один читатель.
+ *
+ * Писатель меняет общие данные между handoff_write_begin() и handoff_write_end():
+ * пока данные меняются sequence нечетный, когда они согласованы - четный.
+ * sequence / 2 - сколько раз данные опубликованы (uint переполняется, разности остаются верными).
+ * Begin и end могут быть в разных прерываниях (DRDY начинает измерение ADS, SPI его заканчивает).
+ *
+ * Читатель копирует данные так:
+ *   do {
+ *       sequence = handoff_read_begin(&handoff);
+ *       ... копируем ...
+ *   } while(!handoff_read_end(&handoff, sequence));
+ * Если во время копирования сработал писатель, sequence изменился и копирование повторяется.
+ * Писатель никогда не ждет читателя, а читатель повторяет копирование не чаще чем срабатывает прерывание.
+ * Если данных нет, а есть только событие (watermark акселерометра), хватает handoff_consume().
+ */
+
+// не дает компилятору переставить доступ к общим данным через доступ к sequence
+#define HANDOFF_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+typedef struct {
+    volatile uint sequence;
+} handoff;
+
+static inline void handoff_write_begin(handoff* h) {
+    h->sequence++;
+    HANDOFF_BARRIER();
+}
+
+static inline void handoff_write_end(handoff* h) {
+    HANDOFF_BARRIER();
+    h->sequence++;
+}
+
+static inline uint handoff_read_begin(handoff* h) {
+    uint sequence = h->sequence;
+    HANDOFF_BARRIER();
+    return sequence;
+}
+
+/**
+ * true если данные скопированные после handoff_read_begin() согласованы
+ */
+static inline bool handoff_read_end(handoff* h, uint sequence) {
+    HANDOFF_BARRIER();
+    return !(sequence & 1) && h->sequence == sequence;
+}
+
+/**
+ * Сколько раз данные опубликованы с прошлого вызова. taken - sequence на котором читатель остановился
+ * (начальное значение - текущий h->sequence), незаконченная запись не считается
+ */
+static inline uint handoff_consume(handoff* h, uint* taken) {
+    uint sequence = handoff_read_begin(h) & ~1u;
+    uint published = (uint)(sequence - *taken) >> 1;
+    *taken = sequence;
+    return published;
+}
+
+#endif //HANDOFF_H
@@ -0,0 +1,359 @@
+#include <stdbool.h>
+#include <string.h>
+#include "utypes.h"
+#include "databatch.h"
+#include "rice.h"
+#include "batch_decoder.h"
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#define START_MARKER 0xAA
+#define STOP_MARKER 0x55
+#define MESSAGE_START 0xA5
+#define BATCH_HEADER_SIZE 4
+#define BATCH_TAIL_SIZE 1
+
+/* CRC-16/CCITT-FALSE (crc16.c прошивки) по байту за шаг: crc = (crc << 8) ^ table[(crc >> 8) ^ byte] */
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+/**
+ * CRC16 пакета с PACKET_CRC (как считает прошивка модулем CRC16)
+ */
+uint16_t batch_crc16(const uint8_t* data, size_t size) {
+    uint16_t crc = 0xFFFF;
+    while(size-- > 0) {
+        crc = (uint16_t)(crc << 8) ^ crc16_table[(crc >> 8) ^ *data++];
+    }
+    return crc;
+}
+
+void batch_decoder_init(batch_decoder* decoder, const batch_layout* layout) {
+    int channel;
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->layout = *layout;
+    decoder->ads_data_offset = BATCH_HEADER_SIZE;
+    if(layout->packet_format != PACKET_FORMAT_RAW) {
+        decoder->ads_data_offset++; // packet_format
+    }
+    if(layout->packet_format & PACKET_RICE) {
+        decoder->ads_data_offset++; // ads_data_length
+    }
+    if(layout->packet_format & PACKET_LOFF) {
+        decoder->loff_size = layout->number_of_channels > 2 ? 2 : 1;
+    }
+    for(channel = 0; channel < layout->number_of_channels; channel++) {
+        decoder->sample_counts[channel] = BATCH_NUMBER_OF_MESURING / layout->dividers[channel];
+        decoder->ads_data_size += decoder->sample_counts[channel] * 3;
+        decoder->batch.number_of_samples += decoder->sample_counts[channel];
+    }
+    memcpy(decoder->batch.sample_counts, decoder->sample_counts, sizeof(decoder->sample_counts));
+}
+
+/**
+ * 24-битные little endian samples в int32 со знаком.
+ * Есть варианты на AVX2 (8 samples за шаг) и SSSE3 (4 samples),
+ * какой использовать решает компилятор по -march. Остаток и все остальное - обычный код.
+ */
+void batch_unpack24(const uint8_t* in, int32_t* out, size_t count) {
+#if defined(__AVX2__)
+    // байт 3 каждого int32 берем из старшего байта sample, потом сдвигом вправо расширяем знак
+    const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                             -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    // байты 12..23 переносим в верхнюю половину регистра
+    const __m256i permute = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    // читаем 32 байта, а используем 24, поэтому последние samples оставляем обычному коду
+    while(count >= 11) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)in);
+        x = _mm256_permutevar8x32_epi32(x, permute);
+        x = _mm256_shuffle_epi8(x, shuffle);
+        _mm256_storeu_si256((__m256i*)out, _mm256_srai_epi32(x, 8));
+        in += 24;
+        out += 8;
+        count -= 8;
+    }
+#endif
+#if defined(__SSSE3__)
+    const __m128i shuffle4 = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    // читаем 16 байт, а используем 12
+    while(count >= 6) {
+        __m128i x = _mm_loadu_si128((const __m128i*)in);
+        x = _mm_shuffle_epi8(x, shuffle4);
+        _mm_storeu_si128((__m128i*)out, _mm_srai_epi32(x, 8));
+        in += 12;
+        out += 4;
+        count -= 4;
+    }
+#endif
+    while(count > 0) {
+        *out++ = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 24) >> 8;
+        in += 3;
+        count--;
+    }
+}
+
+/*
+ * Размер пакета который начинается в packet, 0 - данных пока не хватает чтобы его узнать,
+ * -1 - размер невозможный (ложный START_MARKER или испорченный пакет)
+ */
+static int batch_size(batch_decoder* decoder, const uint8_t* packet, size_t available, int* ads_size) {
+    int size;
+    *ads_size = decoder->ads_data_size;
+    if(decoder->layout.packet_format & PACKET_RICE) {
+        if(available < (size_t)decoder->ads_data_offset) {
+            return 0;
+        }
+        if(packet[decoder->ads_data_offset - 1] != 0) {
+            *ads_size = packet[decoder->ads_data_offset - 1];
+        }
+    }
+    size = decoder->ads_data_offset + *ads_size + BATCH_ACC_ADC_DATA_SIZE + decoder->loff_size;
+    if(decoder->layout.packet_format & PACKET_ACC_RAW) {
+        // число samples акселерометра стоит перед ними
+        if(available <= (size_t)size) {
+            return 0;
+        }
+        if(packet[size] > BATCH_ACC_RAW_MAX_SAMPLES) {
+            return -1;
+        }
+        size += 1 + packet[size] * BATCH_ACC_SAMPLE_SIZE;
+    }
+    if(decoder->layout.packet_format & PACKET_ADC_SCAN) {
+        // число каналов ADC стоит перед ними
+        if(available <= (size_t)size) {
+            return 0;
+        }
+        if(packet[size] > BATCH_ADC_MAX_CHANNELS) {
+            return -1;
+        }
+        size += 1 + packet[size] * 2;
+    }
+    if(decoder->layout.packet_format & PACKET_ADC_SYNC) {
+        // число каналов ADC, потом каналы каждого из 10 измерений
+        if(available <= (size_t)size) {
+            return 0;
+        }
+        if(packet[size] > BATCH_ADC_MAX_CHANNELS) {
+            return -1;
+        }
+        size += 1 + packet[size] * 2 * BATCH_NUMBER_OF_MESURING;
+    }
+    if(decoder->layout.packet_format & PACKET_TIMESTAMP) {
+        size += BATCH_TIMESTAMP_SIZE;
+    }
+    if(decoder->layout.packet_format & PACKET_CRC) {
+        size += BATCH_CRC_SIZE;
+    }
+    return size + BATCH_TAIL_SIZE;
+}
+
+static bool decode_batch(batch_decoder* decoder, const uint8_t* packet, int ads_size,
+                         batch_callback callback, void* context) {
+    decoded_batch* batch = &decoder->batch;
+    const uint8_t* ads_data = packet + decoder->ads_data_offset;
+    batch->batch_number = (uint16_t)(packet[2] | packet[3] << 8);
+    batch->packet_format = PACKET_FORMAT_RAW;
+    if(decoder->layout.packet_format != PACKET_FORMAT_RAW) {
+        batch->packet_format = packet[BATCH_HEADER_SIZE];
+        if((batch->packet_format & ~PACKET_REPLAYED) != decoder->layout.packet_format) {
+            return false;
+        }
+    }
+    if(ads_size != decoder->ads_data_size) { // сжатые данные
+        long samples[BATCH_MAX_SAMPLES];
+        int i;
+        if(rice_decode((uchar*)ads_data, ads_size, decoder->sample_counts, decoder->layout.number_of_channels,
+                       decoder->layout.rice_k, samples) != ads_size) {
+            return false;
+        }
+        for(i = 0; i < batch->number_of_samples; i++) {
+            batch->samples[i] = (int32_t)samples[i];
+        }
+    } else {
+        batch_unpack24(ads_data, batch->samples, batch->number_of_samples);
+    }
+    batch->acc_adc = ads_data + ads_size;
+    batch->loff_status = 0;
+    if(decoder->loff_size > 0) {
+        const uint8_t* loff = batch->acc_adc + BATCH_ACC_ADC_DATA_SIZE;
+        batch->loff_status = decoder->loff_size > 1 ? (uint16_t)(loff[0] | loff[1] << 8) : loff[0];
+    }
+    batch->acc_raw_count = 0;
+    batch->acc_raw = NULL;
+    const uint8_t* tail = batch->acc_adc + BATCH_ACC_ADC_DATA_SIZE + decoder->loff_size;
+    if(decoder->layout.packet_format & PACKET_ACC_RAW) {
+        batch->acc_raw_count = tail[0];
+        batch->acc_raw = tail + 1;
+        tail += 1 + tail[0] * BATCH_ACC_SAMPLE_SIZE;
+    }
+    batch->adc_count = 0;
+    batch->adc = NULL;
+    if(decoder->layout.packet_format & PACKET_ADC_SCAN) {
+        batch->adc_count = tail[0];
+        batch->adc = tail + 1;
+        tail += 1 + tail[0] * 2;
+    }
+    batch->adc_sync_count = 0;
+    batch->adc_sync = NULL;
+    if(decoder->layout.packet_format & PACKET_ADC_SYNC) {
+        batch->adc_sync_count = tail[0];
+        batch->adc_sync = tail + 1;
+        tail += 1 + tail[0] * 2 * BATCH_NUMBER_OF_MESURING;
+    }
+    batch->timestamp = 0;
+    if(decoder->layout.packet_format & PACKET_TIMESTAMP) {
+        batch->timestamp = (uint32_t)tail[0] | (uint32_t)tail[1] << 8 | (uint32_t)tail[2] << 16 | (uint32_t)tail[3] << 24;
+    }
+
+    batch->replayed = (batch->packet_format & PACKET_REPLAYED) != 0;
+    if(batch->replayed) {
+        // отложенный в FRAM пакет заполняет пропуск в номерах который уже посчитан
+        decoder->replayed_batches++;
+        if(decoder->lost_batches > 0) {
+            decoder->lost_batches--;
+        }
+    } else {
+        if(decoder->has_last_number) {
+            decoder->lost_batches += (uint16_t)(batch->batch_number - decoder->last_number - 1);
+        }
+        decoder->has_last_number = 1;
+        decoder->last_number = batch->batch_number;
+    }
+    decoder->batches++;
+    if(callback != NULL) {
+        callback(batch, context);
+    }
+    return true;
+}
+
+/*
+ * Разбирает все целые пакеты в data. Возвращает сколько байт разобрано,
+ * остаток - начало пакета который еще не пришел целиком
+ */
+static size_t parse(batch_decoder* decoder, const uint8_t* data, size_t size,
+                    batch_callback callback, void* context) {
+    size_t position = 0;
+    while(size - position >= 3) {
+        const uint8_t* packet = data + position;
+        size_t available = size - position;
+        int packet_size;
+        int ads_size = 0;
+        if(packet[0] != START_MARKER) {
+            const uint8_t* next = memchr(packet, START_MARKER, available);
+            size_t skip = next == NULL ? available : (size_t)(next - packet);
+            decoder->skipped_bytes += skip;
+            position += skip;
+            continue;
+        }
+        if(packet[1] == START_MARKER) {
+            packet_size = batch_size(decoder, packet, available, &ads_size);
+        } else if(packet[1] == MESSAGE_START && packet[2] >= 4) {
+            packet_size = packet[2];
+        } else {
+            decoder->skipped_bytes++;
+            position++;
+            continue;
+        }
+        if(packet_size < 0) {
+            decoder->bad_packets++;
+            position++;
+            continue;
+        }
+        if(packet_size == 0 || (size_t)packet_size > available) {
+            break; // ждем остальные байты
+        }
+        if(packet[packet_size - 1] != STOP_MARKER) {
+            // ложный START_MARKER или испорченный пакет: ищем начало со следующего байта
+            decoder->bad_packets++;
+            position++;
+            continue;
+        }
+        if(packet[1] == START_MARKER && (decoder->layout.packet_format & PACKET_CRC) &&
+           batch_crc16(packet + 2, packet_size - 2 - BATCH_CRC_SIZE - BATCH_TAIL_SIZE) !=
+           (packet[packet_size - 3] | packet[packet_size - 2] << 8)) {
+            decoder->crc_errors++;
+            decoder->bad_packets++;
+            position++;
+            continue;
+        }
+        if(packet[1] == MESSAGE_START) {
+            decoder->messages++;
+        } else if(!decode_batch(decoder, packet, ads_size, callback, context)) {
+            decoder->bad_packets++;
+            position++;
+            continue;
+        }
+        position += packet_size;
+    }
+    return position;
+}
+
+/**
+ * Передает декодеру очередной кусок потока (любого размера, пакеты могут быть разорваны).
+ * Для каждого целого пакета вызывается callback
+ */
+void batch_decoder_feed(batch_decoder* decoder, const uint8_t* data, size_t size,
+                        batch_callback callback, void* context) {
+    size_t parsed;
+    // сначала дособираем пакет оборванный в прошлый раз
+    while(decoder->carry_size > 0 && size > 0) {
+        size_t added = sizeof(decoder->carry) - decoder->carry_size;
+        if(added > size) {
+            added = size;
+        }
+        memcpy(decoder->carry + decoder->carry_size, data, added);
+        decoder->carry_size += added;
+        data += added;
+        size -= added;
+        parsed = parse(decoder, decoder->carry, decoder->carry_size, callback, context);
+        decoder->carry_size -= parsed;
+        if(decoder->carry_size <= added) {
+            // остаток целиком из новых данных: продолжаем разбирать их на месте без копирования
+            data -= decoder->carry_size;
+            size += decoder->carry_size;
+            decoder->carry_size = 0;
+        } else {
+            memmove(decoder->carry, decoder->carry + parsed, decoder->carry_size);
+        }
+    }
+    if(decoder->carry_size > 0) {
+        return; // все новые данные ушли в carry
+    }
+    parsed = parse(decoder, data, size, callback, context);
+    decoder->carry_size = size - parsed;
+    memcpy(decoder->carry, data + parsed, decoder->carry_size);
+}
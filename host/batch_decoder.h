@@ -0,0 +1,90 @@
+#ifndef BATCH_DECODER_H
+#define BATCH_DECODER_H
+
+/**
+ * Разбор потока пакетов databatch.c на стороне хоста (Linux/Windows, не для MSP430).
+ * Формат пакета описан в начале databatch.c, здесь он должен поддерживаться в том же виде.
+ *
+ * Сборка вместе с rice.c из корня проекта, например:
+ *   gcc -O2 -march=native -I. host/batch_decoder.c rice.c ...
+ * Библиотека на C, из C++ подключается как есть.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BATCH_MAX_CHANNELS 8
+#define BATCH_NUMBER_OF_MESURING 10
+#define BATCH_MAX_SAMPLES (BATCH_MAX_CHANNELS * BATCH_NUMBER_OF_MESURING)
+#define BATCH_ACC_ADC_DATA_SIZE 8
+#define BATCH_ACC_SAMPLE_SIZE 6
+#define BATCH_ACC_RAW_MAX_SAMPLES 32
+#define BATCH_ADC_MAX_CHANNELS 12
+#define BATCH_TIMESTAMP_SIZE 4
+#define BATCH_CRC_SIZE 2
+#define BATCH_MAX_SIZE 1024
+
+/* то что хост задал в ADS_START_RECORDING */
+typedef struct {
+    uint8_t number_of_channels;            // 2, 4, 6 или 8
+    uint8_t dividers[BATCH_MAX_CHANNELS];
+    uint8_t packet_format;                 // флаги PACKET_... из databatch.h
+    uint8_t rice_k;
+} batch_layout;
+
+typedef struct {
+    uint16_t batch_number;
+    uint8_t packet_format;                      // с PACKET_REPLAYED у отложенных в FRAM пакетов
+    int replayed;                               // пакет отложен в FRAM и пришел позже (номер меньше последнего)
+    uint8_t sample_counts[BATCH_MAX_CHANNELS];  // n_i = 10 / divider_i
+    int32_t samples[BATCH_MAX_SAMPLES];         // n_0 samples канала 0, потом n_1 канала 1 ...
+    int number_of_samples;
+    const uint8_t* acc_adc;                     // BATCH_ACC_ADC_DATA_SIZE байт как в пакете
+    uint16_t loff_status;                       // PACKET_LOFF: lead-off биты (4-8 каналов: P | N << 8), иначе 0
+    int acc_raw_count;                          // PACKET_ACC_RAW: сколько samples акселерометра, иначе 0
+    const uint8_t* acc_raw;                     // их x, y, z (по BATCH_ACC_SAMPLE_SIZE байт) как в пакете
+    int adc_count;                              // PACKET_ADC_SCAN: сколько каналов ADC, иначе 0
+    const uint8_t* adc;                         // их средние (по 2 байта little endian) как в пакете
+    int adc_sync_count;                         // PACKET_ADC_SYNC: сколько каналов ADC, иначе 0
+    const uint8_t* adc_sync;                    // 10 измерений по adc_sync_count каналов (0xFFFF - нет серии)
+    uint32_t timestamp;                         // PACKET_TIMESTAMP: время первого измерения (такты XT1), иначе 0
+} decoded_batch;
+
+typedef void (*batch_callback)(const decoded_batch* batch, void* context);
+
+typedef struct {
+    batch_layout layout;
+    uint8_t sample_counts[BATCH_MAX_CHANNELS];
+    int ads_data_size;                  // байт данных ADS без сжатия
+    int ads_data_offset;                // где в пакете начинаются данные ADS
+    int loff_size;                      // байт lead-off статуса после батарейки
+    uint8_t carry[BATCH_MAX_SIZE];      // начало пакета оборванного на конце прошлого куска потока
+    size_t carry_size;
+    int has_last_number;
+    uint16_t last_number;
+    decoded_batch batch;
+    /* статистика */
+    uint64_t batches;
+    uint64_t lost_batches;      // пропуски в номерах пакетов (без заполненных отложенными пакетами)
+    uint64_t replayed_batches;  // пакеты с PACKET_REPLAYED
+    uint64_t bad_packets;       // нет STOP_MARKER, не тот формат, не распаковываются сжатые данные, не та CRC
+    uint64_t crc_errors;        // PACKET_CRC: из них не совпала CRC
+    uint64_t skipped_bytes;     // байты между пакетами (поиск START_MARKER|START_MARKER)
+    uint64_t messages;          // ответы на команды (FRAME_START|MESSAGE_START...) пропущены
+} batch_decoder;
+
+void batch_decoder_init(batch_decoder* decoder, const batch_layout* layout);
+void batch_decoder_feed(batch_decoder* decoder, const uint8_t* data, size_t size,
+                        batch_callback callback, void* context);
+void batch_unpack24(const uint8_t* in, int32_t* out, size_t count);
+uint16_t batch_crc16(const uint8_t* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BATCH_DECODER_H
@@ -0,0 +1,83 @@
+#include <math.h>
+#include "clock_drift.h"
+
+void clock_drift_init(clock_drift* drift, double device_hz) {
+    drift->device_hz = device_hz;
+    drift->first_ticks = 0;
+    drift->last_ticks = 0;
+    drift->first_host = 0;
+    drift->count = 0;
+    drift->mean_device = 0;
+    drift->mean_host = 0;
+    drift->device_variance = 0;
+    drift->host_variance = 0;
+    drift->covariance = 0;
+}
+
+/* 32-битная метка прибора переполняется (раз в 36 часов при 32768 Гц): разворачиваем относительно последней */
+static int64_t unwrap(const clock_drift* drift, uint32_t device_ticks) {
+    return drift->last_ticks + (int32_t)(device_ticks - (uint32_t)drift->last_ticks);
+}
+
+/* секунды прибора с первой метки */
+static double device_seconds(const clock_drift* drift, int64_t ticks) {
+    return (double)(ticks - drift->first_ticks) / drift->device_hz;
+}
+
+/**
+ * Пакет с меткой device_ticks принят хостом в host_seconds (монотонные часы хоста)
+ */
+void clock_drift_add(clock_drift* drift, uint32_t device_ticks, double host_seconds) {
+    double x;
+    double y;
+    double dx;
+    double dy;
+    if(drift->count == 0) {
+        drift->first_ticks = drift->last_ticks = device_ticks;
+        drift->first_host = host_seconds;
+    }
+    drift->last_ticks = unwrap(drift, device_ticks);
+    x = device_seconds(drift, drift->last_ticks);
+    y = host_seconds - drift->first_host;
+    drift->count++;
+    dx = x - drift->mean_device;
+    dy = y - drift->mean_host;
+    drift->mean_device += dx / drift->count;
+    drift->mean_host += dy / drift->count;
+    drift->device_variance += dx * (x - drift->mean_device);
+    drift->host_variance += dy * (y - drift->mean_host);
+    drift->covariance += dx * (y - drift->mean_host);
+}
+
+/* наклон: секунд хоста в секунде прибора (1 пока точек меньше двух) */
+static double slope(const clock_drift* drift) {
+    return drift->device_variance > 0 ? drift->covariance / drift->device_variance : 1.0;
+}
+
+/**
+ * Время хоста (в тех же часах что и host_seconds) для метки прибора,
+ * метки до первой и после последней экстраполируются
+ */
+double clock_drift_host_time(const clock_drift* drift, uint32_t device_ticks) {
+    double x = device_seconds(drift, unwrap(drift, device_ticks));
+    return drift->first_host + drift->mean_host + slope(drift) * (x - drift->mean_device);
+}
+
+/**
+ * Насколько кварц прибора медленнее часов хоста, ppm (положительное - прибор отстает)
+ */
+double clock_drift_ppm(const clock_drift* drift) {
+    return (slope(drift) - 1.0) * 1e6;
+}
+
+/**
+ * Среднеквадратичное отклонение времени приема от прямой, секунды
+ */
+double clock_drift_jitter(const clock_drift* drift) {
+    double residual;
+    if(drift->count < 3 || drift->device_variance <= 0) {
+        return 0;
+    }
+    residual = drift->host_variance - drift->covariance * drift->covariance / drift->device_variance;
+    return residual > 0 ? sqrt(residual / (drift->count - 2)) : 0;
+}
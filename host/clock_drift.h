@@ -0,0 +1,44 @@
+#ifndef CLOCK_DRIFT_H
+#define CLOCK_DRIFT_H
+
+/**
+ * Перевод меток времени пакетов (PACKET_TIMESTAMP, такты кварца прибора) в часы хоста.
+ * Кварц прибора уходит от часов хоста на десятки ppm, поэтому отображение ищется линейной регрессией
+ * host_time = offset + slope * device_time по всем парам (метка пакета, время его приема хостом).
+ * Шум приема (буферы USB/Bluetooth) усредняется, а отсчеты нескольких приборов выравниваются
+ * по общим часам хоста без взаимной корреляции сигналов.
+ * Время приема включает среднюю задержку передачи, она одинаково сдвигает все отсчеты прибора.
+ * Пакеты с PACKET_REPLAYED (отложенные в FRAM) пришли позже своего времени, их в регрессию не подавать.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    double device_hz;           // частота тактов метки (TIMESTAMP_HZ)
+    int64_t first_ticks;        // первая метка, от нее отсчитывается время прибора
+    int64_t last_ticks;         // последняя метка без переполнений 32 бит
+    double first_host;          // время хоста для первой метки
+    uint64_t count;
+    /* регрессия (обновление средних по Уэлфорду, без потери точности на длинных записях) */
+    double mean_device;
+    double mean_host;
+    double device_variance;     // суммы квадратов отклонений
+    double host_variance;
+    double covariance;
+} clock_drift;
+
+void clock_drift_init(clock_drift* drift, double device_hz);
+void clock_drift_add(clock_drift* drift, uint32_t device_ticks, double host_seconds);
+double clock_drift_host_time(const clock_drift* drift, uint32_t device_ticks);
+double clock_drift_ppm(const clock_drift* drift);
+double clock_drift_jitter(const clock_drift* drift);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CLOCK_DRIFT_H
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "batch_decoder.h"
+
+/**
+ * Разбирает записанный поток UART (файл) и печатает статистику и скорость декодера.
+ *   decode_capture <file> <number_of_channels> <divider_0 ... divider_n> [packet_format [rice_k]]
+ * Файл читается кусками по CHUNK_SIZE байт (записи бывают по несколько GB), время чтения в скорость не входит.
+ */
+
+#define CHUNK_SIZE (1024 * 1024)
+
+static void count_samples(const decoded_batch* batch, void* context) {
+    *(uint64_t*)context += batch->number_of_samples;
+}
+
+static double seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+    batch_layout layout = {0};
+    batch_decoder* decoder;
+    uint64_t samples = 0;
+    uint64_t size = 0;
+    uint8_t* data;
+    size_t chunk;
+    double start;
+    double elapsed = 0;
+    int i;
+    FILE* file;
+
+    if(argc < 4) {
+        fprintf(stderr, "usage: %s <file> <number_of_channels> <divider_0 ... divider_n> [packet_format [rice_k]]\n", argv[0]);
+        return 1;
+    }
+    layout.number_of_channels = (uint8_t)atoi(argv[2]);
+    if(layout.number_of_channels == 0 || layout.number_of_channels > BATCH_MAX_CHANNELS
+       || argc < 3 + layout.number_of_channels) {
+        fprintf(stderr, "wrong number of channels or dividers\n");
+        return 1;
+    }
+    for(i = 0; i < layout.number_of_channels; i++) {
+        layout.dividers[i] = (uint8_t)atoi(argv[3 + i]);
+        if(layout.dividers[i] == 0) {
+            fprintf(stderr, "wrong divider %s\n", argv[3 + i]);
+            return 1;
+        }
+    }
+    if(argc > 3 + layout.number_of_channels) {
+        layout.packet_format = (uint8_t)strtol(argv[3 + layout.number_of_channels], NULL, 0);
+    }
+    if(argc > 4 + layout.number_of_channels) {
+        layout.rice_k = (uint8_t)atoi(argv[4 + layout.number_of_channels]);
+    }
+
+    file = fopen(argv[1], "rb");
+    if(file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    data = malloc(CHUNK_SIZE);
+    decoder = malloc(sizeof(batch_decoder));
+    if(data == NULL || decoder == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    batch_decoder_init(decoder, &layout);
+    while((chunk = fread(data, 1, CHUNK_SIZE, file)) > 0) {
+        start = seconds();
+        batch_decoder_feed(decoder, data, chunk, count_samples, &samples);
+        elapsed += seconds() - start;
+        size += chunk;
+    }
+    fclose(file);
+
+    printf("batches:       %llu\n", (unsigned long long)decoder->batches);
+    printf("lost batches:  %llu\n", (unsigned long long)decoder->lost_batches);
+    printf("bad packets:   %llu\n", (unsigned long long)decoder->bad_packets);
+    printf("CRC errors:    %llu\n", (unsigned long long)decoder->crc_errors);
+    printf("skipped bytes: %llu\n", (unsigned long long)decoder->skipped_bytes);
+    printf("messages:      %llu\n", (unsigned long long)decoder->messages);
+    printf("samples:       %llu\n", (unsigned long long)samples);
+    if(elapsed > 0) {
+        printf("speed:         %.1f MB/s, %.0f samples/s\n", size / elapsed / 1e6, samples / elapsed);
+    }
+    free(decoder);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include "hal_host.h"
+
+/**
+ * Host backend HAL: регистры MSP430 как переменные и "периферия" которая вызывает обработчики прерываний.
+ * Работает синхронно: функция события сама вызывает нужный обработчик (и следующие за ним),
+ * main loop (databatch_process(), commands_process()) тест или бенчмарк вызывает сам.
+ * Блокирующие обмены (spi_exchange()) не моделируются: они сразу читают RXBUF,
+ * поэтому значения которые надо "получить" сценарий заранее кладет в регистр.
+ */
+
+#define HAL_HOST_REGISTER(name) volatile uint16_t name;
+#include "hal_host_registers.h"
+#undef HAL_HOST_REGISTER
+
+unsigned char hal_host_hifram[HAL_HOST_HIFRAM_SIZE];
+
+#define NO_DATA 0xFFFF // TXBUF 8-битный: если после обработчика там не NO_DATA, значит байт отправлен
+
+/* обработчики прерываний прошивки */
+void PORT2_ISR(void);
+void PORT3_ISR(void);
+void ADC_ISR(void);
+void TIMERB0_ISR(void);
+void TIMERA1_ISR(void);
+void USCI_A0_ISR(void);
+void USCI_B1_ISR(void);
+
+static volatile int interrupts_disabled;
+static hal_host_interrupt_hook enable_hook;
+
+static uint16_t port_interrupt_vector(uint8_t bits) {
+    uint16_t vector = 0x02;
+    while(!(bits & 1)) {
+        bits >>= 1;
+        vector += 2;
+    }
+    return vector;
+}
+
+void hal_host_init() {
+    UCA0IFG = UCTXIFG; // после сброса TXBUF свободен
+    UCB1IFG = UCTXIFG;
+}
+
+/**
+ * Фронт на выводах bits порта port (2 или 3): выставляет флаги и вызывает обработчик порта
+ */
+void hal_host_port_interrupt(uint8_t port, uint8_t bits) {
+    if(port == 2) {
+        P2IFG |= bits;
+        if(P2IE & bits) {
+            P2IV = port_interrupt_vector(bits);
+            PORT2_ISR();
+            P2IFG &= ~bits; // чтение P2IV сбрасывает флаг
+        }
+    } else if(port == 3) {
+        P3IFG |= bits;
+        if(P3IE & bits) {
+            P3IV = port_interrupt_vector(bits);
+            PORT3_ISR();
+        }
+    }
+}
+
+/**
+ * SPI (eUSCI_B1) master: пока прерывания SPI включены, вызывает TX и RX обработчики,
+ * каждый отправленный байт передает slave и его ответ кладет в RXBUF
+ */
+void hal_host_spi_run(hal_host_spi_slave slave) {
+    while(UCB1IE & (UCRXIE | UCTXIE)) {
+        if((UCB1IE & UCRXIE) && (UCB1IFG & UCRXIFG)) {
+            UCB1IFG &= ~UCRXIFG;
+            UCB1IV = 0x02;
+            USCI_B1_ISR();
+        } else if((UCB1IE & UCTXIE) && (UCB1IFG & UCTXIFG)) {
+            UCB1IFG &= ~UCTXIFG;
+            UCB1TXBUF = NO_DATA;
+            UCB1IV = 0x04;
+            USCI_B1_ISR();
+            if(UCB1TXBUF != NO_DATA) {
+                UCB1RXBUF = slave((unsigned char)UCB1TXBUF);
+                UCB1IFG |= UCRXIFG;
+            }
+            UCB1IFG |= UCTXIFG;
+        } else {
+            break; // прерывания включены, но ждать им нечего
+        }
+    }
+}
+
+/**
+ * UART (eUSCI_A0) TX: вызывает TX обработчик пока он включен, байты отдает в sink.
+ * Отправка мгновенная, то есть как будто UART бесконечно быстрый
+ */
+void hal_host_uart_run(hal_host_uart_sink sink) {
+    while((UCA0IE & UCTXIE) && (UCA0IFG & UCTXIFG)) {
+        UCA0TXBUF = NO_DATA;
+        UCA0IV = 0x04;
+        USCI_A0_ISR();
+        if(UCA0TXBUF != NO_DATA) {
+            sink((unsigned char)UCA0TXBUF);
+        }
+    }
+}
+
+/**
+ * UART RX: пришел байт ch
+ */
+void hal_host_uart_receive(unsigned char ch) {
+    UCA0RXBUF = ch;
+    UCA0IFG |= UCRXIFG;
+    if(UCA0IE & UCRXIE) {
+        UCA0IV = 0x02;
+        USCI_A0_ISR();
+        UCA0IFG &= ~UCRXIFG;
+    }
+}
+
+/**
+ * ADC закончил преобразование с результатом value
+ */
+void hal_host_adc_conversion(uint16_t value) {
+    ADCCTL0 &= ~ADCSC; // сбрасывается в начале преобразования
+    ADCMEM0 = value;
+    ADCIFG |= ADCIFG0;
+    if(ADCIE & ADCIE0) {
+        ADCIV = 0x0C;
+        ADC_ISR();
+        ADCIFG &= ~ADCIFG0;
+    }
+}
+
+/**
+ * true если ADC сейчас преобразует: запущен ADCSC или идет последовательность каналов (ADCCONSEQ и ADCENC),
+ * то есть сценарий должен закончить преобразование hal_host_adc_conversion()
+ */
+int hal_host_adc_busy() {
+    return (ADCCTL0 & ADCSC) || ((ADCCTL1 & ADCCONSEQ) && (ADCCTL0 & ADCENC));
+}
+
+/**
+ * Timer_A1 (метка времени, такты XT1) насчитал еще ticks тактов: на каждом переходе через 0
+ * выставляется TAIFG и вызывается обработчик переполнения
+ */
+void hal_host_timer_a1_advance(uint32_t ticks) {
+    while(ticks > 0) {
+        uint32_t step = 0x10000u - TA1R;
+        if(ticks < step) {
+            TA1R += (uint16_t)ticks;
+            return;
+        }
+        ticks -= step;
+        TA1R = 0;
+        TA1CTL |= TAIFG;
+        if(TA1CTL & TAIE) {
+            TA1IV = 0x0E;
+            TIMERA1_ISR();
+            TA1CTL &= ~TAIFG; // чтение TA1IV сбрасывает флаг
+        }
+    }
+}
+
+/**
+ * Переполнение Timer_B0 (запуск преобразований ADC)
+ */
+void hal_host_timer_b0_overflow() {
+    TB0IV = 0x0E;
+    TIMERB0_ISR();
+}
+
+/**
+ * __disable_interrupt() / __enable_interrupt() прошивки.
+ * Тест который вызывает прерывания из обработчика сигнала проверяет hal_host_interrupts_enabled(),
+ * откладывает их пока прерывания выключены и вызывает из hook при включении
+ */
+void hal_host_interrupts_disable() {
+    interrupts_disabled = 1;
+}
+
+void hal_host_interrupts_enable() {
+    interrupts_disabled = 0;
+    if(enable_hook) {
+        enable_hook();
+    }
+}
+
+int hal_host_interrupts_enabled() {
+    return !interrupts_disabled;
+}
+
+void hal_host_on_interrupts_enable(hal_host_interrupt_hook hook) {
+    enable_hook = hook;
+}
@@ -0,0 +1,140 @@
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+/**
+ * Host вариант hal.h: прошивка собирается обычным gcc на компьютере (Linux).
+ * Регистры - переменные (host/hal_host.c), intrinsics MSP430 ничего не делают,
+ * а прерывания вызываются функциями hal_host_... из host/hal_host.c.
+ * Значения битов взяты из msp430fr2476.h.
+ */
+
+#include <stdint.h>
+
+#define HAL_HOST_REGISTER(name) extern volatile uint16_t name;
+#include "hal_host_registers.h"
+#undef HAL_HOST_REGISTER
+
+/*----------- intrinsics ------------*/
+#define interrupt(vector)                      // __attribute__((interrupt(X_VECTOR))) -> обычная функция
+#define __delay_cycles(cycles)                 ((void)0)
+#define __no_operation()                       ((void)0)
+#define __enable_interrupt()                   hal_host_interrupts_enable()
+#define __disable_interrupt()                  hal_host_interrupts_disable()
+#define __bis_SR_register(bits)                ((void)0) // в том числе сон: main loop на хосте не спит
+#define __bic_SR_register(bits)                ((void)0)
+#define __low_power_mode_off_on_exit()         ((void)0)
+#define __even_in_range(value, range)          (value)
+#define persistent                             // __attribute__((persistent)) -> обычная переменная
+// HIFRAM (выше 64K, на MSP430 доступна только через MOVX) - массив hal_host_hifram
+#define __data20_read_char(address)            (hal_host_hifram[(address) - HAL_HOST_HIFRAM_START])
+#define __data20_write_char(address, value)    (hal_host_hifram[(address) - HAL_HOST_HIFRAM_START] = (value))
+
+#define HAL_HOST_HIFRAM_START 0x10000UL
+#define HAL_HOST_HIFRAM_SIZE  0x8000
+extern unsigned char hal_host_hifram[HAL_HOST_HIFRAM_SIZE];
+
+/*----------- векторы (на хосте только для вида) ------------*/
+#define PORT2_VECTOR       1
+#define PORT3_VECTOR       2
+#define ADC_VECTOR         3
+#define TIMER0_B0_VECTOR   4
+#define USCI_A0_VECTOR     5
+#define USCI_B1_VECTOR     6
+#define TIMER1_A1_VECTOR   7
+
+/*----------- биты ------------*/
+#define BIT0 (0x0001)
+#define BIT1 (0x0002)
+#define BIT2 (0x0004)
+#define BIT3 (0x0008)
+#define BIT4 (0x0010)
+#define BIT5 (0x0020)
+#define BIT6 (0x0040)
+#define BIT7 (0x0080)
+
+#define GIE       (0x0008)
+#define LPM0_bits (0x0010)
+#define SCG0      (0x0040)
+
+#define WDTPW     (0x5A00)
+#define WDTHOLD   (0x0080)
+#define LOCKLPM5  (0x0001)
+#define OFIFG     (0x0002)
+#define INTREFEN  (0x0001)
+#define FRWPPW    (0xA500)
+#define PFWP      (0x0001)
+#define DFWP      (0x0002)
+
+#define DCORSEL_5  (0x000A)
+#define FLLD       (0x7000)
+#define FLLUNLOCK  (0x0300)
+#define REFOLP     (0x0080)
+#define XT1AUTOOFF (0x0001)
+#define XT1BYPASS  (0x0010)
+#define XT1OFFG    (0x0001)
+
+#define ADCSC     (0x0001)
+#define ADCENC    (0x0002)
+#define ADCON     (0x0010)
+#define ADCMSC    (0x0080)
+#define ADCCONSEQ   (0x0006)
+#define ADCCONSEQ_1 (0x0002)
+#define ADCSHP    (0x0200)
+#define ADCSSEL_2 (0x0010)
+#define ADCDIV_2  (0x0040)
+#define ADCRES_2  (0x0020)
+#define ADCSREF_1 (0x0010)
+#define ADCSREF_3 (0x0030)
+#define ADCIE0    (0x0001)
+#define ADCIFG0   (0x0001)
+
+#define TACLR     (0x0004)
+#define TAIFG     (0x0001)
+#define TAIE      (0x0002)
+#define TASSEL_1  (0x0100)
+#define TASSEL_2  (0x0200)
+#define MC_1      (0x0010)
+#define MC_2      (0x0020)
+#define MC_3      (0x0030)
+#define ID_3      (0x00C0)
+#define OUTMOD_7  (0x00E0)
+#define CCIE      (0x0010)
+#define TBCLR     (0x0004)
+#define TBIE      (0x0002)
+#define TBSSEL_2  (0x0200)
+
+#define UCSWRST   (0x0001)
+#define UCSYNC    (0x0100)
+#define UCMST     (0x0800)
+#define UCMSB     (0x2000)
+#define UCCKPL    (0x4000)
+#define UCSSEL_2  (0x0080)
+#define UCOS16    (0x0001)
+#define UCBUSY    (0x0001)
+#define UCRXIE    (0x0001)
+#define UCTXIE    (0x0002)
+#define UCRXIFG   (0x0001)
+#define UCTXIFG   (0x0002)
+
+/*----------- события для прерываний ------------*/
+typedef unsigned char (*hal_host_spi_slave)(unsigned char mosi); // ответ устройства (MISO) на байт MOSI
+typedef void (*hal_host_uart_sink)(unsigned char ch);            // байт ушедший из UART
+typedef void (*hal_host_interrupt_hook)(void);
+
+void hal_host_init();
+void hal_host_port_interrupt(uint8_t port, uint8_t bits);
+void hal_host_spi_run(hal_host_spi_slave slave);
+void hal_host_uart_run(hal_host_uart_sink sink);
+void hal_host_uart_receive(unsigned char ch);
+void hal_host_adc_conversion(uint16_t value);
+int hal_host_adc_busy();
+void hal_host_timer_b0_overflow();
+void hal_host_timer_a1_advance(uint32_t ticks);
+
+/* GIE: прерывания которые тест вызывает асинхронно (сигналом) должны ждать пока прошивка их не включит */
+void hal_host_interrupts_enable();
+void hal_host_interrupts_disable();
+int hal_host_interrupts_enabled();
+void hal_host_on_interrupts_enable(hal_host_interrupt_hook hook);
+
+#endif //HAL_HOST_H
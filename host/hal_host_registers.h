@@ -0,0 +1,45 @@
+/**
+ * Регистры MSP430FR2476 которые используют модули прошивки.
+ * Подключается с разными определениями HAL_HOST_REGISTER:
+ * в hal_host.h как объявления, в hal_host.c как определения переменных.
+ * Новый регистр в прошивке - добавить его сюда.
+ */
+/* ADC */
+HAL_HOST_REGISTER(ADCCTL0) HAL_HOST_REGISTER(ADCCTL1) HAL_HOST_REGISTER(ADCCTL2) HAL_HOST_REGISTER(ADCIE)
+HAL_HOST_REGISTER(ADCIFG) HAL_HOST_REGISTER(ADCIV) HAL_HOST_REGISTER(ADCMCTL0) HAL_HOST_REGISTER(ADCMEM0)
+/* Clock system */
+HAL_HOST_REGISTER(CSCTL0) HAL_HOST_REGISTER(CSCTL1) HAL_HOST_REGISTER(CSCTL2) HAL_HOST_REGISTER(CSCTL3)
+HAL_HOST_REGISTER(CSCTL4) HAL_HOST_REGISTER(CSCTL6) HAL_HOST_REGISTER(CSCTL7)
+/* Ports */
+HAL_HOST_REGISTER(P1DIR) HAL_HOST_REGISTER(P1IN) HAL_HOST_REGISTER(P1OUT) HAL_HOST_REGISTER(P1REN)
+HAL_HOST_REGISTER(P1SEL0) HAL_HOST_REGISTER(P1SEL1) HAL_HOST_REGISTER(P1SELC)
+HAL_HOST_REGISTER(P2DIR) HAL_HOST_REGISTER(P2IE) HAL_HOST_REGISTER(P2IES) HAL_HOST_REGISTER(P2IFG)
+HAL_HOST_REGISTER(P2IN) HAL_HOST_REGISTER(P2IV) HAL_HOST_REGISTER(P2OUT) HAL_HOST_REGISTER(P2REN)
+HAL_HOST_REGISTER(P2SEL0) HAL_HOST_REGISTER(P2SEL1)
+HAL_HOST_REGISTER(P3DIR) HAL_HOST_REGISTER(P3IE) HAL_HOST_REGISTER(P3IES) HAL_HOST_REGISTER(P3IFG)
+HAL_HOST_REGISTER(P3IN) HAL_HOST_REGISTER(P3IV) HAL_HOST_REGISTER(P3OUT) HAL_HOST_REGISTER(P3REN)
+HAL_HOST_REGISTER(P3SEL0) HAL_HOST_REGISTER(P3SEL1)
+HAL_HOST_REGISTER(P4DIR) HAL_HOST_REGISTER(P4OUT) HAL_HOST_REGISTER(P4REN) HAL_HOST_REGISTER(P4SEL0)
+HAL_HOST_REGISTER(P4SEL1)
+HAL_HOST_REGISTER(P5DIR) HAL_HOST_REGISTER(P5OUT) HAL_HOST_REGISTER(P5REN) HAL_HOST_REGISTER(P5SEL0)
+HAL_HOST_REGISTER(P5SEL1)
+HAL_HOST_REGISTER(P6DIR) HAL_HOST_REGISTER(P6OUT) HAL_HOST_REGISTER(P6REN) HAL_HOST_REGISTER(P6SEL0)
+HAL_HOST_REGISTER(P6SEL1)
+/* System */
+HAL_HOST_REGISTER(PM5CTL0) HAL_HOST_REGISTER(PMMCTL2) HAL_HOST_REGISTER(SFRIFG1) HAL_HOST_REGISTER(SYSCFG0)
+HAL_HOST_REGISTER(SYSCFG2) HAL_HOST_REGISTER(WDTCTL)
+/* Timers */
+HAL_HOST_REGISTER(TA1CTL) HAL_HOST_REGISTER(TA1IV) HAL_HOST_REGISTER(TA1R)
+HAL_HOST_REGISTER(TA2CCR0) HAL_HOST_REGISTER(TA2CCTL1) HAL_HOST_REGISTER(TA2CTL)
+HAL_HOST_REGISTER(TB0CCR0) HAL_HOST_REGISTER(TB0CCTL0) HAL_HOST_REGISTER(TB0CTL) HAL_HOST_REGISTER(TB0EX0)
+HAL_HOST_REGISTER(TB0IV) HAL_HOST_REGISTER(TB0R)
+/* eUSCI_A0 (UART) */
+HAL_HOST_REGISTER(UCA0BR0) HAL_HOST_REGISTER(UCA0BR1) HAL_HOST_REGISTER(UCA0BRW) HAL_HOST_REGISTER(UCA0CTL1)
+HAL_HOST_REGISTER(UCA0CTLW0) HAL_HOST_REGISTER(UCA0IE) HAL_HOST_REGISTER(UCA0IFG) HAL_HOST_REGISTER(UCA0IV)
+HAL_HOST_REGISTER(UCA0MCTLW) HAL_HOST_REGISTER(UCA0RXBUF) HAL_HOST_REGISTER(UCA0STATW) HAL_HOST_REGISTER(UCA0TXBUF)
+HAL_HOST_REGISTER(UCA1CTL1)
+/* eUSCI_B0, eUSCI_B1 (SPI) */
+HAL_HOST_REGISTER(UCB0BR0) HAL_HOST_REGISTER(UCB0BRW) HAL_HOST_REGISTER(UCB0CTLW0) HAL_HOST_REGISTER(UCB0IE)
+HAL_HOST_REGISTER(UCB0IFG) HAL_HOST_REGISTER(UCB0RXBUF) HAL_HOST_REGISTER(UCB0STATW) HAL_HOST_REGISTER(UCB0TXBUF)
+HAL_HOST_REGISTER(UCB1BRW) HAL_HOST_REGISTER(UCB1CTLW0) HAL_HOST_REGISTER(UCB1IE) HAL_HOST_REGISTER(UCB1IFG)
+HAL_HOST_REGISTER(UCB1IV) HAL_HOST_REGISTER(UCB1RXBUF) HAL_HOST_REGISTER(UCB1STATW) HAL_HOST_REGISTER(UCB1TXBUF)
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "hal_host.h"
+#include "utypes.h"
+#include "uart.h"
+#include "commands.h"
+#include "databatch.h"
+#include "ads1292.h"
+#include "acc.h"
+#include "batch_decoder.h"
+
+/**
+ * Проверяет передачу данных из прерываний в main loop (handoff.h) на компьютере.
+ * Прерывания вызываются из обработчика сигнала таймера, то есть в случайных местах main loop
+ * (между любыми двумя инструкциями), как на MSP430:
+ *  - DRDY (PORT3) и чтение измерения ADS по SPI,
+ *  - Timer_B0 и конец преобразования ADC (ADC_ISR: серия каналов A6, A7 и батарейка),
+ *  - watermark FIFO акселерометра (PORT2).
+ * main loop крутит acc_handle_interrupt(), databatch_process() и отправку по UART, пакеты разбирает batch_decoder.
+ * Проверяется что:
+ *  - среднее ADC в каждом пакете равно значению которое отдает модель ADC (разорванная копия сумм дала бы другое),
+ *  - ни одно измерение ADS не потеряно и не взято дважды, данные акселерометра и батарейки не разорваны,
+ *  - регистры ADS записанные командой во время записи (SDATAC/WREG/RDATAC между DRDY) читаются из копии в RAM,
+ *    а DRDY пришедший пока прерывание DRDY выключено читается после записи,
+ *  - DRDY внутри make_batch() (при включении прерываний в uart_transmit_queued() и adc_battery_request())
+ *    не переписывает собранный и поставленный в очередь пакет: данные каждого измерения ADS разные,
+ *    так что переписанный после подсчета CRC пакет хост получит с неверной CRC.
+ * Прерывания которые прошивка выключает (__disable_interrupt(), запуск UART и батарейки) откладываются до включения.
+ *   handoff_stress [seconds]
+ *
+ *   gcc -O2 -I. -Ihost host/handoff_stress.c host/hal_host.c host/batch_decoder.c $(ls *.c | grep -v main.c) -o handoff_stress
+ */
+
+#define SAMPLES_PER_BATCH 10
+#define DRDY_BIT BIT7
+#define ACC_INT1_BIT BIT2
+#define ACC_BYTE 0x05           // FIFO_SRC = 5 samples, каждая ось 0x0505
+#define ADC_VALUE 2048          // все преобразования ADC (и батарейки)
+#define ADC_AVERAGE (ADC_VALUE << 3)
+#define ADC_CHANNELS 2
+#define BATTERY_MILLIVOLTS 3300
+#define MIN_PERIOD_NS 2000      // интервал между прерываниями случайный
+#define MAX_PERIOD_NS 40000
+#define UART_BUFFER_SIZE (64 * 1024)
+#define LIVE_WRITE_PERIOD 500000// итераций main loop между записями регистров ADS
+#define LIVE_WRITE_ADDRESS 0x04 // CH1SET, CH2SET
+
+volatile bool interrupt_flag; // в прошивке определен в main.c
+
+static timer_t timer;
+static unsigned int seed = 1;
+static volatile bool stopped;
+static volatile bool pending;       // сигнал пришел когда прерывания были выключены
+static volatile bool uart_running;  // main loop сейчас в прерывании UART, они друг друга не прерывают
+static volatile unsigned long drdy_count;
+static volatile unsigned long watermark_count;
+static volatile unsigned long adc_count;
+static int ads_frame_byte;
+static uchar uart_buffer[UART_BUFFER_SIZE];
+static size_t uart_buffer_size;
+static unsigned long mismatches;
+static unsigned long adc_mismatches;
+static bool adc_started;
+static unsigned long live_writes;
+static bool in_databatch;               // main loop сейчас в databatch_process()
+static unsigned int main_seed = 2;      // rand_r() main loop, seed таймера трогает обработчик сигнала
+static unsigned long make_batch_drdys;  // DRDY пришедшие внутри make_batch()
+
+static unsigned char ads_slave(unsigned char mosi) {
+    int byte = ads_frame_byte++;
+    (void)mosi;
+    return byte < 3 ? (byte == 0 ? 0xC0 : 0x00) : (unsigned char)(byte * 17 + drdy_count);
+}
+
+static void arm_timer() {
+    struct itimerspec period = {{0, 0}, {0, MIN_PERIOD_NS + rand_r(&seed) % (MAX_PERIOD_NS - MIN_PERIOD_NS)}};
+    timer_settime(timer, 0, &period, NULL);
+}
+
+static void read_ads_sample() {
+    ads_frame_byte = 0;
+    hal_host_port_interrupt(3, DRDY_BIT);
+    hal_host_spi_run(ads_slave);
+}
+
+/*
+ * Пока прерывание DRDY выключено (запись регистров во время записи), флаг P3IFG ждет,
+ * и как на MSP430 измерение читается когда прерывание снова включено (deliver_deferred_drdy())
+ */
+static void fire_drdy() {
+    if(P3IE & DRDY_BIT) {
+        read_ads_sample();
+    } else {
+        P3IFG |= DRDY_BIT;
+    }
+    drdy_count++;
+}
+
+static void deliver_deferred_drdy() {
+    if(P3IFG & P3IE & DRDY_BIT) {
+        read_ads_sample();
+    }
+}
+
+/* одно случайное прерывание */
+static void fire_interrupt() {
+    switch(rand_r(&seed) % 4) {
+    case 0:
+        fire_drdy();
+        break;
+    case 1:
+        hal_host_port_interrupt(2, ACC_INT1_BIT);
+        watermark_count++;
+        break;
+    case 2:
+        hal_host_timer_b0_overflow();
+        break;
+    case 3:
+        if(hal_host_adc_busy()) { // прошивка запустила ADC
+            hal_host_adc_conversion(ADC_VALUE);
+            adc_count++;
+        }
+        break;
+    }
+}
+
+static void on_signal(int signal) {
+    (void)signal;
+    if(!hal_host_interrupts_enabled() || uart_running) {
+        pending = true;
+    } else {
+        deliver_deferred_drdy();
+        fire_interrupt();
+    }
+    if(!stopped) {
+        arm_timer();
+    }
+}
+
+/*
+ * Прерывания включены снова: отложенное прерывание срабатывает сразу.
+ * Внутри databatch_process() прерывания включаются только в make_batch(): там DRDY приходит через раз
+ */
+static void on_interrupts_enable() {
+    if(pending && !uart_running) {
+        pending = false;
+        fire_interrupt();
+    } else if(in_databatch && rand_r(&main_seed) % 2 == 0) {
+        fire_drdy();
+        make_batch_drdys++;
+    }
+}
+
+static void uart_sink(unsigned char ch) {
+    if(uart_buffer_size < UART_BUFFER_SIZE) {
+        uart_buffer[uart_buffer_size++] = ch;
+    }
+}
+
+static void check_batch(const decoded_batch* batch, void* context) {
+    int adc = batch->acc_adc[0] | batch->acc_adc[1] << 8;
+    int i;
+    (void)context;
+    // до первой серии ADC в пакете 0, потом всегда среднее модели
+    if(adc == ADC_AVERAGE) {
+        adc_started = true;
+    } else if(adc != 0 || adc_started) {
+        adc_mismatches++;
+    }
+    if(batch->adc_count != ADC_CHANNELS) {
+        mismatches++;
+    } else {
+        for(i = 0; i < ADC_CHANNELS * 2; i += 2) {
+            int channel = batch->adc[i] | batch->adc[i + 1] << 8;
+            if(channel != (adc_started ? ADC_AVERAGE : 0)) {
+                adc_mismatches++;
+            }
+        }
+    }
+    // acc_adc[2..5] - оси x, y акселерометра (0x0505 + 32768) или 0 пока samples не было
+    for(i = 2; i < 6; i += 2) {
+        int acc = batch->acc_adc[i] | batch->acc_adc[i + 1] << 8;
+        if(acc != 0x0505 + 32768 && acc != 0) {
+            mismatches++;
+        }
+    }
+    int battery = batch->acc_adc[6] | batch->acc_adc[7] << 8;
+    if(battery != BATTERY_MILLIVOLTS && battery != 0) {
+        mismatches++;
+    }
+}
+
+static void send_command(const uchar* command, int size) {
+    int i;
+    for(i = 0; i < size; i++) {
+        hal_host_uart_receive(command[i]);
+    }
+    commands_process(); // весь кадр за одно пробуждение main loop
+}
+
+/*
+ * ADS_REGISTERS_WRITE во время записи, потом регистры читаются обратно (SPI при этом не трогается)
+ */
+static void live_write() {
+    uchar value = (uchar)live_writes;
+    uchar inverted = (uchar)(~value & 0xFF);
+    uchar command[] = {0xAA, 0x5A, 0x09, 0xB6, LIVE_WRITE_ADDRESS, value, inverted, 0xCC, 0x55};
+    uchar registers[2];
+    send_command(command, sizeof(command));
+    // эхо еще в очереди uart: подтверждение все равно разбирается и выполняется сразу
+    on_interrupts_enable();
+    command[3] = 0xAE; // COMMAND_CONFIRMED
+    command[2] = 0x06;
+    command[4] = command[5] = 0x55;
+    send_command(command, 6);
+    ads_read_regs(LIVE_WRITE_ADDRESS, registers, 2);
+    if(registers[0] != value || registers[1] != inverted) {
+        mismatches++;
+    }
+    live_writes++;
+}
+
+static double seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+    double duration = argc > 1 ? atof(argv[1]) : 2.0;
+    // ADC_CHANNELS_SET: A6, A7
+    static const uchar adc_command[] = {0xAA, 0x5A, 0x08, 0xB2, 0xC0, 0x00, 0x55, 0x55};
+    // ADS_START_RECORDING: делители 1, 1, packet_format PACKET_ADC_SCAN | PACKET_CRC, rice_k
+    static const uchar start_command[] = {0xAA, 0x5A, 0x0A, 0xA8, 0x01, 0x01, PACKET_ADC_SCAN | PACKET_CRC, 0x08, 0x55, 0x55};
+    batch_layout layout = {0};
+    static batch_decoder decoder;
+    struct sigevent event;
+    struct sigaction action;
+    unsigned long ads_samples;
+    unsigned long iterations = 0;
+    double end;
+
+    layout.number_of_channels = 2;
+    layout.dividers[0] = layout.dividers[1] = 1;
+    layout.packet_format = PACKET_ADC_SCAN | PACKET_CRC;
+    layout.rice_k = 8;
+    hal_host_init();
+    uart_init();
+    UCB1RXBUF = 0x00; // ID двухканалки
+    UCB0RXBUF = ACC_BYTE;
+    databatch_init(true, true);
+    send_command(adc_command, sizeof(adc_command));
+    send_command(start_command, sizeof(start_command));
+    batch_decoder_init(&decoder, &layout);
+    hal_host_on_interrupts_enable(on_interrupts_enable);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGALRM, &action, NULL);
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = SIGALRM;
+    timer_create(CLOCK_MONOTONIC, &event, &timer);
+
+    end = seconds() + duration;
+    arm_timer();
+    while(seconds() < end) {
+        if(++iterations % LIVE_WRITE_PERIOD == 0) {
+            live_write();
+        }
+        acc_handle_interrupt();
+        in_databatch = true;
+        databatch_process();
+        in_databatch = false;
+        uart_running = true;
+        hal_host_uart_run(uart_sink);
+        uart_running = false;
+        on_interrupts_enable();
+        if(uart_buffer_size > UART_BUFFER_SIZE / 2) {
+            batch_decoder_feed(&decoder, uart_buffer, uart_buffer_size, check_batch, NULL);
+            uart_buffer_size = 0;
+        }
+    }
+    stopped = true;
+    timer_delete(timer);
+    on_interrupts_enable();
+    acc_handle_interrupt();
+    databatch_process();
+    hal_host_uart_run(uart_sink);
+    batch_decoder_feed(&decoder, uart_buffer, uart_buffer_size, check_batch, NULL);
+
+    // каждое измерение ADS либо в пакете, либо в пакете который ждет своих 10, либо пропущено
+    // (пришло следующее раньше чем main loop взял это), либо потеряно вместе с пакетом (overrun).
+    // Запись регистров во время записи измерений не теряет ни одного
+    ads_samples = (decoder.batches + databatch_overruns()) * SAMPLES_PER_BATCH + ads_missed_samples();
+    if(ads_samples > drdy_count || drdy_count - ads_samples >= SAMPLES_PER_BATCH) {
+        mismatches++;
+    }
+
+    printf("DRDY:             %lu (missed %u)\n", drdy_count, ads_missed_samples());
+    printf("watermarks:       %lu\n", watermark_count);
+    printf("live ADS writes:  %lu\n", live_writes);
+    printf("DRDY in batch:    %lu\n", make_batch_drdys);
+    printf("ADC conversions:  %lu\n", adc_count);
+    printf("batches decoded:  %llu (lost %llu, bad %llu, crc errors %llu, overruns %u)\n",
+           (unsigned long long)decoder.batches, (unsigned long long)decoder.lost_batches,
+           (unsigned long long)decoder.bad_packets, (unsigned long long)decoder.crc_errors, databatch_overruns());
+    printf("ADC mismatches:   %lu\n", adc_mismatches);
+    printf("mismatches:       %lu\n", mismatches);
+    return mismatches == 0 && adc_mismatches == 0 && decoder.bad_packets == 0 &&
+           adc_started && decoder.batches > 0 && live_writes > 0 && make_batch_drdys > 0 ? 0 : 1;
+}
@@ -0,0 +1,564 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hal_host.h"
+#include "utypes.h"
+#include "uart.h"
+#include "commands.h"
+#include "databatch.h"
+#include "dsp.h"
+#include "acc.h"
+#include "timestamp.h"
+#include "batch_decoder.h"
+#include "clock_drift.h"
+
+/**
+ * Прогоняет путь данных прошивки на компьютере через host HAL:
+ * DRDY (PORT3) -> чтение ADS по SPI -> databatch -> очередь UART -> batch_decoder,
+ * плюс watermark FIFO акселерометра (PORT2) -> чтение FIFO по SPI0.
+ * Запись запускается командой ADS_START_RECORDING пришедшей по UART (commands.c), ее настройки сохраняются
+ * в профиль (PROFILE_SAVE), запись останавливается и снова запускается из профиля (PROFILE_START).
+ * Данные каналов проверяются по значениям которые отдавала модель ADS
+ * (каналы с делителем пропускаются через такой же фильтр dsp.c), а также батарейка, lead-off и акселерометр.
+ * С PACKET_ADC_SYNC ADC меряет каналы A4, A5, A6 по DRDY, и каждое их значение сверяется с тем измерением ADS
+ * во время которого модель ADC его выдала.
+ * С PACKET_TIMESTAMP Timer_A1 идет с кварцем который отстает на DEVICE_DRIFT_PPM, метки пакетов
+ * сверяются с моделью, а host/clock_drift.c по ним и модели времени приема должен найти этот уход.
+ * С PACKET_CRC начало потока еще раз разбирается с испорченными битами: ни один испорченный пакет не должен пройти.
+ * До записи прошивке приходит пачка команд больше входящего fifo без отправки ответов (command_burst()).
+ * packet_format с битом PACKET_REPLAYED (0x80) включает store-and-forward: связь пропадает на OUTAGE_BATCHES пакетов
+ * (или меньше, сколько вмещает лог, см. outage_batches()), пакеты должны дойти все (отложенные в FRAM - позже),
+ * делители при этом все 1. Store-and-forward работает только с байтом packet_format в пакете, поэтому
+ * 0x80 без других флагов не принимается. До пропадания связи в потоке
+ * с PACKET_CRC портится бит раз в NOISE_PERIOD байт: хост запрашивает пропущенные номера командой BATCH_RESEND.
+ *   pipeline_bench [number_of_batches] [number_of_channels (2, 4, 6 или 8) [divider_1 ... divider_n [packet_format [rice_k]]]]
+ * Скорость считается отдельно для прошивки и для декодера.
+ */
+
+#define SAMPLES_PER_BATCH 10
+#define ADS1294_ID 0x90 // ads_init() читает ID из RXBUF: ADS1294/6/8 - 0x90/0x91/0x92, 0 - двухканалка
+#define DRDY_BIT BIT7
+#define BATTERY_ADC_VALUE 2048  // ADC канала батарейки
+#define BATTERY_MILLIVOLTS 3300 // то же с калибровкой по умолчанию (6600 мВ на 4096)
+#define ACC_INT1_BIT BIT2
+#define ACC_BYTE 0x05           // акселерометр на SPI0 всегда отдает этот байт: FIFO_SRC = 5 samples
+#define ACC_FIFO_SAMPLES 5      // (ACC_BYTE & 0x3F), каждая ось 0x0505
+#define ACC_WATERMARK_PERIOD 2  // прерывание watermark раз в 2 измерения ADS
+#define ACC_SAMPLES_PER_BATCH (ACC_FIFO_SAMPLES * (SAMPLES_PER_BATCH / ACC_WATERMARK_PERIOD + 1))
+#define UART_BUFFER_SIZE (1024 * 1024)
+#define BATTERY_CHANNEL 7
+#define ADC_SYNC_MASK 0x70      // PACKET_ADC_SYNC: каналы A4, A5, A6
+#define ADC_SYNC_LOWEST 4
+#define ADC_SYNC_CHANNELS 3
+#define SAMPLE_RATE 500         // PACKET_TIMESTAMP: частота DRDY в модели
+#define DEVICE_DRIFT_PPM 40.0   // кварц прибора медленнее часов хоста
+#define HOST_LATENCY 0.002      // прием пакета хостом: задержка + случайная добавка до HOST_JITTER
+#define HOST_JITTER 0.001
+#define TIMESTAMP_WRAP 0xFFF00000u // добавка к меткам: переполнение 32 бит в первые полминуты записи
+#define CRC_TEST_SIZE (64 * 1024)  // PACKET_CRC: столько байт начала потока портим
+#define CRC_TEST_FLIP_PERIOD 97    // по одному биту на каждые 97 байт
+#define BATCH_NUMBERS 0x10000
+#define STORE_THRESHOLD 4          // store-and-forward: пакетов в очереди uart
+#define OUTAGE_START 100           // номер пакета с которого uart перестает отправлять
+#define OUTAGE_BATCHES 200         // если столько вмещает лог store-and-forward
+#define NOISE_PERIOD 997           // до OUTAGE_START - NOISE_GUARD пакетов портится бит раз в столько байт
+#define NOISE_GUARD 10
+#define BURST_SEQUENCED 8          // команд с номером в пачке command_burst() (все места таблицы прошивки)
+
+volatile bool interrupt_flag; // в прошивке определен в main.c
+
+static long ads_sample_number;
+static int ads_frame_byte;
+static uchar uart_buffer[UART_BUFFER_SIZE];
+static size_t uart_buffer_size;
+static int number_of_channels = 2;
+static uint8_t dividers[BATCH_MAX_CHANNELS] = {1, 1, 1, 1, 1, 1, 1, 1};
+static unsigned long mismatches;
+static long last_live_index = -1;
+static unsigned char* received_batches; // сколько раз пришел пакет с этим индексом
+static dsp_decimator reference_decimators[BATCH_MAX_CHANNELS];
+static int adc_channel = -1; // канал который ADC преобразует следующим, -1 - берем из ADCMCTL0
+static clock_drift drift;
+static uchar crc_test_stream[CRC_TEST_SIZE];
+static size_t crc_test_size;
+static uint32_t batch_digests[BATCH_NUMBERS]; // пакеты начала потока по номерам
+static unsigned long undetected_errors;
+static bool noisy_link;
+static unsigned long uart_bytes;
+static unsigned long resend_requests;
+
+/* модель сигнала ADS: медленная пила с небольшим шумом, у каналов разный сдвиг */
+static long ads_value(long sample_number, int channel) {
+    long value = (sample_number * 37 + channel * 100000 + (sample_number * 7919 % 13)) % 0x7FFFFF;
+    return value - 0x400000;
+}
+
+/* модель ADC: у каждого канала свое значение на каждое измерение ADS */
+static uint16_t adc_value(long sample_number, int channel) {
+    return (uint16_t)((sample_number * 3 + channel * 500) & 0xFFF);
+}
+
+/* заканчивает все преобразования которые запустила прошивка: серию каналов (номер канала
+ * в последовательности уменьшается, как у ADCCONSEQ_1) и батарейку */
+static void run_adc() {
+    while(hal_host_adc_busy()) {
+        int channel = adc_channel >= 0 ? adc_channel : (ADCMCTL0 & 0x0F);
+        bool sequence = (ADCCTL1 & ADCCONSEQ) != 0;
+        hal_host_adc_conversion(channel == BATTERY_CHANNEL && !sequence ? BATTERY_ADC_VALUE
+                                                                        : adc_value(ads_sample_number, channel));
+        adc_channel = sequence && (ADCCTL1 & ADCCONSEQ) ? channel - 1 : -1;
+    }
+}
+
+/* модель кварца прибора: такты Timer_A1 к DRDY измерения sample_number */
+static uint32_t device_ticks(long sample_number) {
+    return (uint32_t)((double)sample_number / SAMPLE_RATE * TIMESTAMP_HZ * (1.0 - DEVICE_DRIFT_PPM * 1e-6));
+}
+
+/* модель приема: когда хост получил пакет batch_number (в часах хоста) */
+static double host_time(long batch_number) {
+    return (double)batch_number * SAMPLES_PER_BATCH / SAMPLE_RATE + HOST_LATENCY
+           + HOST_JITTER * (batch_number * 7919 % 1000) / 1000.0;
+}
+
+/* модель ADS на SPI: на каждый байт DRDY кадра отдает статус, потом каналы в big endian */
+static unsigned char ads_slave(unsigned char mosi) {
+    int byte = ads_frame_byte++;
+    (void)mosi;
+    if(byte < 3) {
+        // status word: в одном измерении из 10 отвалился электрод (LOFF_STAT бит 1 / LOFF_STATP бит 4)
+        return byte == 0 ? (ads_sample_number % SAMPLES_PER_BATCH == 3 ? 0xC1 : 0xC0) : 0x00;
+    }
+    byte -= 3;
+    return (unsigned char)(ads_value(ads_sample_number, byte / 3) >> (8 * (2 - byte % 3)));
+}
+
+static void uart_sink(unsigned char ch) {
+    if(crc_test_size < CRC_TEST_SIZE) {
+        crc_test_stream[crc_test_size++] = ch;
+    }
+    if(noisy_link && ++uart_bytes % NOISE_PERIOD == 0) {
+        ch ^= (uchar)(1 << (uart_bytes % 8));
+    }
+    if(uart_buffer_size < UART_BUFFER_SIZE) {
+        uart_buffer[uart_buffer_size++] = ch;
+    }
+}
+
+/* FNV-1a того что декодер достал из пакета */
+static uint32_t batch_digest(const decoded_batch* batch) {
+    const uint8_t* bytes = (const uint8_t*)batch->samples;
+    uint32_t digest = 2166136261u;
+    size_t i;
+    for(i = 0; i < batch->number_of_samples * sizeof(int32_t); i++) {
+        digest = (digest ^ bytes[i]) * 16777619u;
+    }
+    for(i = 0; i < BATCH_ACC_ADC_DATA_SIZE; i++) {
+        digest = (digest ^ batch->acc_adc[i]) * 16777619u;
+    }
+    return (digest ^ batch->timestamp ^ batch->loff_status) * 16777619u;
+}
+
+static void remember_batch(const decoded_batch* batch, void* context) {
+    (void)context;
+    batch_digests[batch->batch_number] = batch_digest(batch);
+}
+
+static void check_corrupted_batch(const decoded_batch* batch, void* context) {
+    (void)context;
+    if(batch_digests[batch->batch_number] != batch_digest(batch)) {
+        undetected_errors++;
+    }
+}
+
+/*
+ * Начало потока разбирается дважды: как есть (запоминаем пакеты) и с испорченными битами.
+ * Пакеты с испорченными байтами должен отбросить CRC, остальные совпасть с запомненными
+ */
+static uint64_t crc_test(const batch_layout* layout) {
+    static batch_decoder decoder;
+    size_t i;
+    batch_decoder_init(&decoder, layout);
+    batch_decoder_feed(&decoder, crc_test_stream, crc_test_size, remember_batch, NULL);
+    for(i = CRC_TEST_FLIP_PERIOD / 2; i < crc_test_size; i += CRC_TEST_FLIP_PERIOD) {
+        crc_test_stream[i] ^= (uchar)(1 << (i % 8));
+    }
+    batch_decoder_init(&decoder, layout);
+    batch_decoder_feed(&decoder, crc_test_stream, crc_test_size, check_corrupted_batch, NULL);
+    return decoder.crc_errors;
+}
+
+/*
+ * Номер пакета 16-битный, поэтому индекс с начала записи считаем сами:
+ * отложенные пакеты приходят позже, но не дальше чем на 32768 пакетов от последнего живого
+ */
+static long batch_index(const decoded_batch* batch) {
+    long index = batch->batch_number;
+    if(last_live_index >= 0) {
+        index = last_live_index + (int16_t)(batch->batch_number - (uint16_t)last_live_index);
+    }
+    if(!batch->replayed) {
+        last_live_index = index;
+    }
+    return index;
+}
+
+static void send_command(const uchar* command, int size) {
+    int i;
+    for(i = 0; i < size; i++) {
+        hal_host_uart_receive(command[i]);
+    }
+    commands_process(); // весь кадр за одно пробуждение main loop
+}
+
+/*
+ * Пачка команд подряд, как их шлет хост, без отправки по uart (связь медленная):
+ * BURST_SEQUENCED команд с номером, их подтверждение, HELLO, HARDWARE и STATUS - больше чем вмещает
+ * входящий fifo. main loop просыпается на каждый байт, а ответы ждут в очереди uart:
+ * разбор не должен останавливаться, ни один байт не должен пропасть, и все ответы должны прийти по порядку.
+ * Возвращает сколько байт отправлено
+ */
+static int command_burst() {
+    uchar burst[BURST_SEQUENCED * 8 + 7 + 3 * 6];
+    uchar expected[BURST_SEQUENCED * 8 + 5 + 6 + 9];
+    int size = 0;
+    int expected_size = 0;
+    int i;
+    for(i = 0; i < BURST_SEQUENCED; i++) {
+        // STORE_AND_FORWARD_SET 0 (выключен) с номером 0x10 + i
+        const uchar command[] = {0xAA, 0x5A, 0x08, 0xB3, 0x00, (uchar)(0x10 + i), 0xCD, 0x55};
+        memcpy(burst + size, command, sizeof(command));
+        memcpy(expected + expected_size, command, sizeof(command));
+        size += sizeof(command);
+        expected_size += sizeof(command);
+    }
+    {
+        const uchar commands[] = {0xAA, 0x5A, 0x07, 0xB5, (uchar)(0x10 + BURST_SEQUENCED - 1), 0x55, 0x55, // SEQUENCE_CONFIRMED
+                                  0xAA, 0x5A, 0x06, 0xAB, 0x55, 0x55,  // HELLO_REQUEST
+                                  0xAA, 0x5A, 0x06, 0xAC, 0x55, 0x55,  // HARDWARE_REQUEST
+                                  0xAA, 0x5A, 0x06, 0xAF, 0x55, 0x55}; // STATUS_REQUEST
+        const uchar replies[] = {0xAA, 0xA5, 0x05, 0xA0, 0x55,
+                                 0xAA, 0xA5, 0x06, 0xA4, (uchar)number_of_channels, 0x55,
+                                 0xAA, 0xA5, 0x09, 0xA1, 0x00, 0x00, 0x00, 0x00, 0x55};
+        memcpy(burst + size, commands, sizeof(commands));
+        memcpy(expected + expected_size, replies, sizeof(replies));
+        size += sizeof(commands);
+        expected_size += sizeof(replies);
+    }
+    for(i = 0; i < size; i++) {
+        hal_host_uart_receive(burst[i]);
+        commands_process();
+    }
+    hal_host_uart_run(uart_sink);
+    if(uart_rx_overruns() != 0 || uart_buffer_size != (size_t)expected_size ||
+       memcmp(uart_buffer, expected, expected_size) != 0) {
+        mismatches++;
+    }
+    uart_buffer_size = 0;
+    return size;
+}
+
+/* BATCH_RESEND: count пакетов начиная с index */
+static void request_resend(long index, long count) {
+    uchar command[] = {0xAA, 0x5A, 0x09, 0xB4, (uchar)index, (uchar)(index >> 8), (uchar)count, 0x55, 0x55};
+    send_command(command, sizeof(command));
+    resend_requests++;
+}
+
+static void check_batch(const decoded_batch* batch, void* context) {
+    const int32_t* samples = batch->samples;
+    long last_live = last_live_index;
+    long index = batch_index(batch);
+    long number_of_batches = *(long*)context;
+    int channel;
+    int i;
+    // пропуск в живых пакетах (испорченные отбросил CRC) - сразу запрашиваем их снова
+    if(noisy_link && !batch->replayed && last_live >= 0 && index > last_live + 1) {
+        request_resend(last_live + 1, index - last_live - 1);
+    }
+    if(index < 0 || index >= number_of_batches || received_batches[index]++ > 0) {
+        mismatches++;
+        return;
+    }
+    for(channel = 0; channel < number_of_channels; channel++) {
+        const int32_t* decoded = samples;
+        long value;
+        for(i = 0; i < SAMPLES_PER_BATCH; i++) {
+            if(dsp_decimate(&reference_decimators[channel],
+                            ads_value(index * SAMPLES_PER_BATCH + i, channel), &value)) {
+                if(*decoded++ != value) {
+                    mismatches++;
+                }
+            }
+        }
+        samples += batch->sample_counts[channel];
+    }
+    if((batch->acc_adc[6] | batch->acc_adc[7] << 8) != BATTERY_MILLIVOLTS) {
+        mismatches++;
+    }
+    if((batch->packet_format & PACKET_LOFF) && batch->loff_status != (number_of_channels > 2 ? 0x10 : 0x02)) {
+        mismatches++;
+    }
+    // каналы ADC снятые по DRDY каждого измерения пакета
+    if(batch->packet_format & PACKET_ADC_SYNC) {
+        const uint8_t* adc = batch->adc_sync;
+        if(batch->adc_sync_count != ADC_SYNC_CHANNELS) {
+            mismatches++;
+        } else {
+            for(i = 0; i < SAMPLES_PER_BATCH * ADC_SYNC_CHANNELS; i++, adc += 2) {
+                if((adc[0] | adc[1] << 8) != adc_value(index * SAMPLES_PER_BATCH + i / ADC_SYNC_CHANNELS,
+                                                        ADC_SYNC_LOWEST + i % ADC_SYNC_CHANNELS)) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    if(batch->packet_format & PACKET_TIMESTAMP) {
+        if(batch->timestamp != device_ticks(index * SAMPLES_PER_BATCH)) {
+            mismatches++;
+        }
+        if(!batch->replayed) {
+            clock_drift_add(&drift, batch->timestamp + TIMESTAMP_WRAP, host_time(index));
+        }
+    }
+    // среднее по осям (+32768) и, если заданы, все samples пакета
+    // (когда ADC включен, на месте оси x его среднее)
+    for(i = (batch->packet_format & PACKET_ADC_SYNC) ? 2 : 0; i < 6; i += 2) {
+        if((batch->acc_adc[i] | batch->acc_adc[i + 1] << 8) != 0x0505 + 32768) {
+            mismatches++;
+        }
+    }
+    if(batch->packet_format & PACKET_ACC_RAW) {
+        if(batch->acc_raw_count != ACC_SAMPLES_PER_BATCH) {
+            mismatches++;
+        }
+        for(i = 0; i < batch->acc_raw_count * BATCH_ACC_SAMPLE_SIZE; i++) {
+            if(batch->acc_raw[i] != ACC_BYTE) {
+                mismatches++;
+            }
+        }
+    }
+}
+
+/*
+ * На сколько пакетов пропадает связь: OUTAGE_BATCHES, но не больше 3/4 лога store-and-forward
+ * при самом большом пакете этого формата (пока отложенные пакеты уходят, живые тоже иногда откладываются)
+ */
+static long outage_batches(const batch_decoder* decoder) {
+    uint8_t format = decoder->layout.packet_format;
+    long size = decoder->ads_data_offset + decoder->ads_data_size + BATCH_ACC_ADC_DATA_SIZE + decoder->loff_size + 1;
+    long capacity;
+    if(format & PACKET_ACC_RAW) {
+        size += 1 + ACC_SAMPLES_PER_BATCH * BATCH_ACC_SAMPLE_SIZE;
+    }
+    if(format & PACKET_ADC_SCAN) {
+        size += 1 + BATCH_ADC_MAX_CHANNELS * 2;
+    }
+    if(format & PACKET_ADC_SYNC) {
+        size += 1 + ADC_SYNC_CHANNELS * 2 * SAMPLES_PER_BATCH;
+    }
+    if(format & PACKET_TIMESTAMP) {
+        size += BATCH_TIMESTAMP_SIZE;
+    }
+    if(format & PACKET_CRC) {
+        size += BATCH_CRC_SIZE;
+    }
+    capacity = DATABATCH_STORE_LOG_SIZE / (size + 2) * 3 / 4; // запись лога: размер (2 байта) + пакет
+    return capacity < OUTAGE_BATCHES ? capacity : OUTAGE_BATCHES;
+}
+
+static double seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+    long number_of_batches = argc > 1 ? atol(argv[1]) : 100000;
+    batch_layout layout = {0};
+    uchar start_command[4 + BATCH_MAX_CHANNELS + 4];
+    // ADC_CHANNELS_SET: A4, A5, A6
+    // настройки идут командами с номером (sequence 1, 2) и подтверждаются вместе одной SEQUENCE_CONFIRMED
+    static const uchar adc_command[] = {0xAA, 0x5A, 0x09, 0xB2, ADC_SYNC_MASK, 0x00, 0x01, 0xCD, 0x55};
+    // STORE_AND_FORWARD_SET
+    static const uchar store_command[] = {0xAA, 0x5A, 0x08, 0xB3, STORE_THRESHOLD, 0x02, 0xCD, 0x55};
+    // PROFILE_SAVE в slot 1, ADS_STOP_RECORDING, PROFILE_START из slot 1
+    static const uchar profile_commands[] = {0xAA, 0x5A, 0x0F, 0xB9, 0x01, 'b', 'e', 'n', 'c', 'h', 0, 0, 0, 0x55, 0x55,
+                                             0xAA, 0x5A, 0x06, 0xA9, 0x55, 0x55,
+                                             0xAA, 0x5A, 0x07, 0xBA, 0x01, 0x55, 0x55};
+    // SEQUENCE_CONFIRMED: last_sequence
+    uchar confirm_command[] = {0xAA, 0x5A, 0x07, 0xB5, 0x00, 0x55, 0x55};
+    bool adc_sync;
+    bool store_and_forward;
+    long outage = 0;
+    int command_size;
+    int burst_size;
+    static batch_decoder decoder;
+    double firmware_time;
+    double decoder_time = 0;
+    double start;
+    long sample;
+    int i;
+    double alignment_error = 0;
+
+    if(argc > 2) {
+        number_of_channels = atoi(argv[2]);
+        if(number_of_channels != 4 && number_of_channels != 6 && number_of_channels != 8) {
+            number_of_channels = 2;
+        }
+    }
+    for(i = 0; i < number_of_channels && argc > 3 + i; i++) {
+        dividers[i] = (uint8_t)atoi(argv[3 + i]);
+    }
+    layout.number_of_channels = (uint8_t)number_of_channels;
+    for(i = 0; i < number_of_channels; i++) {
+        layout.dividers[i] = dividers[i];
+        dsp_decimator_init(&reference_decimators[i], dividers[i]);
+    }
+    if(argc > 3 + number_of_channels) {
+        layout.packet_format = (uint8_t)strtol(argv[3 + number_of_channels], NULL, 0);
+    }
+    adc_sync = (layout.packet_format & PACKET_ADC_SYNC) != 0;
+    store_and_forward = (layout.packet_format & PACKET_REPLAYED) != 0;
+    layout.packet_format &= ~PACKET_REPLAYED;
+    if(store_and_forward && layout.packet_format == PACKET_FORMAT_RAW) {
+        fprintf(stderr, "store-and-forward (0x80) needs at least one more packet_format flag, e.g. 0x88\n");
+        return 1;
+    }
+    if(store_and_forward) {
+        // пакеты приходят не по порядку, а эталонный фильтр децимации считает только по порядку
+        for(i = 0; i < number_of_channels; i++) {
+            layout.dividers[i] = dividers[i] = 1;
+            dsp_decimator_init(&reference_decimators[i], 1);
+        }
+    }
+    received_batches = calloc(number_of_batches > 0 ? number_of_batches : 1, 1);
+    layout.rice_k = argc > 4 + number_of_channels ? (uint8_t)atoi(argv[4 + number_of_channels]) : 8;
+    // FRAME_START|COMMAND_START|size|ADS_START_RECORDING|dividers...|packet_format|rice_k|FRAME_STOP|FRAME_STOP
+    command_size = 0;
+    start_command[command_size++] = 0xAA;
+    start_command[command_size++] = 0x5A;
+    start_command[command_size++] = (uchar)(number_of_channels + 8);
+    start_command[command_size++] = 0xA8;
+    for(i = 0; i < number_of_channels; i++) {
+        start_command[command_size++] = dividers[i];
+    }
+    start_command[command_size++] = layout.packet_format;
+    start_command[command_size++] = layout.rice_k;
+    start_command[command_size++] = 0x55;
+    start_command[command_size++] = 0x55;
+
+    hal_host_init();
+    uart_init();
+    UCB1RXBUF = number_of_channels > 2 ? ADS1294_ID + (number_of_channels - 4) / 2 : 0x00;
+    UCB0RXBUF = ACC_BYTE;
+    clock_drift_init(&drift, TIMESTAMP_HZ);
+    databatch_init(adc_sync, true);
+    burst_size = command_burst();
+    printf("command burst:    %d bytes, %u rx overruns\n", burst_size, uart_rx_overruns());
+    if(adc_sync) {
+        send_command(adc_command, sizeof(adc_command));
+        confirm_command[4] = adc_command[6];
+    }
+    if(store_and_forward) {
+        send_command(store_command, sizeof(store_command));
+        confirm_command[4] = store_command[5];
+    }
+    // эхо команд с номером должно вернуться как есть, выполняются они только после подтверждения
+    hal_host_uart_run(uart_sink);
+    if(uart_buffer_size != (adc_sync ? sizeof(adc_command) : 0) + (store_and_forward ? sizeof(store_command) : 0) ||
+       (adc_sync && memcmp(uart_buffer, adc_command, sizeof(adc_command)) != 0) ||
+       (store_and_forward && memcmp(uart_buffer + uart_buffer_size - sizeof(store_command), store_command,
+                                    sizeof(store_command)) != 0)) {
+        mismatches++;
+    }
+    uart_buffer_size = 0;
+    crc_test_size = 0;
+    if(adc_sync || store_and_forward) {
+        send_command(confirm_command, sizeof(confirm_command));
+    }
+    send_command(start_command, command_size);
+    send_command(profile_commands, sizeof(profile_commands));
+    batch_decoder_init(&decoder, &layout);
+    if(store_and_forward) {
+        outage = outage_batches(&decoder);
+    }
+
+    firmware_time = seconds();
+    for(sample = 0; sample < number_of_batches * SAMPLES_PER_BATCH; sample++) {
+        ads_sample_number = sample;
+        ads_frame_byte = 0;
+        hal_host_timer_a1_advance(device_ticks(sample) - (sample > 0 ? device_ticks(sample - 1) : 0));
+        hal_host_port_interrupt(3, DRDY_BIT);
+        hal_host_spi_run(ads_slave);
+        run_adc(); // серия запущенная DRDY (PACKET_ADC_SYNC)
+        if(sample % ACC_WATERMARK_PERIOD == ACC_WATERMARK_PERIOD - 1) {
+            hal_host_port_interrupt(2, ACC_INT1_BIT);
+            acc_handle_interrupt();
+        }
+        databatch_process();
+        run_adc(); // прошивка запустила ADC (батарейка)
+        if(sample < OUTAGE_START * SAMPLES_PER_BATCH || sample >= (OUTAGE_START + outage) * SAMPLES_PER_BATCH) {
+            hal_host_uart_run(uart_sink); // иначе связь пропала
+        }
+        // без PACKET_CRC испорченный пакет не отличить от правильного
+        noisy_link = store_and_forward && (layout.packet_format & PACKET_CRC) &&
+                     sample < (OUTAGE_START - NOISE_GUARD) * SAMPLES_PER_BATCH;
+        // хост с BATCH_RESEND разбирает поток сразу, иначе пакеты успеют уйти из истории
+        if(uart_buffer_size > UART_BUFFER_SIZE / 2 || (store_and_forward && uart_buffer_size > 0)) {
+            start = seconds();
+            batch_decoder_feed(&decoder, uart_buffer, uart_buffer_size, check_batch, &number_of_batches);
+            decoder_time += seconds() - start;
+            uart_buffer_size = 0;
+        }
+    }
+    firmware_time = seconds() - firmware_time - decoder_time;
+    batch_decoder_feed(&decoder, uart_buffer, uart_buffer_size, check_batch, &number_of_batches);
+
+    printf("batches sent:     %ld\n", number_of_batches);
+    printf("batches decoded:  %llu (lost %llu, bad %llu)\n", (unsigned long long)decoder.batches,
+           (unsigned long long)decoder.lost_batches, (unsigned long long)decoder.bad_packets);
+    printf("overruns:         %u\n", databatch_overruns());
+    if(store_and_forward) {
+        printf("replayed:         %llu (outage %ld batches, %lu resend requests, %llu CRC errors)\n",
+               (unsigned long long)decoder.replayed_batches, outage, resend_requests, (unsigned long long)decoder.crc_errors);
+        if(decoder.replayed_batches == 0 || decoder.lost_batches != 0 ||
+           ((layout.packet_format & PACKET_CRC) && resend_requests == 0)) {
+            mismatches++;
+        }
+    }
+    printf("mismatches:       %lu\n", mismatches);
+    if(layout.packet_format & PACKET_TIMESTAMP) {
+        // выровненное время первого измерения пакета против модели (средняя задержка приема одинакова для всех)
+        for(sample = 0; sample < number_of_batches * SAMPLES_PER_BATCH; sample += SAMPLES_PER_BATCH) {
+            double error = clock_drift_host_time(&drift, device_ticks(sample) + TIMESTAMP_WRAP)
+                           - ((double)sample / SAMPLE_RATE + HOST_LATENCY + HOST_JITTER / 2);
+            if(error < 0) {
+                error = -error;
+            }
+            if(error > alignment_error) {
+                alignment_error = error;
+            }
+        }
+        printf("clock drift:      %.2f ppm (model %.2f), jitter %.0f us, alignment error %.1f us\n",
+               clock_drift_ppm(&drift), DEVICE_DRIFT_PPM, clock_drift_jitter(&drift) * 1e6, alignment_error * 1e6);
+        if(alignment_error > 100e-6) {
+            mismatches++;
+        }
+    }
+    if(layout.packet_format & PACKET_CRC) {
+        uint64_t crc_errors = crc_test(&layout);
+        printf("CRC test:         %llu corrupted batches rejected, %lu passed\n",
+               (unsigned long long)crc_errors, undetected_errors);
+        if(undetected_errors > 0 || crc_errors == 0) {
+            mismatches++;
+        }
+    }
+    printf("firmware:         %.0f ADS samples/s\n", number_of_batches * SAMPLES_PER_BATCH / firmware_time);
+    if(decoder_time > 0) {
+        printf("decoder:          %.0f batches/s\n", decoder.batches / decoder_time);
+    }
+    return mismatches == 0 && decoder.batches == (uint64_t)number_of_batches ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "utypes.h"
+#include "rice.h"
+
+/**
+ * Проверяет что rice_decode() восстанавливает ровно то что сжал rice_encode() (rice.c) при любых данных:
+ *  - каждый k от 0 до RICE_MAX_K,
+ *  - 2 и 8 каналов, разное число samples в канале (делители 1, 2, 5, 10),
+ *  - постоянный сигнал, малые разности, разности на границе escape (RICE_ESCAPE << k) и сразу за ней,
+ *  - полная шкала 24 бит: скачки 0x7FFFFF <-> 0x800000 (самые большие разности) и случайные значения.
+ * Кроме того сжатые данные которые не помещаются в out_size должны давать -1, а не испорченный буфер.
+ *   rice_roundtrip [iterations]
+ *
+ *   gcc -O2 -I. host/rice_roundtrip.c rice.c -o rice_roundtrip
+ */
+
+#define MAX_CHANNELS 8
+#define SAMPLES_PER_BATCH 10
+#define MAX_SAMPLES (MAX_CHANNELS * SAMPLES_PER_BATCH)
+#define ESCAPE 16 // RICE_ESCAPE в rice.c
+#define OUT_SIZE (MAX_SAMPLES * 5 + 1) // с escape разность занимает ESCAPE + 24 бита
+#define GUARD 0xA5
+
+typedef enum {
+    PATTERN_CONSTANT,
+    PATTERN_SMALL,
+    PATTERN_ESCAPE_EDGE,  // разности вокруг границы escape для k
+    PATTERN_FULL_SCALE,   // 0x7FFFFF, 0x800000, ...
+    PATTERN_RANDOM,
+    NUMBER_OF_PATTERNS
+} PATTERN;
+
+static const uchar dividers[] = {1, 2, 5, 10};
+static unsigned int seed = 1;
+static unsigned long cases;
+static unsigned long escapes;
+static unsigned long failures;
+
+static long random24() {
+    long value = ((long)(rand_r(&seed) & 0xFFF) << 12) | (rand_r(&seed) & 0xFFF);
+    return value & 0x800000L ? value - 0x1000000L : value;
+}
+
+static long wrap24(long value) {
+    value &= 0xFFFFFFL;
+    return value & 0x800000L ? value - 0x1000000L : value;
+}
+
+/* значение sample i канала: разность с предыдущим задает pattern */
+static long pattern_value(PATTERN pattern, uchar k, int i, long previous) {
+    long edge = (long)ESCAPE << k; // zigzag разности >= edge уходит в escape
+    long delta;
+    if(i == 0) {
+        return pattern == PATTERN_FULL_SCALE ? 0x7FFFFFL : random24();
+    }
+    switch(pattern) {
+    case PATTERN_CONSTANT:
+        return previous;
+    case PATTERN_SMALL:
+        return wrap24(previous + rand_r(&seed) % 7 - 3);
+    case PATTERN_ESCAPE_EDGE:
+        // zigzag: delta >= 0 -> 2 * delta, delta < 0 -> -2 * delta - 1
+        switch(i % 4) {
+        case 0: delta = (edge - 1) / 2; break;   // последняя разность без escape (положительная)
+        case 1: delta = -(edge / 2); break;      // последняя без escape (отрицательная)
+        case 2: delta = edge / 2; break;         // первая с escape
+        default: delta = -(edge / 2) - 1; break;
+        }
+        return wrap24(previous + delta);
+    case PATTERN_FULL_SCALE:
+        return previous == 0x7FFFFFL ? -0x800000L : 0x7FFFFFL;
+    default:
+        return random24();
+    }
+}
+
+static void put24(uchar* destination, long value) {
+    destination[0] = (uchar)value;
+    destination[1] = (uchar)(value >> 8);
+    destination[2] = (uchar)(value >> 16);
+}
+
+static void check(uchar number_of_channels, const uchar* sample_counts, uchar k, PATTERN pattern) {
+    uchar ads_data[MAX_SAMPLES * 3];
+    uchar compressed[OUT_SIZE + 1];
+    long expected[MAX_SAMPLES];
+    long decoded[MAX_SAMPLES];
+    uchar counts[MAX_CHANNELS];
+    int number_of_samples = 0;
+    int size;
+    int i;
+    uchar channel;
+
+    for(channel = 0; channel < number_of_channels; channel++) {
+        long previous = 0;
+        counts[channel] = sample_counts[channel];
+        for(i = 0; i < sample_counts[channel]; i++) {
+            long value = pattern_value(pattern, k, i, previous);
+            long delta = wrap24(value - previous);
+            if(i > 0 && ((delta >= 0 ? 2 * delta : -2 * delta - 1) >> k) >= ESCAPE) {
+                escapes++;
+            }
+            put24(ads_data + number_of_samples * 3, value);
+            expected[number_of_samples++] = value;
+            previous = value;
+        }
+    }
+    cases++;
+    compressed[OUT_SIZE] = GUARD;
+    size = rice_encode(ads_data, counts, number_of_channels, k, compressed, OUT_SIZE);
+    if(size <= 0 || compressed[OUT_SIZE] != GUARD) {
+        printf("encode failed: %d channels, k %d, pattern %d\n", number_of_channels, k, pattern);
+        failures++;
+        return;
+    }
+    if(rice_decode(compressed, size, counts, number_of_channels, k, decoded) != size) {
+        printf("decode size mismatch: %d channels, k %d, pattern %d\n", number_of_channels, k, pattern);
+        failures++;
+        return;
+    }
+    for(i = 0; i < number_of_samples; i++) {
+        if(decoded[i] != expected[i]) {
+            printf("sample %d: %ld instead of %ld (%d channels, k %d, pattern %d)\n",
+                   i, decoded[i], expected[i], number_of_channels, k, pattern);
+            failures++;
+            return;
+        }
+    }
+    // на байт меньше: сжатые данные не помещаются и за out_size ничего не пишется
+    compressed[size - 1] = GUARD;
+    if(rice_encode(ads_data, counts, number_of_channels, k, compressed, size - 1) != -1 ||
+       compressed[size - 1] != GUARD) {
+        printf("overflow not detected: %d channels, k %d, pattern %d\n", number_of_channels, k, pattern);
+        failures++;
+    }
+    // оборванные данные не декодируются
+    if(rice_decode(compressed, size - 1, counts, number_of_channels, k, decoded) != -1) {
+        printf("truncated data decoded: %d channels, k %d, pattern %d\n", number_of_channels, k, pattern);
+        failures++;
+    }
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 100;
+    static const uchar numbers_of_channels[] = {2, 8};
+    uchar sample_counts[MAX_CHANNELS];
+    long iteration;
+    uchar k;
+    int pattern;
+    int c;
+    int i;
+
+    for(iteration = 0; iteration < iterations; iteration++) {
+        for(c = 0; c < (int)sizeof(numbers_of_channels); c++) {
+            for(i = 0; i < MAX_CHANNELS; i++) {
+                sample_counts[i] = SAMPLES_PER_BATCH / dividers[(iteration + i) % sizeof(dividers)];
+            }
+            for(k = 0; k <= RICE_MAX_K; k++) {
+                for(pattern = 0; pattern < NUMBER_OF_PATTERNS; pattern++) {
+                    check(numbers_of_channels[c], sample_counts, k, (PATTERN)pattern);
+                }
+            }
+        }
+    }
+    printf("cases:    %lu (%lu escaped deltas)\n", cases, escapes);
+    printf("failures: %lu\n", failures);
+    return failures == 0 && escapes > 0 ? 0 : 1;
+}
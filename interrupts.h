@@ -10,4 +10,10 @@
 // ВСЕ прерывания должны выставлять этот флаг!
 extern volatile bool interrupt_flag;
 
+// Прерывания не умножают и не делят: dsp.c в main loop пишет операнды и читает результат MPY32 по частям,
+// и умножение в прерывании (в том числе вставленное компилятором для * и / при -mhwmult) испортило бы RES.
+// В обработчиках (PORT2/3, USCI_A0/B1, ADC, TIMER0_B0, TIMER1_A1 и вызываемых из них функциях)
+// только сложения, сдвиги и копирование. Если умножение в прерывании понадобится,
+// main loop должен выключать прерывания на время работы с MPY32
+
 #endif //INTERRUPT_H
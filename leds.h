@@ -1,7 +1,7 @@
 #ifndef LEDS_H
 #define LEDS_H
 
-#include "msp430fr2476.h"
+#include "hal.h"
 
 #define LEDS_INIT() P5REN &= ~(BIT0+BIT1); P4REN &= ~BIT7; P5DIR |= (BIT0+BIT1); P4DIR |= BIT7; P5OUT &= ~(BIT0+BIT1); P4OUT &= ~BIT7
 
@@ -1,4 +1,4 @@
-#include "msp430fr2476.h"
+#include "hal.h"
 #include <stdbool.h>
 #include "uart.h"
 #include "core_inits.h"
@@ -28,7 +28,7 @@ int main(void) {
     while(1){
         while (interrupt_flag) {
             interrupt_flag = false;
-//            acc_handle_interrupt();
+            acc_handle_interrupt();
             commands_process();
             databatch_process();
         }
@@ -0,0 +1,43 @@
+#include "hal.h"
+#include "utypes.h"
+#include "fram.h"
+#include "profiles.h"
+
+#define NULL 0
+#define PROFILE_VALID 0xA5
+
+/**
+ * Профили настроек записи (регистры ADS, делители, формат пакета, IIR фильтры, каналы ADC, store-and-forward)
+ * в FRAM: сохраняются при выключении питания, поэтому прибор стартует одной командой PROFILE_START
+ * вместо повторения всех настроек. Профиль записывается командой PROFILE_SAVE из текущих настроек
+ */
+__attribute__((persistent))
+static profile profiles[PROFILES_NUMBER] = {{0}};
+
+/**
+ * Сохраняет настройки в профиль slot (старые затираются)
+ */
+void profiles_save(uchar slot, const profile* settings) {
+    const uchar* source = (const uchar*)settings;
+    uchar* destination = (uchar*)&profiles[slot];
+    uint i;
+    if(slot >= PROFILES_NUMBER) {
+        return;
+    }
+    FRAM_WRITE_ENABLE();
+    for(i = 0; i < sizeof(profile); i++) {
+        destination[i] = source[i];
+    }
+    profiles[slot].valid = PROFILE_VALID;
+    FRAM_WRITE_DISABLE();
+}
+
+/**
+ * Профиль slot или NULL если он не сохранен
+ */
+const profile* profiles_get(uchar slot) {
+    if(slot >= PROFILES_NUMBER || profiles[slot].valid != PROFILE_VALID) {
+        return NULL;
+    }
+    return &profiles[slot];
+}
@@ -0,0 +1,31 @@
+#ifndef PROFILES_H
+#define PROFILES_H
+
+#include "utypes.h"
+#include "ads1292.h"
+#include "dsp.h"
+
+#define PROFILES_NUMBER 4
+#define PROFILE_NAME_SIZE 8
+
+/*
+ * Настройки записи которые хост иначе присылает командами перед каждым стартом
+ */
+typedef struct {
+    uchar valid;                                     // PROFILE_VALID если профиль сохранен
+    uchar name[PROFILE_NAME_SIZE];                   // для хоста, без завершающего 0
+    uchar number_of_registers;                       // регистров ADS в профиле (с ID)
+    uchar ads_registers[ADS_MAX_NUMBER_OF_REGISTERS];  // ads_registers[ADS_ID_REGISTER] - ID ADS профиля
+    uchar dividers[ADS_MAX_NUMBER_OF_CHANNELS];
+    uchar packet_format;
+    uchar rice_k;
+    uint adc_channels;                               // 0 - каналы ADC по умолчанию
+    uchar store_threshold;                           // store-and-forward, 0 - выключен
+    uchar filter_sections[ADS_MAX_NUMBER_OF_CHANNELS]; // биты включенных звеньев IIR фильтра канала
+    long filter_coefficients[ADS_MAX_NUMBER_OF_CHANNELS][DSP_MAX_BIQUADS][DSP_BIQUAD_COEFFICIENTS];
+} profile;
+
+void profiles_save(uchar slot, const profile* settings);
+const profile* profiles_get(uchar slot);
+
+#endif //PROFILES_H
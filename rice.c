@@ -0,0 +1,178 @@
+#include <stdbool.h>
+#include "utypes.h"
+#include "rice.h"
+
+/**======================== Сжатие данных ADS (дельта + Райс) ======================
+Данные каждого канала сжимаются отдельно, каналы идут друг за другом, биты пишутся старшими вперед:
+ первый sample канала - 24 бита как есть
+ каждый следующий - разность с предыдущим (по модулю 2^24) в zigzag виде u:
+   u >> k единиц, ноль, младшие k бит u (код Райса с фиксированным параметром k)
+   если (u >> k) >= RICE_ESCAPE: RICE_ESCAPE единиц и u целиком (24 бита)
+Последний байт дополняется нулями.
+
+Соседние измерения ЭКГ отличаются мало, поэтому вместо 3 байт на sample выходит 1-1.5 байта.
+Параметр k выбирается хостом под амплитуду сигнала (усиление, делители) и передается в ADS_START_RECORDING.
+Декодер написан на чистом C без железа процессора и собирается и на хосте.
+ =========================================================**/
+
+#define RICE_ESCAPE 16
+#define SAMPLE_BITS 24
+#define SAMPLE_MASK 0xFFFFFFUL
+#define SAMPLE_SIGN 0x800000UL
+
+typedef struct {
+    uchar* buffer;
+    int size;          // размер буфера в байтах
+    int position;      // сколько байт уже записано (прочитано)
+    uint byte;         // накопленные биты текущего байта
+    uchar bit_count;   // сколько бит в byte
+    bool overflow;     // вышли за пределы буфера
+} rice_stream;
+
+static void put_bits(rice_stream* stream, unsigned long value, uchar count) {
+    uchar free_bits;
+    uchar n;
+    while(count > 0) {
+        free_bits = 8 - stream->bit_count;
+        n = count < free_bits ? count : free_bits;
+        count -= n;
+        stream->byte = (stream->byte << n) | (uint)((value >> count) & ((1 << n) - 1));
+        stream->bit_count += n;
+        if(stream->bit_count == 8) {
+            if(stream->position >= stream->size) {
+                stream->overflow = true;
+                return;
+            }
+            stream->buffer[stream->position++] = (uchar)stream->byte;
+            stream->byte = 0;
+            stream->bit_count = 0;
+        }
+    }
+}
+
+static unsigned long get_bits(rice_stream* stream, uchar count) {
+    unsigned long value = 0;
+    uchar n;
+    while(count > 0) {
+        if(stream->bit_count == 0) {
+            if(stream->position >= stream->size) {
+                stream->overflow = true;
+                return 0;
+            }
+            stream->byte = stream->buffer[stream->position++];
+            stream->bit_count = 8;
+        }
+        n = count < stream->bit_count ? count : stream->bit_count;
+        count -= n;
+        stream->bit_count -= n;
+        value = (value << n) | ((stream->byte >> stream->bit_count) & ((1 << n) - 1));
+    }
+    return value;
+}
+
+static void put_delta(rice_stream* stream, unsigned long zigzag, uchar k) {
+    uchar q = RICE_ESCAPE;
+    if((zigzag >> k) < RICE_ESCAPE) {
+        q = (uchar)(zigzag >> k);
+    }
+    if(q < RICE_ESCAPE) {
+        put_bits(stream, (1UL << (q + 1)) - 2, q + 1); // q единиц и ноль
+        put_bits(stream, zigzag, k);
+    } else {
+        put_bits(stream, (1UL << RICE_ESCAPE) - 1, RICE_ESCAPE);
+        put_bits(stream, zigzag, SAMPLE_BITS);
+    }
+}
+
+static unsigned long get_delta(rice_stream* stream, uchar k) {
+    uchar q = 0;
+    while(q < RICE_ESCAPE && get_bits(stream, 1)) {
+        if(stream->overflow) {
+            return 0;
+        }
+        q++;
+    }
+    if(q == RICE_ESCAPE) {
+        return get_bits(stream, SAMPLE_BITS);
+    }
+    return ((unsigned long)q << k) | get_bits(stream, k);
+}
+
+/**
+ * Сжимает данные ADS пакета.
+ * @param ads_data данные каналов как в пакете: sample_counts[i] samples канала i по 3 байта little endian
+ * @param out_size размер out. Если сжатые данные в него не помещаются возвращается -1
+ * @return размер сжатых данных в байтах
+ */
+int rice_encode(uchar* ads_data, uchar* sample_counts, uchar number_of_channels, uchar k, uchar* out, int out_size) {
+    rice_stream stream = {out, out_size, 0, 0, 0, false};
+    unsigned long previous = 0;
+    unsigned long sample;
+    unsigned long delta;
+    uchar channel;
+    uchar i;
+    for(channel = 0; channel < number_of_channels; channel++) {
+        for(i = 0; i < sample_counts[channel]; i++) {
+            sample = ads_data[0] | ((uint)ads_data[1] << 8) | ((unsigned long)ads_data[2] << 16);
+            ads_data += 3;
+            if(i == 0) {
+                put_bits(&stream, sample, SAMPLE_BITS);
+            } else {
+                delta = (sample - previous) & SAMPLE_MASK;
+                if(delta & SAMPLE_SIGN) {
+                    put_delta(&stream, ((~delta) << 1 | 1) & SAMPLE_MASK, k);
+                } else {
+                    put_delta(&stream, delta << 1, k);
+                }
+            }
+            previous = sample;
+            if(stream.overflow) {
+                return -1;
+            }
+        }
+    }
+    if(stream.bit_count > 0) {
+        put_bits(&stream, 0, 8 - stream.bit_count);
+    }
+    if(stream.overflow) {
+        return -1;
+    }
+    return stream.position;
+}
+
+/**
+ * Восстанавливает данные ADS сжатые rice_encode().
+ * @param samples сюда кладутся sample_counts[i] значений канала i друг за другом (со знаком)
+ * @return сколько байт из in прочитано или -1 если данные оборвались
+ */
+int rice_decode(uchar* in, int in_size, uchar* sample_counts, uchar number_of_channels, uchar k, long* samples) {
+    rice_stream stream = {in, in_size, 0, 0, 0, false};
+    unsigned long sample = 0;
+    unsigned long zigzag;
+    uchar channel;
+    uchar i;
+    for(channel = 0; channel < number_of_channels; channel++) {
+        for(i = 0; i < sample_counts[channel]; i++) {
+            if(i == 0) {
+                sample = get_bits(&stream, SAMPLE_BITS);
+            } else {
+                zigzag = get_delta(&stream, k);
+                if(zigzag & 1) {
+                    sample -= (zigzag >> 1) + 1;
+                } else {
+                    sample += zigzag >> 1;
+                }
+                sample &= SAMPLE_MASK;
+            }
+            if(stream.overflow) {
+                return -1;
+            }
+            if(sample & SAMPLE_SIGN) {
+                *samples++ = (long)(sample | ~SAMPLE_MASK);
+            } else {
+                *samples++ = (long)sample;
+            }
+        }
+    }
+    return stream.position;
+}
@@ -0,0 +1,12 @@
+#ifndef RICE_H
+#define RICE_H
+
+#include "utypes.h"
+
+#define RICE_DEFAULT_K 8 // параметр Райса по умолчанию
+#define RICE_MAX_K 23
+
+int rice_encode(uchar* ads_data, uchar* sample_counts, uchar number_of_channels, uchar k, uchar* out, int out_size);
+int rice_decode(uchar* in, int in_size, uchar* sample_counts, uchar number_of_channels, uchar k, long* samples);
+
+#endif //RICE_H
@@ -1,9 +1,11 @@
-#include "msp430fr2476.h"
+#include "hal.h"
 #include <stdbool.h>
 #include "utypes.h"
 #include "leds.h"
 #include "interrupts.h"
 #include "utils.h"
+#include "handoff.h"
+#include "spi.h"
 
 /**************************************************************************
  *
@@ -30,6 +32,10 @@
 static volatile uchar* spi_rx_data;
 static volatile int spi_rx_data_size;
 
+/*---- таблица адресов куда сохранять поступающие байты (spi_read_scatter) -----*/
+static uchar** volatile spi_rx_destinations;
+static handoff* volatile spi_rx_handoff; // чтение закончено - handoff_write_end()
+
 /*---- ссылка на буфер из которого будут отправляться данные-----*/
 static volatile uchar* spi_tx_data;
 static volatile int spi_tx_data_size;
@@ -81,6 +87,31 @@ void spi_read(uchar* read_buffer, int data_size) {
     SPI_RX_INTERRUPT_DISABLE();
     SPI_TX_INTERRUPT_DISABLE();
     spi_rx_data = read_buffer;
+    spi_rx_destinations = NULL;
+    spi_rx_handoff = NULL;
+    spi_rx_data_size = data_size;
+    spi_tx_data_size = data_size;
+    transmit_available = false;
+    read_available = true;
+    UCB1IFG |= UCTXIFG;         //Trigger first Tx interrupt
+    SPI_RX_INTERRUPT_ENABLE();  // Enable Receive  interrupt
+    SPI_TX_INTERRUPT_ENABLE();  // Enable Transmit  interrupt
+}
+
+/**
+ * Неблокирующее получение data_size байт по SPI с раскладкой по адресам:
+ * i-й принятый байт сохраняется по адресу destinations[i].
+ * Так данные можно сразу класть на их место (например в пакет) и заодно менять порядок байт.
+ * Таблицу destinations нельзя изменять пока чтение не завершено (spi_transfer_finished())
+ * Когда принят последний байт, прерывание вызывает handoff_write_end(done) (если done не NULL):
+ * так писатель начавший запись данных (handoff_write_begin()) до чтения публикует их сразу после него.
+ * Можно вызывать из обработчика прерывания
+ */
+void spi_read_scatter(uchar** destinations, int data_size, handoff* done) {
+    SPI_RX_INTERRUPT_DISABLE();
+    SPI_TX_INTERRUPT_DISABLE();
+    spi_rx_destinations = destinations;
+    spi_rx_handoff = done;
     spi_rx_data_size = data_size;
     spi_tx_data_size = data_size;
     transmit_available = false;
@@ -123,9 +154,22 @@ void USCI_B1_ISR(void){
              SPI_RX_INTERRUPT_DISABLE();
          } else {
              if(read_available) {
-                 *spi_rx_data++ = ch; // положить символ в буффер для получения данных
+                 if(spi_rx_destinations != NULL) {
+                     **spi_rx_destinations++ = ch; // положить символ по его адресу из таблицы
+                 } else {
+                     *spi_rx_data++ = ch; // положить символ в буффер для получения данных
+                 }
+             }
+             if(--spi_rx_data_size <= 0) {
+                 SPI_RX_INTERRUPT_DISABLE();
+                 if(spi_rx_handoff != NULL) {
+                     handoff_write_end(spi_rx_handoff);
+                 }
+                 // будим main loop только когда приняты все данные,
+                 // пока идет обмен процессор может спать
+                 interrupt_flag = true;
+                 __low_power_mode_off_on_exit();
              }
-             spi_rx_data_size--;
          }
        break;
     case 0x04:
@@ -143,8 +187,6 @@ void USCI_B1_ISR(void){
           }
         break;
     }
-    interrupt_flag = true;
-    __low_power_mode_off_on_exit();
 }
 
 
@@ -3,10 +3,12 @@
 
 #include <stdbool.h>
 #include "utypes.h"
+#include "handoff.h"
 
 void spi_init();
 uchar spi_exchange(uchar tx_data);
 void spi_read(uchar* read_buffer, int data_size);
+void spi_read_scatter(uchar** destinations, int data_size, handoff* done);
 bool spi_transfer_finished();
 void spi_flush();
 
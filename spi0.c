@@ -1,4 +1,4 @@
-#include "msp430fr2476.h"
+#include "hal.h"
 #include <stdbool.h>
 #include "utypes.h"
 #include "interrupts.h"
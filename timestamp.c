@@ -0,0 +1,48 @@
+#include "hal.h"
+#include "utypes.h"
+#include "interrupts.h"
+#include "timestamp.h"
+
+/**
+ * Метка времени пакетов: 32-битный счетчик тактов кварца XT1 (32768 Гц, ACLK) с момента включения.
+ * Timer_A1 считает в continuous mode, старшие 16 бит добавляет прерывание переполнения (раз в 2 с),
+ * счетчик переполняется через 36 часов. Хост по меткам находит уход кварца относительно своих часов
+ * (host/clock_drift.c), номер пакета для этого не годится: он 16-битный и не знает о пропусках.
+ */
+
+static volatile uint timestamp_high;
+
+void timestamp_init() {
+    TA1CTL = TACLR;                     //Clearing the timer and stopping it
+    timestamp_high = 0;
+    TA1CTL = (TASSEL_1 + MC_2 + TAIE);  //Clocking timer from ACLK (XT1), continuous mode, overflow interrupt on
+}
+
+/**
+ * Текущее время в тактах XT1. Вызывать с выключенными прерываниями (из обработчика прерывания):
+ * переполнение которое еще не обработано учитывается по флагу TAIFG
+ */
+unsigned long timestamp_now() {
+    uint low;
+    uint high;
+    // таймер тактируется не от MCLK: читаем пока два чтения подряд не совпадут
+    do {
+        low = TA1R;
+    } while(low != TA1R);
+    high = timestamp_high;
+    if((TA1CTL & TAIFG) && low < 0x8000) { // счетчик уже перешел через 0, а прерывание еще ждет
+        high++;
+    }
+    return ((unsigned long)high << 16) | low;
+}
+
+__attribute__((interrupt(TIMER1_A1_VECTOR)))
+void TIMERA1_ISR(void){
+    switch(__even_in_range (TA1IV, 0x0E)){
+    case 0x0E:
+        timestamp_high++;                   //Overflow of the low 16 bits
+        break;
+    }
+    interrupt_flag = true;
+    __low_power_mode_off_on_exit();
+}
@@ -0,0 +1,11 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include "utypes.h"
+
+#define TIMESTAMP_HZ 32768UL // тики метки времени - такты XT1
+
+void timestamp_init();
+unsigned long timestamp_now();
+
+#endif //TIMESTAMP_H
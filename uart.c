@@ -1,9 +1,12 @@
-#include "msp430fr2476.h"
+#include "hal.h"
 #include <stdbool.h>
 #include "utypes.h"
 #include "leds.h"
 #include "interrupts.h"
 #include "utils.h"
+#include "uart.h"
+
+#define NULL 0x00
 
 /**
  * Обмен информацией через UART происходит в дуплексном режиме,
@@ -75,10 +78,29 @@
 #define UART_TX_INTERRUPT_DISABLE() (UCA0IE &= ~UCTXIE)
 
 /*------------ UART receive circular fifo buffer ------------*/
-#define UART_RX_FIFO_BUFFER_SIZE 32
-static uchar uart_rx_fifo_buffer[UART_RX_FIFO_BUFFER_SIZE];
+static uchar uart_rx_fifo_buffer[UART_RX_FIFO_SIZE];
 static volatile uint uart_rx_buffer_head;
 static volatile uint uart_rx_buffer_tail;
+static volatile uint uart_rx_overrun_counter; // сколько байт пропало потому что fifo был полон
+/*__________________________________________________*/
+
+/*------------ UART transmit queues ------------
+ * На каждый приоритет своя очередь описателей (адрес, размер) того что нужно отправить.
+ * Прерывание TX отправляет описатели друг за другом, не разрывая их,
+ * и между ними всегда сначала берет очередь с более высоким приоритетом.
+ * Так ответы на команды встают в поток между пакетами данных без ожидания в main loop
+ */
+typedef struct {
+    uchar* data;
+    uint data_size;
+    volatile uchar* sent_counter; // если не NULL, увеличивается на 1 когда все данные отправлены
+} uart_tx_descriptor;
+
+static uart_tx_descriptor uart_tx_queues[UART_NUMBER_OF_PRIORITIES][UART_TX_QUEUE_SIZE];
+static volatile uchar uart_tx_heads[UART_NUMBER_OF_PRIORITIES]; // куда добавлять (меняет только main loop)
+static volatile uchar uart_tx_tails[UART_NUMBER_OF_PRIORITIES]; // что отправлять (меняет только прерывание)
+static volatile bool uart_tx_active;   // прерывание TX включено и разбирает очереди
+static uchar uart_tx_priority;         // из какой очереди описатель который сейчас отправляется
 /*__________________________________________________*/
 
 static uchar* uart_tx_data;
@@ -109,19 +131,59 @@ void uart_init() {
     UART_RX_INTERRUPT_ENABLE();
 }
 
+static uchar uart_tx_queue_next(uchar index) {
+    if(++index >= UART_TX_QUEUE_SIZE) {
+        index = 0;
+    }
+    return index;
+}
+
 /**
 * Не блокирующая  отправка  напрямую из переданного массива.
-*  Переданный массив нельзя изменять пока все данные не будут отправлены.
-* Также в это время нельзя добавлять другие данные на отправку
-* Для работы по принципу двойной буфферизации
-* (когда есть два массива одинаковой длины -
-* один для отправку а второй в это время заполнять
+* Данные ставятся в очередь с приоритетом priority (UART_PRIORITY_HIGH / UART_PRIORITY_LOW)
+* и отправляются прерыванием целиком, не перемешиваясь с другими данными.
+* Переданный массив нельзя изменять пока все данные не будут отправлены.
+* Узнать об этом можно через sent_counter: если он не NULL,
+* прерывание увеличит его на 1 когда массив будет отправлен.
+* @return false если очередь заполнена и данные не приняты
+*/
+bool uart_transmit_queued(uchar* data, int data_size, uchar priority, volatile uchar* sent_counter) {
+    if(data_size <= 0) {
+        if(sent_counter != NULL) {
+            (*sent_counter)++;
+        }
+        return true;
+    }
+    uchar head = uart_tx_heads[priority];
+    uchar next_head = uart_tx_queue_next(head);
+    if(next_head == uart_tx_tails[priority]) { // очередь полна
+        return false;
+    }
+    uart_tx_descriptor* descriptor = &uart_tx_queues[priority][head];
+    descriptor->data = data;
+    descriptor->data_size = data_size;
+    descriptor->sent_counter = sent_counter;
+    uart_tx_heads[priority] = next_head;
+    // если прерывание TX уже разбирает очереди, оно само дойдет до этих данных,
+    // иначе запускаем его. Проверку и запуск делаем без прерываний,
+    // чтобы TX не успело выключиться между ними
+    INTERRUPTS_DISABLE();
+    if(!uart_tx_active) {
+        uart_tx_active = true;
+        UCA0IFG |= UCTXIFG;         //Triggering Tx interrupt flag
+        UART_TX_INTERRUPT_ENABLE();
+    }
+    INTERRUPTS_ENABLE();
+    return true;
+}
+
+/**
+* Не блокирующая  отправка  напрямую из переданного массива с высоким приоритетом
+* (ответы на команды и т.п.). Переданный массив нельзя изменять пока все данные не будут отправлены.
+* return false если очередь полна и данные не будут отправлены
 */
-void uart_transmit(uchar* data, int data_size) {
-    uart_tx_data = data;
-    uart_tx_data_size = data_size;
-    UCA0IFG |= UCTXIFG;         //Triggering Tx interrupt flag
-    UART_TX_INTERRUPT_ENABLE();
+bool uart_transmit(uchar* data, int data_size) {
+    return uart_transmit_queued(data, data_size, UART_PRIORITY_HIGH, NULL);
 }
 
 /**
@@ -136,29 +198,29 @@ void uart_transmit(uchar* data, int data_size) {
 //    UART_TX_BUFFER = ch;
 //}
 
-/**
- *  Waits for the transmission of outgoing uart data to complete
- */
-void uart_flush() {
-    while(uart_tx_data_size > 0);
-}
-
 void uart_rx_fifo_erase(){
-    //for(int i = 0; i < UART_RX_FIFO_BUFFER_SIZE; i++){
+    //for(int i = 0; i < UART_RX_FIFO_SIZE; i++){
     //    uart_rx_fifo_buffer[i] = 0;
     //}
     uart_rx_buffer_head=uart_rx_buffer_tail = 0;
 }
 
+/**
+ * Сколько принятых байт пропало с включения из-за того что входящий fifo был полон
+ */
+uint uart_rx_overruns() {
+    return uart_rx_overrun_counter;
+}
+
 /**
  * @return true если ассинхронная передача по UART завершены
  */
-//bool uart_transmit_finished() {
-//    if(uart_tx_data_size <= 0) {
-//        return true;
-//    }
-//    return false;
-//}
+bool uart_transmit_finished() {
+    if(uart_tx_active) {
+        return false;
+    }
+    return true;
+}
 
 /**
  * Берет элемент из входящего fifo buffer где накапливаются поступающие данные
@@ -174,13 +236,42 @@ bool uart_read(uchar* chp) {
     *chp = uart_rx_fifo_buffer[uart_rx_buffer_tail];
 
     uint next_tail = (uint) (uart_rx_buffer_tail + 1);
-    if (next_tail >= UART_RX_FIFO_BUFFER_SIZE) {
+    if (next_tail >= UART_RX_FIFO_SIZE) {
         next_tail = 0;
     }
     uart_rx_buffer_tail = next_tail;
     return true;
 }
 
+/**
+ * Вызывается из прерывания TX когда текущий описатель отправлен (или его нет).
+ * Отмечает текущий описатель отправленным и берет следующий из очереди
+ * с самым высоким приоритетом.
+ * return false если все очереди пусты
+ */
+static bool uart_tx_next_descriptor() {
+    uchar priority;
+    if(uart_tx_data != NULL) {
+        uchar tail = uart_tx_tails[uart_tx_priority];
+        volatile uchar* sent_counter = uart_tx_queues[uart_tx_priority][tail].sent_counter;
+        if(sent_counter != NULL) {
+            (*sent_counter)++;
+        }
+        uart_tx_tails[uart_tx_priority] = uart_tx_queue_next(tail);
+        uart_tx_data = NULL;
+    }
+    for(priority = 0; priority < UART_NUMBER_OF_PRIORITIES; priority++) {
+        uchar tail = uart_tx_tails[priority];
+        if(tail != uart_tx_heads[priority]) {
+            uart_tx_priority = priority;
+            uart_tx_data = uart_tx_queues[priority][tail].data;
+            uart_tx_data_size = uart_tx_queues[priority][tail].data_size;
+            return true;
+        }
+    }
+    return false;
+}
+
 //***Combined UART Rx/Tx interrupt vector***
 __attribute__((interrupt(USCI_A0_VECTOR)))
 void USCI_A0_ISR(void){
@@ -193,25 +284,33 @@ void USCI_A0_ISR(void){
             ch = UART_RX_BUFFER;
             // Проверить что uart fifo buffer не полон
             next_head = (uint) (uart_rx_buffer_head + 1);
-            if (next_head >= UART_RX_FIFO_BUFFER_SIZE) {
+            if (next_head >= UART_RX_FIFO_SIZE) {
                 next_head = 0;
             }
             if (next_head != uart_rx_buffer_tail) { // буфер неполон
                 // Положить пришедший символ в фифо буффер
                 uart_rx_fifo_buffer[uart_rx_buffer_head] = ch;
                 uart_rx_buffer_head = next_head;
+            } else {
+                uart_rx_overrun_counter++;
             }
             break;
         //Tx routine
         case 0x04:
             if (uart_tx_data_size <= 0) { // Исходящий буфер пуст
-                // Выключаем прерывание на передачу USCI
-                UART_TX_INTERRUPT_DISABLE();
-            } else {
-                UART_TX_BUFFER = *uart_tx_data++;
-                uart_tx_data_size--;
+                // будим main loop: отправленный буфер можно использовать снова
+                interrupt_flag = true;
+                __low_power_mode_off_on_exit();
+                if (!uart_tx_next_descriptor()) { // и очереди пусты
+                    // Выключаем прерывание на передачу USCI
+                    UART_TX_INTERRUPT_DISABLE();
+                    uart_tx_active = false;
+                    return;
+                }
             }
-            break;
+            UART_TX_BUFFER = *uart_tx_data++;
+            uart_tx_data_size--;
+            return; // байты внутри буфера отправляем не будя main loop
     }
     interrupt_flag = true;
     __low_power_mode_off_on_exit();
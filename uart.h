@@ -4,11 +4,30 @@
 #include <stdbool.h>
 #include "utypes.h"
 
+/*------------ приоритеты очередей на отправку ------------
+ * Описатель отправляется целиком (хост разбирает пакеты и ответы только целыми кадрами),
+ * поэтому ответ ждет конца описателя который уже идет по линии: до одного пакета данных,
+ * в худшем случае (8 каналов, все поля пакета) 722 байта - около 16 мс при 460800 бод,
+ * у двухканалки без дополнительных полей 73 байта - около 1.6 мс
+ */
+#define UART_PRIORITY_HIGH 0 // ответы на команды
+#define UART_PRIORITY_LOW  1 // пакеты с данными
+#define UART_NUMBER_OF_PRIORITIES 2
+#define UART_TX_QUEUE_SIZE 32 // описателей в очереди каждого приоритета
+
+// входящий fifo (байт): должен вмещать пачку команд которая приходит пока main loop занят пакетом.
+// Задается при сборке: -DUART_RX_FIFO_SIZE=...
+#ifndef UART_RX_FIFO_SIZE
+#define UART_RX_FIFO_SIZE 64
+#endif
+
 void uart_init();
 bool uart_read(uchar* chp);
-void uart_transmit(uchar *data, int data_size);
-void uart_flush();
+bool uart_transmit(uchar *data, int data_size);
+bool uart_transmit_queued(uchar* data, int data_size, uchar priority, volatile uchar* sent_counter);
+bool uart_transmit_finished();
 void uart_rx_fifo_erase();
+uint uart_rx_overruns();
 
 #endif //UART_H
 